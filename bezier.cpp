@@ -64,6 +64,7 @@ triangle::triangle()
 {
   a=b=c=NULL;
   aneigh=bneigh=cneigh=NULL;
+  localEpoch=0;
 #ifndef FLATTRIANGLE
   memset(ctrl,0,sizeof(ctrl));
   nocubedir=INT_MAX;
@@ -114,6 +115,44 @@ double triangle::elevation(xy pnt)
 #endif
 }
 
+void triangle::elevations(const double *x,const double *y,int n,double *z)
+/* Computes the elevations at n points, all in the triangle, whose
+ * coordinates are in separate arrays. This is the same formula as
+ * elevation, but the areas are computed directly, relative to corner a,
+ * instead of with area3, so that the loop has no calls or branches and
+ * the compiler can vectorize it. The results may differ from elevation's
+ * in the last few bits.
+ */
+{
+  int i;
+  double ax=a->east(),ay=a->north();
+  double bx=b->east()-ax,by=b->north()-ay,cx=c->east()-ax,cy=c->north()-ay;
+  double px,py,p,q,r,totarea;
+  double za=a->elev(),zb=b->elev(),zc=c->elev();
+#ifndef FLATTRIANGLE
+  double c0=ctrl[0],c1=ctrl[1],c2=ctrl[2],c3=ctrl[3],c4=ctrl[4],c5=ctrl[5],c6=ctrl[6];
+#endif
+  for (i=0;i<n;i++)
+  {
+    px=x[i]-ax;
+    py=y[i]-ay;
+    p=(bx-px)*(cy-py)-(by-py)*(cx-px);
+    q=px*cy-py*cx;
+    r=bx*py-by*px;
+    totarea=p+q+r;
+    p/=totarea;
+    q/=totarea;
+    r/=totarea;
+#ifdef FLATTRIANGLE
+    z[i]=q*zb+p*za+r*zc;
+#else
+    z[i]=q*q*q*zb+3*q*q*r*c5+3*p*q*q*c2+
+         3*q*r*r*c6+6*p*q*r*c3+3*p*p*q*c0+
+         p*p*p*za+3*p*p*r*c1+3*p*r*r*c4+r*r*r*zc;
+#endif
+  }
+}
+
 xyz triangle::gradient3(xy pnt)
 {
   double p,q,r,s,gp,gq,gr;
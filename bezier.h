@@ -94,11 +94,13 @@ public:
   std::vector<segment> subdiv;
   double peri,sarea;
   triangle *aneigh,*bneigh,*cneigh;
+  unsigned localEpoch; // set when put in pointlist::localTriangles
   double gradmat[2][3]; // to compute gradient from three partial gradients
   triangle();
   void setneighbor(triangle *neigh);
   void setnoneighbor(edge *neigh);
   double elevation(xy pnt);
+  void elevations(const double *x,const double *y,int n,double *z);
   void setgradient(xy pnt,xy grad);
   double ctrlpt(xy pnt1,xy pnt2);
   void flatten();
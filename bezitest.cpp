@@ -32,6 +32,9 @@
 #include <cstring>
 #include <QTime>
 #include "config.h"
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 #include "point.h"
 #include "cogo.h"
 #include "globals.h"
@@ -42,6 +45,7 @@
 #include "dxf.h"
 #include "measure.h"
 #include "pnezd.h"
+#include "binpoint.h"
 #include "csv.h"
 #include "angle.h"
 #include "pointlist.h"
@@ -88,6 +92,8 @@
 #include "leastsquares.h"
 #include "smooth5.h"
 #include "readtin.h"
+#include "ptin.h"
+#include "rendercache.h"
 
 #define psoutput true
 // affects only maketin
@@ -1059,6 +1065,235 @@ void testmaketinellipse()
   tassert(fabs(totallength-1329.4675)<0.001);
 }
 
+void testmaketinbig()
+/* Makes a TIN of enough points that the flipping algorithm would take
+ * a long time, and checks that every edge is Delaunay.
+ */
+{
+  int i,nondelaunay=0;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,100000);
+  rotate(doc,30);
+  doc.pl[1].maketin();
+  tassert(doc.pl[1].edges.size()==3*100000-3-doc.pl[1].convexHull().size());
+  for (i=0;i<doc.pl[1].edges.size();i++)
+    if (!doc.pl[1].edges[i].delaunay())
+      nondelaunay++;
+  cout<<nondelaunay<<" non-Delaunay edges out of "<<doc.pl[1].edges.size()<<endl;
+  tassert(nondelaunay==0);
+  doc.pl[1].maketriangles();
+  tassert(doc.pl[1].checkTinConsistency());
+}
+
+void testflipthreads()
+/* Makes a TIN by sweeping the convex hull and flipping edges, as the GUI
+ * does, with the flips done on four threads, and checks that it is
+ * the same Delaunay TIN that inserting the points makes.
+ */
+{
+  int i,passes,nondelaunay=0;
+  double inslength,fliplength;
+  xy startpnt;
+  PostScript ps;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,2000);
+  doc.pl[1].maketin("",false,4);
+  inslength=doc.pl[1].totalEdgeLength();
+  startpnt=doc.pl[1].points.begin()->second;
+  for (i=0;i<100 && doc.pl[1].tryStartPoint(ps,startpnt);i++);
+  for (passes=0;passes<100 && doc.pl[1].flipPass(ps,false,4);passes++);
+  fliplength=doc.pl[1].totalEdgeLength();
+  for (i=0;i<doc.pl[1].edges.size();i++)
+    if (!doc.pl[1].edges[i].delaunay())
+      nondelaunay++;
+  cout<<passes<<" flip passes, edge length "<<ldecimal(fliplength)<<" flipped, "<<ldecimal(inslength)<<" inserted"<<endl;
+  tassert(nondelaunay==0);
+  tassert(fabs(fliplength-inslength)<1e-6*inslength);
+}
+
+void testqindexbench()
+/* Compares the speed of finding triangles with qindex and linqindex,
+ * singly and in batches, in a TIN of 100000 points.
+ */
+{
+  int i,qtime,ltime,btime,mismatch=0;
+  vector<xy> pnts;
+  vector<triangle *> qtri,ltri,btri;
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,100000);
+  doc.pl[1].maketin();
+  doc.pl[1].maketriangles();
+  doc.pl[1].makeqindex();
+  for (i=0;i<1000000;i++)
+    pnts.push_back(xy(rng.usrandom()-32767.5,rng.usrandom()-32767.5)*(sqrt(100000)/65536));
+  starttime.start();
+  for (i=0;i<pnts.size();i++)
+    qtri.push_back(doc.pl[1].qinx.findt(pnts[i]));
+  qtime=starttime.elapsed();
+  starttime.start();
+  for (i=0;i<pnts.size();i++)
+    ltri.push_back(doc.pl[1].lqinx.findt(pnts[i]));
+  ltime=starttime.elapsed();
+  starttime.start();
+  btri=doc.pl[1].lqinx.findt(pnts);
+  btime=starttime.elapsed();
+  for (i=0;i<pnts.size();i++)
+    if (qtri[i]!=ltri[i] || qtri[i]!=btri[i])
+      mismatch++;
+  cout<<doc.pl[1].qinx.size()<<" qindex nodes, "<<doc.pl[1].lqinx.size()<<" linqindex nodes"<<endl;
+  cout<<"1000000 findt: qindex "<<qtime<<" ms, linqindex "<<ltime<<" ms, batch "<<btime<<" ms"<<endl;
+  cout<<mismatch<<" points found in different triangles"<<endl;
+  tassert(mismatch<10); // points exactly on an edge may go either way
+}
+
+void testlocalsets()
+/* Checks that setLocalSets finds every edge well inside the view, once each,
+ * that it leaves the sets alone when the view hasn't moved, and that
+ * remaking the triangles or moving the points makes the sets stale.
+ */
+{
+  int i,j,missing=0,dups=0;
+  double radius=20;
+  xy center;
+  set<edge *> edgeSet;
+  vector<edge *> lastEdges;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,20000);
+  doc.pl[1].maketin();
+  doc.pl[1].maketriangles();
+  doc.pl[1].makeqindex();
+  for (i=0;i<30;i++)
+  {
+    center=xy(rng.usrandom()-32767.5,rng.usrandom()-32767.5)/512;
+    doc.pl[1].setLocalSets(center,radius);
+    tassert(!doc.pl[1].localAll);
+    edgeSet.clear();
+    for (j=0;j<doc.pl[1].localEdges.size();j++)
+      edgeSet.insert(doc.pl[1].localEdges[j]);
+    dups+=doc.pl[1].localEdges.size()-edgeSet.size();
+    for (j=0;j<doc.pl[1].edges.size();j++)
+      if (dist(*doc.pl[1].edges[j].a,center)<radius/2 &&
+	  dist(*doc.pl[1].edges[j].b,center)<radius/2 &&
+	  !edgeSet.count(&doc.pl[1].edges[j]))
+	missing++;
+    lastEdges=doc.pl[1].localEdges;
+    doc.pl[1].setLocalSets(center,radius);
+    tassert(lastEdges==doc.pl[1].localEdges);
+  }
+  cout<<missing<<" edges missing, "<<dups<<" duplicated"<<endl;
+  tassert(missing==0);
+  tassert(dups==0);
+  doc.pl[1].setLocalSets(xy(0,0),200);
+  tassert(doc.pl[1].localAll && doc.pl[1].localEdges.empty());
+  doc.pl[1].makeqindex();
+  tassert(!doc.pl[1].localValid);
+  doc.pl[1].setLocalSets(xy(0,0),radius);
+  doc.pl[1].setEdgeLevels();
+  tassert(doc.pl[1].localValid && doc.pl[1].edgeLevelsValid);
+  doc.pl[1].maketriangles();
+  tassert(!doc.pl[1].localValid && !doc.pl[1].edgeLevelsValid);
+  doc.pl[1].setLocalSets(xy(0,0),radius);
+  doc.pl[1].setEdgeLevels();
+  doc.pl[1].roscat(xy(0,0),0,1,xy(1,0));
+  tassert(!doc.pl[1].localValid && !doc.pl[1].edgeLevelsValid);
+}
+
+void testlocalsetsbench()
+/* Times setLocalSets while panning across a TIN of 100000 points, as viewtin
+ * does on every frame, then while the view stays still.
+ */
+{
+  int i,pantime,stilltime;
+  double radius=10;
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,100000);
+  doc.pl[1].maketin();
+  doc.pl[1].maketriangles();
+  doc.pl[1].makeqindex();
+  starttime.start();
+  for (i=0;i<2000;i++)
+    doc.pl[1].setLocalSets(xy(i*0.1-100,i*0.05-50),radius);
+  pantime=starttime.elapsed();
+  starttime.start();
+  for (i=0;i<2000;i++)
+    doc.pl[1].setLocalSets(xy(0,0),radius);
+  stilltime=starttime.elapsed();
+  cout<<doc.pl[1].localEdges.size()<<" edges in view"<<endl;
+  cout<<"2000 frames: panning "<<pantime<<" ms, still "<<stilltime<<" ms"<<endl;
+  tassert(!doc.pl[1].localAll);
+}
+
+void testedgelevels()
+/* Checks that every edge longer than a given length is in the levels at or
+ * above edgeLevel of that length, and that few shorter edges are, so that
+ * drawing a huge TIN zoomed out looks at only the edges longer than a pixel.
+ */
+{
+  int i,j,lev,longer,looked,missing=0;
+  double pixel;
+  set<edge *> edgeSet;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,100000);
+  doc.pl[1].maketin();
+  doc.pl[1].setEdgeLevels();
+  tassert(doc.pl[1].edgeLevelsValid);
+  for (pixel=0.5;pixel<20;pixel*=1.5)
+  {
+    edgeSet.clear();
+    for (lev=doc.pl[1].edgeLevel(pixel);lev<doc.pl[1].edgeLevels.size();lev++)
+      for (j=0;j<doc.pl[1].edgeLevels[lev].size();j++)
+	edgeSet.insert(doc.pl[1].edgeLevels[lev][j]);
+    looked=edgeSet.size();
+    for (i=longer=0;i<doc.pl[1].edges.size();i++)
+      if (doc.pl[1].edges[i].length()>pixel)
+      {
+	longer++;
+	if (!edgeSet.count(&doc.pl[1].edges[i]))
+	  missing++;
+      }
+    cout<<"Pixel "<<ldecimal(pixel)<<": "<<longer<<" edges longer, "<<looked<<" looked at of "<<doc.pl[1].edges.size()<<endl;
+    for (i=longer=0;i<doc.pl[1].edges.size();i++)
+      if (doc.pl[1].edges[i].length()>pixel/2)
+	longer++;
+    tassert(looked<=longer);
+  }
+  tassert(missing==0);
+  doc.pl[1].makeqindex();
+  tassert(!doc.pl[1].edgeLevelsValid);
+  tassert(doc.pl[1].edgeLevel(0)==0);
+  tassert(doc.pl[1].edgeLevel(INFINITY)==doc.pl[1].edgeLevels.size());
+}
+
+void testtinbench()
+/* Times making a TIN of a million points and making its triangles.
+ * Not part of the regular tests, as it takes a minute and over a gigabyte.
+ */
+{
+  QTime starttime;
+  int tintime,tritime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  aster(doc,1000000);
+  starttime.start();
+  doc.pl[1].maketin();
+  tintime=starttime.elapsed();
+  starttime.start();
+  doc.pl[1].maketriangles();
+  tritime=starttime.elapsed();
+  cout<<doc.pl[1].points.size()<<" points, "<<doc.pl[1].edges.size()<<" edges, "<<doc.pl[1].triangles.size()<<" triangles"<<endl;
+  cout<<"maketin took "<<tintime<<" ms, maketriangles took "<<tritime<<" ms"<<endl;
+  tassert(doc.pl[1].edges.size()==3*1000000-3-doc.pl[1].convexHull().size());
+  tassert(doc.pl[1].triangles.size()==2*1000000-2-doc.pl[1].convexHull().size());
+}
+
 void testintloop()
 /* The biggest loop is
  * (1 150 104 138 169 21 217 16 9 27 49 145 151 254 226 43 58 172 200 128
@@ -1397,6 +1632,487 @@ void testtindxf()
   }
 }
 
+vector<array<xyz,3> > tileTinyTin(int n)
+/* Tiles an n×n parallelogram with the tiny TIN, a hexagon cut in four
+ * triangles. The corners are computed from integer lattice coordinates,
+ * so that corners shared by neighboring hexagons are exactly equal.
+ */
+{
+  int i,j,k,l,X,Y;
+  vector<array<xyz,3> > tiny,ret;
+  array<xyz,3> face;
+  tiny=readDxfTriangles("tinytin-bin.dxf");
+  if (tiny.size()==0)
+    tiny=readDxfTriangles("../tinytin-bin.dxf");
+  for (i=0;i<n;i++)
+    for (j=0;j<n;j++)
+      for (k=0;k<tiny.size();k++)
+      {
+	for (l=0;l<3;l++)
+	{
+	  X=lrint(tiny[k][l].getx()*2)+3*i;
+	  Y=lrint(tiny[k][l].gety()/0.866)+i+2*j;
+	  face[l]=xyz(X*0.5,Y*0.866,sin(X*0.37)+cos(Y*0.23));
+	}
+	ret.push_back(face);
+      }
+  return ret;
+}
+
+void copyBareTin(pointlist &from,pointlist &to)
+// Copies the points and triangles, but not the edges.
+{
+  int i;
+  to.clear();
+  for (i=1;i<=from.points.size();i++)
+  {
+    to.points[i]=from.points[i];
+    to.points[i].line=nullptr;
+    to.revpoints[&to.points[i]]=i;
+  }
+  to.addtriangle(from.triangles.size());
+  for (i=0;i<from.triangles.size();i++)
+  {
+    to.triangles[i].a=&to.points[from.revpoints[from.triangles[i].a]];
+    to.triangles[i].b=&to.points[from.revpoints[from.triangles[i].b]];
+    to.triangles[i].c=&to.points[from.revpoints[from.triangles[i].c]];
+    to.triangles[i].flatten();
+  }
+}
+
+void testflippass()
+/* Sweeps the convex hull, copies the triangles into two pointlists and
+ * makes their edges, flips one pass in the same order on one thread and
+ * on four, and checks that the edges are the same. (tryStartPoint starts
+ * from a random point, so the two pointlists are copied from one sweep.)
+ */
+{
+  int i,m1,m4,diff=0;
+  vector<int> order;
+  vector<edge *> todo1,todo4;
+  xy startpnt;
+  PostScript ps;
+  doc.makepointlist(3);
+  pointlist &swept=doc.pl[1],&pl1=doc.pl[2],&pl4=doc.pl[3];
+  swept.clear();
+  aster(doc,2000);
+  startpnt=swept.points.begin()->second;
+  for (i=0;i<100 && swept.tryStartPoint(ps,startpnt);i++);
+  swept.maketriangles();
+  copyBareTin(swept,pl1);
+  copyBareTin(swept,pl4);
+  pl1.makeEdges();
+  pl4.makeEdges();
+  tassert(pl1.edges.size()==pl4.edges.size());
+  order=pl1.passOrder();
+  for (i=0;i<order.size();i++)
+  {
+    todo1.push_back(&pl1.edges[order[i]]);
+    todo4.push_back(&pl4.edges[order[i]]);
+  }
+  m1=pl1.flipColored(todo1,1).size();
+  m4=pl4.flipColored(todo4,4).size();
+  for (i=0;i<pl1.edges.size();i++)
+    if (pl1.revpoints[pl1.edges[i].a]!=pl4.revpoints[pl4.edges[i].a] ||
+        pl1.revpoints[pl1.edges[i].b]!=pl4.revpoints[pl4.edges[i].b])
+      diff++;
+  cout<<m1<<" edges flipped on one thread, "<<m4<<" on four, "<<diff<<" edges differ"<<endl;
+  tassert(m1>0);
+  tassert(m1==m4);
+  tassert(diff==0);
+}
+
+void compareBareTin(int n,bool compareEdges)
+/* Makes a TIN from tiled tiny TINs, once making the edges all at once and
+ * once with makeEdges, and checks that they're the same. The convex hull
+ * starts from a random point, and the sides of the tiling are nearly
+ * straight, so how much is filled in can differ; after filling in, each TIN
+ * is checked only for consistency and for the edge count a TIN with its
+ * points and triangles must have.
+ */
+{
+  int i,j,bareTime,linkTime,oldTime;
+  pointlist &pl=doc.pl[1],oldpl;
+  vector<array<xyz,3> > faces=tileTinyTin(n);
+  QTime starttime;
+  doc.makepointlist(1);
+  starttime.start();
+  pl.makeBareTriangles(faces);
+  bareTime=starttime.elapsed();
+  tassert(pl.points.size()==2*n*n+4*n);
+  tassert(pl.triangles.size()==faces.size());
+  faces.clear();
+  faces.shrink_to_fit();
+  if (compareEdges)
+  {
+    copyBareTin(pl,oldpl);
+    oldpl.makeEdges();
+    tassert(pl.linkBareTriangles());
+    tassert(pl.edges.size()==oldpl.edges.size());
+    for (i=j=0;i<pl.edges.size() && i<oldpl.edges.size();i++)
+    {
+      edge &e0=oldpl.edges[i],&e1=pl.edges[i];
+      if (oldpl.revpoints[e0.a]!=pl.revpoints[e1.a] ||
+	  oldpl.revpoints[e0.b]!=pl.revpoints[e1.b] ||
+	  oldpl.edges.indexOf(e0.nexta)!=pl.edges.indexOf(e1.nexta) ||
+	  oldpl.edges.indexOf(e0.nextb)!=pl.edges.indexOf(e1.nextb) ||
+	  oldpl.triangles.indexOf(e0.tria)!=pl.triangles.indexOf(e1.tria) ||
+	  oldpl.triangles.indexOf(e0.trib)!=pl.triangles.indexOf(e1.trib))
+	j++;
+    }
+    cout<<j<<" edges differ from makeEdges"<<endl;
+    tassert(j==0);
+    copyBareTin(oldpl,pl);
+  }
+  copyBareTin(pl,oldpl);
+  starttime.start();
+  tassert(pl.linkBareTriangles(4));
+  linkTime=starttime.elapsed();
+  starttime.start();
+  oldpl.makeEdges();
+  oldTime=starttime.elapsed();
+  cout<<pl.triangles.size()<<" triangles, "<<pl.points.size()<<" points: makeBareTriangles "<<bareTime
+      <<" ms, linkBareTriangles "<<linkTime<<" ms, makeEdges "<<oldTime<<" ms"<<endl;
+  copyBareTin(oldpl,pl);
+  pl.fillInBareTin();
+  tassert(pl.checkTinConsistency());
+  tassert(pl.edges.size()==pl.points.size()+pl.triangles.size()-1);
+  tassert(pl.triangles.size()>=oldpl.triangles.size());
+}
+
+void testbaretin()
+/* Also checks that corners that differ only in the sign of zero are merged,
+ * keeping the first elevation.
+ */
+{
+  pointlist &pl=doc.pl[1];
+  vector<array<xyz,3> > faces(2);
+  compareBareTin(60,true);
+  faces[0][0]=xyz(0,0,1);
+  faces[0][1]=xyz(1,0,2);
+  faces[0][2]=xyz(0,1,3);
+  faces[1][0]=xyz(-0.,-0.,4);
+  faces[1][1]=xyz(0,-1,5);
+  faces[1][2]=xyz(1,0,6);
+  pl.makeBareTriangles(faces);
+  tassert(pl.points.size()==4);
+  tassert(pl.points[1].elev()==1 && pl.points[2].elev()==2);
+  tassert(pl.linkBareTriangles());
+  tassert(pl.edges.size()==5);
+}
+
+void testbaretinbench()
+// Not part of the regular tests, as it takes minutes and gigabytes.
+{
+  compareBareTin(500,false);
+}
+
+long peakMemory()
+// in KiB, or 0 if it can't be found
+{
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF,&usage)==0)
+    return usage.ru_maxrss; // in KiB on Linux
+#endif
+  return 0;
+}
+
+void testdxfstream()
+/* Reads 3DFACEs from DXF files as they're read, and checks that they're
+ * the same as reading all the group codes, then extracting the faces.
+ * Then writes a large file each way, with other entities and a layer and
+ * color on each face, and compares time and memory. The streaming reader
+ * goes first, so that its peak memory isn't hidden by the other's.
+ */
+{
+  int i,j,mode,streamTime,groupTime;
+  long mem0,mem1,mem2;
+  string filename;
+  ofstream file;
+  vector<array<xyz,3> > streamed,extracted;
+  GroupCode entity(0),layer(8),color(62),coord(10);
+  QTime starttime;
+  for (mode=0;mode<2;mode++)
+  {
+    filename=mode?"tinytin-txt.dxf":"tinytin-bin.dxf";
+    if (readDxfGroups(filename).size()==0)
+      filename="../"+filename;
+    streamed=readDxfTriangles(filename);
+    extracted=extractTriangles(readDxfGroups(filename));
+    cout<<streamed.size()<<" triangles streamed from "<<filename<<endl;
+    tassert(streamed.size()==4);
+    tassert(streamed==extracted);
+  }
+  tassert(readDxfTriangles("nonexistent.dxf").size()==0);
+  for (mode=0;mode<2;mode++)
+  {
+    filename=mode?"big-txt.dxf":"big-bin.dxf";
+    file.open(filename,ios::binary);
+    if (!mode)
+      writeDxfMagic(file);
+    layer.str="TIN";
+    for (i=0;i<100000;i++)
+    {
+      entity.str=(i%10)?"3DFACE":"POINT";
+      color.integer=i%256;
+      if (mode)
+      {
+	writeDxfText(file,entity);
+	writeDxfText(file,layer);
+	writeDxfText(file,color);
+      }
+      else
+      {
+	writeDxfBinary(file,entity);
+	writeDxfBinary(file,layer);
+	writeDxfBinary(file,color);
+      }
+      for (j=0;j<12;j++)
+      {
+	coord.tag=10+10*(j%3)+j/3;
+	coord.real=(rng.uirandom()-2147483648.)/65536;
+	if (mode)
+	  writeDxfText(file,coord);
+	else
+	  writeDxfBinary(file,coord);
+      }
+    }
+    entity.str="EOF";
+    if (mode)
+      writeDxfText(file,entity);
+    else
+      writeDxfBinary(file,entity);
+    file.close();
+    mem0=peakMemory();
+    starttime.start();
+    streamed=readDxfTriangles(filename);
+    streamTime=starttime.elapsed();
+    mem1=peakMemory();
+    starttime.start();
+    extracted=extractTriangles(readDxfGroups(filename));
+    groupTime=starttime.elapsed();
+    mem2=peakMemory();
+    cout<<filename<<": "<<streamed.size()<<" triangles streamed in "<<streamTime
+        <<" ms, peak memory +"<<mem1-mem0<<" KiB; "<<extracted.size()
+        <<" extracted from groups in "<<groupTime<<" ms, peak memory +"<<mem2-mem1<<" KiB"<<endl;
+    tassert(streamed.size()==90000);
+    tassert(streamed==extracted);
+    streamed.clear();
+    streamed.shrink_to_fit();
+    extracted.clear();
+    extracted.shrink_to_fit();
+  }
+}
+
+void writeTestPtin(pointlist &pl,string filename,int corrupt)
+/* Writes pl, which must be a TIN with triangles, as a PerfectTIN file,
+ * with a few random dots in each triangle. corrupt is 0 for a good file,
+ * 1 to make a triangle backward, 2 to botch the z-check, or 3 to cut
+ * off the end.
+ */
+{
+  int i,j,m,n;
+  map<pair<int,int>,int> hullNext;
+  map<int,int> hullTo;
+  vector<int> hull;
+  unique_ptr<CoordCheck> zc(new CoordCheck);
+  triangle *tri;
+  xyz ctr;
+  double dx,dy;
+  int corners[3];
+  ofstream file(filename,ios::binary);
+  zc->clear();
+  for (i=0;i<pl.triangles.size();i++)
+  {
+    tri=&pl.triangles[i];
+    corners[0]=pl.revpoints[tri->a];
+    corners[1]=pl.revpoints[tri->b];
+    corners[2]=pl.revpoints[tri->c];
+    for (j=0;j<3;j++)
+      hullNext[make_pair(corners[j],corners[(j+1)%3])]=i;
+  }
+  for (auto k=hullNext.begin();k!=hullNext.end();++k)
+    if (!hullNext.count(make_pair(k->first.second,k->first.first)))
+      hullTo[k->first.first]=k->first.second;
+  n=hullTo.begin()->first;
+  do
+  {
+    hull.push_back(n);
+    n=hullTo[n];
+  } while (n!=hull[0]);
+  writeleshort(file,6);
+  writeleshort(file,28);
+  writeleshort(file,496);
+  writeleshort(file,8128);
+  writeleint(file,0x28);
+  writelelong(file,0);
+  writeleint(file,4);
+  writeledouble(file,0.01);
+  writeledouble(file,1);
+  writeleint(file,pl.points.size());
+  writeleint(file,hull.size());
+  writeleint(file,pl.triangles.size());
+  for (i=1;i<=pl.points.size();i++)
+  {
+    writeledouble(file,pl.points[i].getx());
+    writeledouble(file,pl.points[i].gety());
+    writeledouble(file,pl.points[i].getz());
+  }
+  for (i=0;i<hull.size();i++)
+    writeleint(file,hull[i]);
+  for (i=0;i<pl.triangles.size();i++)
+  {
+    tri=&pl.triangles[i];
+    corners[0]=pl.revpoints[tri->a];
+    corners[1]=pl.revpoints[tri->b];
+    corners[2]=pl.revpoints[tri->c];
+    if (corrupt==1 && i==pl.triangles.size()/2)
+      swap(corners[1],corners[2]);
+    for (j=0;j<3;j++)
+      writeleint(file,corners[j]);
+    ctr=((xyz)*tri->a+(xyz)*tri->b+(xyz)*tri->c)/3;
+    m=rng.ucrandom()%8;
+    if (m==7)
+      m=255;
+    file.put(m);
+    for (j=0;j<(m==255?3:m);j++)
+    {
+      dx=(rng.usrandom()-32768)*tri->peri/1e6;
+      dy=(rng.usrandom()-32768)*tri->peri/1e6;
+      writelefloat(file,dx);
+      writelefloat(file,dy);
+      writelefloat(file,tri->elevation(xy(ctr)+xy(dx,dy))-ctr.getz());
+      *zc<<(double)(float)(tri->elevation(xy(ctr)+xy(dx,dy))-ctr.getz())+ctr.getz();
+    }
+    if (m==255)
+      writelefloat(file,NAN);
+  }
+  if (corrupt<3)
+  {
+    file.put(64);
+    for (i=0;i<64;i++)
+      writeledouble(file,(*zc)[i]+(corrupt==2 && i==5));
+  }
+}
+
+void testptin()
+/* Writes a TIN as a PerfectTIN file and reads it back, checking that the
+ * edges made all at once are the same as those makeEdges makes, and that
+ * corrupt files are caught.
+ */
+{
+  int i,j,oldtime,newtime;
+  pointlist &pl=doc.pl[1],readpl,oldpl;
+  PtinHeader header;
+  QTime starttime;
+  doc.makepointlist(1);
+  pl.clear();
+  aster(doc,20000);
+  pl.maketin();
+  pl.maketriangles();
+  writeTestPtin(pl,"test.ptin",0);
+  starttime.start();
+  header=readPtin("test.ptin",readpl,1);
+  oldtime=starttime.elapsed();
+  starttime.start();
+  header=readPtin("test.ptin",readpl,4);
+  newtime=starttime.elapsed();
+  cout<<"Read "<<readpl.triangles.size()<<" triangles in "<<oldtime<<" ms on 1 thread, "
+      <<newtime<<" ms on 4 threads; tolRatio "<<header.tolRatio<<endl;
+  tassert(header.tolRatio==4);
+  tassert(readpl.points.size()==pl.points.size());
+  tassert(readpl.triangles.size()==pl.triangles.size());
+  tassert(readpl.edges.size()==pl.edges.size());
+  tassert(readpl.checkTinConsistency());
+  // Make the edges of the same triangles one at a time, and compare.
+  for (i=1;i<=readpl.points.size();i++)
+  {
+    oldpl.points[i]=point(readpl.points[i],"");
+    oldpl.revpoints[&oldpl.points[i]]=i;
+  }
+  oldpl.addtriangle(readpl.triangles.size());
+  for (i=0;i<readpl.triangles.size();i++)
+  {
+    oldpl.triangles[i].a=&oldpl.points[readpl.revpoints[readpl.triangles[i].a]];
+    oldpl.triangles[i].b=&oldpl.points[readpl.revpoints[readpl.triangles[i].b]];
+    oldpl.triangles[i].c=&oldpl.points[readpl.revpoints[readpl.triangles[i].c]];
+    oldpl.triangles[i].flatten();
+  }
+  oldpl.makeEdges();
+  tassert(oldpl.edges.size()==readpl.edges.size());
+  for (i=j=0;i<readpl.edges.size();i++)
+  {
+    edge &e0=oldpl.edges[i],&e1=readpl.edges[i];
+    if (oldpl.revpoints[e0.a]!=readpl.revpoints[e1.a] ||
+        oldpl.revpoints[e0.b]!=readpl.revpoints[e1.b] ||
+        oldpl.edges.indexOf(e0.nexta)!=readpl.edges.indexOf(e1.nexta) ||
+        oldpl.edges.indexOf(e0.nextb)!=readpl.edges.indexOf(e1.nextb) ||
+        oldpl.triangles.indexOf(e0.tria)!=readpl.triangles.indexOf(e1.tria) ||
+        oldpl.triangles.indexOf(e0.trib)!=readpl.triangles.indexOf(e1.trib))
+      j++;
+  }
+  cout<<j<<" edges differ from makeEdges"<<endl;
+  tassert(j==0);
+  for (i=1;i<=3;i++)
+  {
+    writeTestPtin(pl,"test.ptin",i);
+    header=readPtin("test.ptin",readpl,4);
+    cout<<"Corruption "<<i<<" gives tolRatio "<<header.tolRatio<<endl;
+    tassert(header.tolRatio==(i==1?PT_BACKWARD_TRIANGLE:(i==2?PT_ZCHECK_FAIL:PT_EOF)));
+    tassert(readpl.points.size()==0 && readpl.triangles.size()==0);
+  }
+}
+
+void testcoordcheck()
+/* Puts the same values into one CoordCheck and into several, which are then
+ * merged, and checks that the sums are exactly the same. The runs start
+ * just before 2**26 and 2**39, so that blocks of every level but the last
+ * are split between CoordChecks.
+ */
+{
+  int i,j,k,n,nsplits=0;
+  size_t startAt[3]={0,((size_t)1<<26)-50000,((size_t)1<<39)-70000};
+  vector<size_t> cuts;
+  vector<double> vals;
+  unique_ptr<CoordCheck> serial(new CoordCheck),merged(new CoordCheck),part(new CoordCheck);
+  for (i=0;i<3;i++)
+  {
+    n=100000+rng.usrandom();
+    vals.clear();
+    for (j=0;j<n;j++)
+      vals.push_back((rng.usrandom()-32767.5)/256);
+    serial->clear(startAt[i]);
+    for (j=0;j<n;j++)
+      *serial<<vals[j];
+    // Cut at random, at a block boundary, and twice in the same place.
+    cuts.clear();
+    for (j=0;j<5;j++)
+      cuts.push_back(rng.uirandom()%n);
+    cuts.push_back(((startAt[i]+n/2)&~(size_t)8191)-startAt[i]);
+    cuts.push_back(cuts[0]);
+    if (startAt[i])
+      cuts.push_back(((startAt[i]+n)&~(((size_t)1<<26)-1))-startAt[i]);
+    cuts.push_back(n);
+    sort(cuts.begin(),cuts.end());
+    merged->clear(startAt[i]);
+    for (j=k=0;j<cuts.size();j++)
+    {
+      part->clear(startAt[i]+k);
+      for (;k<cuts[j];k++)
+	*part<<vals[k];
+      merged->merge(*part);
+      nsplits++;
+    }
+    tassert(merged->getCount()==serial->getCount());
+    for (j=0;j<64;j++)
+      tassert((*merged)[j]==(*serial)[j]);
+    cout<<n<<" values from "<<startAt[i]<<": sum "<<ldecimal((*serial)[63])
+        <<" serial, "<<ldecimal((*merged)[63])<<" merged"<<endl;
+  }
+  tassert(nsplits>20);
+}
+
 void testbreak0()
 {
   double leftedge,bottomedge,rightedge,topedge,conterval,totallength;
@@ -3569,9 +4285,11 @@ void testmeasure()
 void testqindex()
 {
   qindex qinx;
+  linqindex lqinx;
   int i,j,qs,ntri,size;
   triangle *ptri;
-  vector<xy> plist;
+  vector<triangle *> bonetri;
+  vector<xy> plist,bones;
   double pathlength;
   vector<qindex*> hilbertpath;
   set<triangle *> intri;
@@ -3709,6 +4427,23 @@ void testqindex()
   tassert(!ptri->in(bone1));
   tassert(qinx.findt(bone3,true));
   tassert(!qinx.findt(bone3,false));
+  lqinx.build(plist);
+  lqinx.settri(&doc.pl[1].triangles[0]);
+  printf("%d linear nodes\n",lqinx.size());
+  tassert(lqinx.size()<=qinx.size()); // qindex::split keeps some duplicate points
+  tassert(lqinx.x==qinx.x && lqinx.y==qinx.y && lqinx.side==qinx.side);
+  ptri=lqinx.findt(bone1);
+  tassert(ptri->in(bone1));
+  ptri=lqinx.findt(bone2);
+  tassert(ptri->in(bone2));
+  tassert(lqinx.findt(bone3,true));
+  tassert(!lqinx.findt(bone3,false));
+  bones.push_back(bone1);
+  bones.push_back(bone3);
+  bones.push_back(bone2);
+  bonetri=lqinx.findt(bones);
+  tassert(bonetri.size()==3);
+  tassert(bonetri[0]->in(bone1) && !bonetri[1] && bonetri[2]->in(bone2));
   printf("%d nodes\n",qinx.size());
   intri=qinx.localTriangles(xy(0,0),pow(2,(size-32767.5)/65536)*10,185);
   cout<<intri.size()<<" local triangles\n";
@@ -3782,6 +4517,109 @@ void testmakegrad()
   ps.close();
 }
 
+void testgradthreads()
+/* Computes gradients of a TIN of 100000 points on one thread and on four,
+ * which must be identical, and stopping early when they change less than
+ * 0.01, which must be close. The slopes of this surface are up to 12, so
+ * GRAD_TOLERANCE would not stop it before ten sweeps.
+ */
+{
+  int i,onetime,fourtime,toltime,mismatch=0;
+  double maxdiff=0;
+  vector<xy> grad1;
+  ptlist::iterator j;
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  setsurface(HYPAR);
+  aster(doc,100000);
+  doc.pl[1].maketin("",false,4);
+  starttime.start();
+  doc.pl[1].makegrad(0.15);
+  onetime=starttime.elapsed();
+  for (j=doc.pl[1].points.begin();j!=doc.pl[1].points.end();j++)
+    grad1.push_back(j->second.gradient);
+  starttime.start();
+  doc.pl[1].makegrad(0.15,4);
+  fourtime=starttime.elapsed();
+  for (i=0,j=doc.pl[1].points.begin();j!=doc.pl[1].points.end();i++,j++)
+    if (j->second.gradient!=grad1[i])
+      mismatch++;
+  starttime.start();
+  doc.pl[1].makegrad(0.15,4,0.01);
+  toltime=starttime.elapsed();
+  for (i=0,j=doc.pl[1].points.begin();j!=doc.pl[1].points.end();i++,j++)
+    maxdiff=max(maxdiff,dist(j->second.gradient,grad1[i]));
+  cout<<"makegrad "<<onetime<<" ms on 1 thread, "<<fourtime<<" ms on 4 threads, "
+      <<toltime<<" ms stopping early, differing by "<<maxdiff<<endl;
+  tassert(mismatch==0);
+  tassert(maxdiff>0 && maxdiff<0.01);
+}
+
+void testcritthreads()
+/* Sets the gradient and finds the critical points of a TIN of 2000 points
+ * on one thread and on four, and checks that the control points, critical
+ * points, and subdivisions of every triangle are the same.
+ */
+{
+  int i,j,onetime,fourtime,mismatch=0,ncrit=0;
+  vector<vector<double> > ctrl1;
+  vector<vector<xy> > crit1;
+  vector<vector<segment> > subdiv1;
+  vector<array<double,2> > extrema1;
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  setsurface(RUGAE);
+  aster(doc,2000);
+  doc.pl[1].maketin("",false,4);
+  doc.pl[1].makegrad(0.15,4);
+  doc.pl[1].maketriangles();
+  starttime.start();
+  doc.pl[1].setgradient(false);
+  doc.pl[1].findcriticalpts();
+  onetime=starttime.elapsed();
+  for (i=0;i<doc.pl[1].triangles.size();i++)
+  {
+    triangle &tri=doc.pl[1].triangles[i];
+    ctrl1.push_back(vector<double>(tri.ctrl,tri.ctrl+7));
+    crit1.push_back(tri.critpoints);
+    subdiv1.push_back(tri.subdiv);
+    ncrit+=tri.critpoints.size();
+  }
+  for (i=0;i<doc.pl[1].edges.size();i++)
+  {
+    array<double,2> ext={{doc.pl[1].edges[i].extrema[0],doc.pl[1].edges[i].extrema[1]}};
+    extrema1.push_back(ext);
+  }
+  starttime.start();
+  doc.pl[1].setgradient(false,4);
+  doc.pl[1].findcriticalpts(4);
+  fourtime=starttime.elapsed();
+  for (i=0;i<doc.pl[1].triangles.size();i++)
+  {
+    triangle &tri=doc.pl[1].triangles[i];
+    if (vector<double>(tri.ctrl,tri.ctrl+7)!=ctrl1[i] || tri.critpoints!=crit1[i] ||
+        tri.subdiv.size()!=subdiv1[i].size())
+      mismatch++;
+    else
+      for (j=0;j<tri.subdiv.size();j++)
+	if (tri.subdiv[j].getstart()!=subdiv1[i][j].getstart() ||
+	    tri.subdiv[j].getend()!=subdiv1[i][j].getend() ||
+	    tri.subdiv[j].startslope()!=subdiv1[i][j].startslope() ||
+	    tri.subdiv[j].endslope()!=subdiv1[i][j].endslope())
+	  mismatch++;
+  }
+  for (i=0;i<doc.pl[1].edges.size();i++)
+    for (j=0;j<2;j++)
+      if (memcmp(&doc.pl[1].edges[i].extrema[j],&extrema1[i][j],sizeof(double)))
+	mismatch++;
+  cout<<ncrit<<" critical points in "<<doc.pl[1].triangles.size()<<" triangles, "
+      <<onetime<<" ms on 1 thread, "<<fourtime<<" ms on 4 threads, "<<mismatch<<" mismatches"<<endl;
+  tassert(ncrit>0);
+  tassert(mismatch==0);
+}
+
 void testrasterdraw()
 {
   doc.makepointlist(1);
@@ -3799,6 +4637,48 @@ void testrasterdraw()
   testpointedg();
 }
 
+void testelevations()
+/* Checks that the batch elevation methods agree with elevation, and times
+ * them on a grid covering a TIN of 10000 points, part of which is outside.
+ */
+{
+  int i,j,mismatch=0,onetime,gridtime,listtime;
+  vector<xy> locations;
+  vector<double> one,grid,list;
+  xy origin(-120,-120),spacing(0.4,0.4);
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  setsurface(HYPAR);
+  aster(doc,10000);
+  doc.pl[1].maketin();
+  doc.pl[1].makegrad(0.);
+  doc.pl[1].maketriangles();
+  doc.pl[1].setgradient();
+  doc.pl[1].makeqindex();
+  for (i=0;i<600;i++)
+    for (j=0;j<600;j++)
+      locations.push_back(origin+xy(j*spacing.east(),i*spacing.north()));
+  starttime.start();
+  for (i=0;i<locations.size();i++)
+    one.push_back(doc.pl[1].elevation(locations[i]));
+  onetime=starttime.elapsed();
+  starttime.start();
+  grid=doc.pl[1].elevations(origin,spacing,600,600);
+  gridtime=starttime.elapsed();
+  starttime.start();
+  list=doc.pl[1].elevations(locations);
+  listtime=starttime.elapsed();
+  tassert(grid.size()==one.size() && list.size()==one.size());
+  for (i=0;i<one.size();i++)
+    if (std::isnan(one[i])!=std::isnan(grid[i]) || std::isnan(one[i])!=std::isnan(list[i]) ||
+        fabs(one[i]-grid[i])>1e-9 || fabs(one[i]-list[i])>1e-9)
+      mismatch++;
+  cout<<"360000 elevations: one at a time "<<onetime<<" ms, grid "<<gridtime<<" ms, list "<<listtime<<" ms"<<endl;
+  cout<<mismatch<<" mismatches"<<endl;
+  tassert(mismatch==0);
+}
+
 void test1tri(string triname,int excrits)
 {
   vector<double> xs;
@@ -3936,26 +4816,25 @@ void test1grad()
 {
   xyz grad3;
   xy pt,grad2;
-  map<int,triangle>::iterator i;
-  int j;
+  int i,j;
   vector<double> xsect,ysect;
   doc.pl[1].maketriangles();
   doc.pl[1].setgradient();
   doc.pl[1].makeqindex();
-  for (i=doc.pl[1].triangles.begin();i!=doc.pl[1].triangles.end();i++)
+  for (i=0;i<doc.pl[1].triangles.size();i++)
   {
-    pt=(*i->second.a+*i->second.b*2+*i->second.c*3)/6;
-    i->second.setgradmat();
-    grad3=i->second.gradient3(pt);
-    grad2=i->second.gradient(pt);
+    pt=(*doc.pl[1].triangles[i].a+*doc.pl[1].triangles[i].b*2+*doc.pl[1].triangles[i].c*3)/6;
+    doc.pl[1].triangles[i].setgradmat();
+    grad3=doc.pl[1].triangles[i].gradient3(pt);
+    grad2=doc.pl[1].triangles[i].gradient(pt);
     //cout<<grad3.east()<<' '<<grad3.north()<<' '<<grad3.elev()<<endl;
     cout<<"Computed gradient: "<<grad2.east()<<','<<grad2.north()<<' ';
     xsect.clear();
     ysect.clear();
     for (j=-3;j<4;j+=2)
     {
-      xsect.push_back(i->second.elevation(pt+xy(j*0.5,0)));
-      ysect.push_back(i->second.elevation(pt+xy(0,j*0.5)));
+      xsect.push_back(doc.pl[1].triangles[i].elevation(pt+xy(j*0.5,0)));
+      ysect.push_back(doc.pl[1].triangles[i].elevation(pt+xy(0,j*0.5)));
     }
     cout<<"Actual gradient: "<<deriv1(xsect)<<','<<deriv1(ysect)<<endl;
     tassert(dist(xy(deriv1(xsect),deriv1(ysect)),grad2)<1e-6);
@@ -4921,6 +5800,173 @@ void testpnezd()
   cout<<a<<endl;
 }
 
+bool samePointlists(pointlist &a,pointlist &b)
+// Checks that the numbers, coordinates, and descriptions are exactly the same.
+{
+  ptlist::iterator i,j;
+  bool ret=a.points.size()==b.points.size();
+  for (i=a.points.begin(),j=b.points.begin();ret && i!=a.points.end();i++,j++)
+    ret=i->first==j->first && i->second.east()==j->second.east() &&
+        i->second.north()==j->second.north() && i->second.elev()==j->second.elev() &&
+        i->second.note==j->second.note && b.revpoints[&j->second]==j->first;
+  return ret;
+}
+
+void makeShots(pointlist &pl,int n)
+/* Makes points like a crew's shots, with state-plane coordinates in meters,
+ * a few repeated descriptions, and gaps in the point numbers.
+ */
+{
+  int i;
+  const char *codes[]={"TOP","TOE","EP","GND","\"CL\", ditch"};
+  string desc;
+  double angle=(sqrt(5)-1)*M_PI;
+  pl.clear();
+  pl.addpoint(-5,point(500000,4000000,100,""));
+  for (i=0;i<n;i++)
+  {
+    desc=codes[i%5];
+    if (i%1000==0)
+      desc="CP "+to_string(i);
+    pl.addpoint(i+1+i/100,point(512345.678+cos(angle*i)*sqrt(i+0.5),
+				4012345.678+sin(angle*i)*sqrt(i+0.5),
+				130+i*0.001,desc));
+  }
+}
+
+int binPointsReadTime(string fname,bool binary,int threads)
+{
+  QTime starttime;
+  doc.pl[0].clear();
+  starttime.start();
+  if (binary)
+    doc.readbinpoints(fname,false,threads);
+  else
+    doc.readpnezd(fname);
+  return starttime.elapsed();
+}
+
+void binPointsBench(int n)
+{
+  int pnezdTime,binTime,binzTime,bin1Time;
+  pointlist shots;
+  ifstream file;
+  long long sizes[3];
+  makeShots(shots,n);
+  makeShots(doc.pl[0],n);
+  doc.ms.clearUnits();
+  doc.ms.addUnit(METER);
+  doc.writepnezd("points.csv");
+  doc.writebinpoints("points.bpnt");
+  doc.writebinpoints("pointsz.bpnt",true);
+  file.open("points.csv",ios::binary);
+  sizes[0]=fileSize(file);
+  file.close();
+  file.open("points.bpnt",ios::binary);
+  sizes[1]=fileSize(file);
+  file.close();
+  file.open("pointsz.bpnt",ios::binary);
+  sizes[2]=fileSize(file);
+  file.close();
+  pnezdTime=binPointsReadTime("points.csv",false,1);
+  bin1Time=binPointsReadTime("points.bpnt",true,1);
+  binTime=binPointsReadTime("points.bpnt",true,4);
+  binzTime=binPointsReadTime("pointsz.bpnt",true,4);
+  tassert(samePointlists(shots,doc.pl[0]));
+  cout<<shots.points.size()<<" points: PNEZD "<<sizes[0]<<" bytes, "<<pnezdTime<<" ms; binary "
+      <<sizes[1]<<" bytes, "<<bin1Time<<" ms on 1 thread, "<<binTime<<" ms on 4 threads; compressed "
+      <<sizes[2]<<" bytes, "<<binzTime<<" ms"<<endl;
+  tassert(sizes[2]<sizes[1]);
+}
+
+void testbinpoints()
+/* Writes points in binary, uncompressed and compressed, and reads them back,
+ * checking that they're identical. Checks that reading into a pointlist
+ * that already has points renumbers the points, and that truncated files,
+ * wrong point counts, and files of another type are caught. Compares load time with PNEZD.
+ */
+{
+  int i,n,error;
+  pointlist shots;
+  ifstream infile;
+  ofstream outfile;
+  string content;
+  doc.makepointlist(0);
+  makeShots(shots,20000);
+  for (i=0;i<2;i++)
+  {
+    makeShots(doc.pl[0],20000);
+    tassert(doc.writebinpoints("points.bpnt",i)==shots.points.size());
+    tassert(isbinpoints("points.bpnt"));
+    doc.pl[0].clear();
+    tassert(doc.readbinpoints("points.bpnt",false,4)==shots.points.size());
+    tassert(samePointlists(shots,doc.pl[0]));
+    doc.pl[0].clear();
+    doc.readbinpoints("points.bpnt",false,1);
+    tassert(samePointlists(shots,doc.pl[0]));
+    // Reading again gives the points new numbers.
+    n=doc.pl[0].points.rbegin()->first;
+    doc.readbinpoints("points.bpnt");
+    tassert(doc.pl[0].points.size()==2*shots.points.size());
+    tassert(doc.pl[0].points.rbegin()->first==n+shots.points.size()-1);
+    tassert(doc.pl[0].points[-6].note=="");
+    tassert(doc.pl[0].points[n+1].note=="CP 0");
+    infile.open("points.bpnt",ios::binary);
+    content.assign(istreambuf_iterator<char>(infile),istreambuf_iterator<char>());
+    infile.close();
+    outfile.open("points.bpnt",ios::binary);
+    outfile.write(content.data(),content.length()-1);
+    outfile.close();
+    error=0;
+    try
+    {
+      doc.readbinpoints("points.bpnt");
+    }
+    catch (BeziExcept e)
+    {
+      error=e.getNumber();
+    }
+    tassert(error==baddata);
+    // A huge point count must be caught before allocating anything.
+    content.replace(16,4,"\xff\xff\xff\x7f",4);
+    outfile.open("points.bpnt",ios::binary);
+    outfile.write(content.data(),content.length());
+    outfile.close();
+    error=0;
+    try
+    {
+      doc.readbinpoints("points.bpnt");
+    }
+    catch (BeziExcept e)
+    {
+      error=e.getNumber();
+    }
+    tassert(error==baddata);
+  }
+  doc.ms.clearUnits();
+  doc.ms.addUnit(METER);
+  doc.writepnezd("points.csv");
+  tassert(!isbinpoints("points.csv"));
+  error=0;
+  try
+  {
+    doc.readbinpoints("points.csv");
+  }
+  catch (BeziExcept e)
+  {
+    error=e.getNumber();
+  }
+  tassert(error==badheader);
+  tassert(doc.readbinpoints("nonexistent.bpnt")==-1);
+  binPointsBench(200000);
+}
+
+void testbinpointsbench()
+// Not part of the regular tests, as it takes a minute and over a gigabyte.
+{
+  binPointsBench(2000000);
+}
+
 void testldecimal()
 {
   double d;
@@ -5861,6 +6907,269 @@ void testfoldcontour()
   doc.writeXml(ofile);
 }
 
+void testcontourindex()
+/* Checks that the contour index finds the same contour starts as scanning
+ * all edges, at elevations including the corners' elevations, and that
+ * every triangle with a contour inside it is among those it finds.
+ */
+{
+  int i,j,mismatch=0,missing=0,scantime,inxtime;
+  double elev;
+  vector<double> elevs;
+  vector<vector<uintptr_t> > scanned;
+  vector<triangle *> tris;
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  doc.changeOffset(xyz(0,0,0));
+  setsurface(CIRPAR);
+  aster(doc,1000);
+  moveup(doc,-0.001);
+  doc.pl[1].maketin();
+  doc.pl[1].makegrad(0.);
+  doc.pl[1].maketriangles();
+  doc.pl[1].setgradient();
+  doc.pl[1].makeqindex();
+  doc.pl[1].findcriticalpts();
+  doc.pl[1].addperimeter();
+  for (elev=-0.1;elev<2.2;elev+=0.01)
+    elevs.push_back(elev);
+  for (i=0;i<doc.pl[1].triangles.size();i+=10)
+    elevs.push_back(doc.pl[1].triangles[i].a->elev());
+  tassert(doc.pl[1].cinx.empty());
+  starttime.start();
+  for (i=0;i<elevs.size();i++)
+    scanned.push_back(contstarts(doc.pl[1],elevs[i]));
+  scantime=starttime.elapsed();
+  starttime.start();
+  doc.pl[1].cinx.build(doc.pl[1]);
+  for (i=0;i<elevs.size();i++)
+    if (contstarts(doc.pl[1],elevs[i])!=scanned[i])
+      mismatch++;
+  inxtime=starttime.elapsed();
+  for (i=0;i<elevs.size();i+=10)
+  {
+    tris=doc.pl[1].cinx.triangles(elevs[i]);
+    for (j=0;j<doc.pl[1].triangles.size();j++)
+      if (intrace(&doc.pl[1].triangles[j],elevs[i]).size() &&
+          find(tris.begin(),tris.end(),&doc.pl[1].triangles[j])==tris.end())
+        missing++;
+  }
+  cout<<elevs.size()<<" elevations: scanning "<<scantime<<" ms, index "<<inxtime<<" ms, "
+      <<mismatch<<" different, "<<missing<<" triangles missing"<<endl;
+  tassert(mismatch==0);
+  tassert(missing==0);
+  doc.pl[1].removeperimeter();
+  tassert(doc.pl[1].cinx.empty());
+}
+
+void testroughthreads()
+/* Traces rough contours on one thread and on four, and checks that they're
+ * the same. Then removes the contours crossing some triangles and checks
+ * that retracing them puts back the same contours.
+ */
+{
+  int i,j,mismatch=0,badindex=0;
+  vector<unsigned> hashes;
+  vector<triangle *> changed;
+  vector<polyspiral> kept;
+  array<double,4> tlohi;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  doc.changeOffset(xyz(0,0,0));
+  setsurface(CIRPAR);
+  aster(doc,100);
+  moveup(doc,-0.001);
+  doc.pl[1].maketin();
+  doc.pl[1].makegrad(0.);
+  doc.pl[1].maketriangles();
+  doc.pl[1].setgradient();
+  doc.pl[1].makeqindex();
+  doc.pl[1].findcriticalpts();
+  doc.pl[1].addperimeter();
+  for (i=0;i<doc.pl[1].edges.size();i++)
+    if (doc.pl[1].edges.indexOf(&doc.pl[1].edges[i])!=i)
+      badindex++;
+  tassert(badindex==0);
+  tassert(doc.pl[1].edges.indexOf(&doc.pl[1].edges[0]-1)<0);
+  roughcontours(doc.pl[1],0.03);
+  for (i=0;i<doc.pl[1].contours.size();i++)
+    hashes.push_back(doc.pl[1].contours[i].hash());
+  roughcontours(doc.pl[1],0.03,4);
+  tassert(doc.pl[1].contours.size()==hashes.size());
+  for (i=0;i<doc.pl[1].contours.size() && i<hashes.size();i++)
+    if (doc.pl[1].contours[i].hash()!=hashes[i])
+      mismatch++;
+  cout<<hashes.size()<<" contours, "<<mismatch<<" different on four threads"<<endl;
+  tassert(mismatch==0);
+  for (i=0;i<doc.pl[1].triangles.size();i+=61)
+    changed.push_back(&doc.pl[1].triangles[i]);
+  retraceContours(doc.pl[1],0.03,changed,4);
+  tassert(doc.pl[1].contours.size()==hashes.size());
+  for (i=mismatch=0;i<doc.pl[1].contours.size() && i<hashes.size();i++)
+    if (doc.pl[1].contours[i].hash()!=hashes[i])
+      mismatch++;
+  tassert(mismatch==0);
+  for (i=0;i<doc.pl[1].contours.size();i++)
+  {
+    for (j=0;j<changed.size();j++)
+    {
+      tlohi=changed[j]->lohi();
+      if (doc.pl[1].contours[i].getElevation()>=tlohi[0] && doc.pl[1].contours[i].getElevation()<=tlohi[3])
+        break;
+    }
+    if (j==changed.size())
+      kept.push_back(doc.pl[1].contours[i]);
+  }
+  cout<<"Retracing "<<hashes.size()-kept.size()<<" contours crossing "<<changed.size()<<" triangles"<<endl;
+  tassert(kept.size()<hashes.size());
+  doc.pl[1].contours=kept;
+  retraceContours(doc.pl[1],0.03,changed);
+  tassert(doc.pl[1].contours.size()==hashes.size());
+  for (i=mismatch=0;i<doc.pl[1].contours.size() && i<hashes.size();i++)
+    if (doc.pl[1].contours[i].hash()!=hashes[i])
+      mismatch++;
+  tassert(mismatch==0);
+}
+
+void testsmooththreads()
+/* Smooths the contours of a TIN on one thread and on four, and checks
+ * that every contour comes out the same.
+ */
+{
+  int i,mismatch=0,serialtime,threadtime;
+  vector<polyspiral> rough;
+  vector<unsigned> hashes;
+  QTime starttime;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  doc.changeOffset(xyz(0,0,0));
+  setsurface(CIRPAR);
+  aster(doc,100);
+  moveup(doc,-0.001);
+  doc.pl[1].maketin();
+  doc.pl[1].makegrad(0.);
+  doc.pl[1].maketriangles();
+  doc.pl[1].setgradient();
+  doc.pl[1].makeqindex();
+  doc.pl[1].findcriticalpts();
+  doc.pl[1].addperimeter();
+  roughcontours(doc.pl[1],0.1);
+  doc.pl[1].removeperimeter();
+  rough=doc.pl[1].contours;
+  starttime.start();
+  smoothcontours(doc.pl[1],0.1,true,false,1);
+  serialtime=starttime.elapsed();
+  for (i=0;i<doc.pl[1].contours.size();i++)
+    hashes.push_back(doc.pl[1].contours[i].hash());
+  doc.pl[1].contours=rough;
+  starttime.start();
+  smoothcontours(doc.pl[1],0.1,true,false,4);
+  threadtime=starttime.elapsed();
+  tassert(doc.pl[1].contours.size()==hashes.size());
+  for (i=0;i<doc.pl[1].contours.size() && i<hashes.size();i++)
+    if (doc.pl[1].contours[i].hash()!=hashes[i])
+      mismatch++;
+  cout<<'\n'<<hashes.size()<<" contours, "<<mismatch<<" different; "<<serialtime
+      <<" ms on one thread, "<<threadtime<<" ms on four"<<endl;
+  tassert(hashes.size()>0);
+  tassert(mismatch==0);
+}
+
+bool sameRendering(vector<drawingElement> a,vector<drawingElement> b)
+{
+  int i,j,k;
+  bool ret=a.size()==b.size();
+  for (i=0;ret && i<a.size();i++)
+  {
+    ret=a[i].path.size()==b[i].path.size() && a[i].color==b[i].color;
+    for (j=0;ret && j<a[i].path.size();j++)
+      for (k=0;k<4;k++)
+	ret=ret && a[i].path[j][k]==b[i].path[j][k];
+  }
+  return ret;
+}
+
+void testrendercache()
+/* Renders contours in a RenderCache without workers and in one with two,
+ * and checks that the renderings are the same. Then moves a contour and
+ * checks that its old rendering is drawn until the new one is collected.
+ */
+{
+  int i,mismatch=0;
+  unsigned oldHash;
+  RenderCache serial,background;
+  RenderItem sri,bri;
+  doc.makepointlist(1);
+  doc.pl[1].clear();
+  doc.changeOffset(xyz(0,0,0));
+  setsurface(CIRPAR);
+  aster(doc,100);
+  moveup(doc,-0.001);
+  doc.pl[1].maketin();
+  doc.pl[1].makegrad(0.);
+  doc.pl[1].maketriangles();
+  doc.pl[1].setgradient();
+  doc.pl[1].makeqindex();
+  doc.pl[1].findcriticalpts();
+  doc.pl[1].addperimeter();
+  roughcontours(doc.pl[1],0.1);
+  doc.pl[1].removeperimeter();
+  smoothcontours(doc.pl[1],0.1,true,false);
+  background.setThreads(2);
+  serial.clearPresent();
+  background.clearPresent();
+  for (i=0;i<doc.pl[1].contours.size();i++)
+  {
+    serial.checkInObject(&doc.pl[1].contours[i],0.01,-1,i,0,0);
+    background.checkInObject(&doc.pl[1].contours[i],0.01,-1,i,0,0);
+  }
+  serial.deleteAbsent();
+  background.deleteAbsent();
+  tassert(background.queueDepth()<=doc.pl[1].contours.size());
+  background.waitIdle();
+  tassert(background.queueDepth()==0);
+  tassert(background.collectFinished());
+  tassert(!background.pending());
+  do
+  {
+    sri=serial.nextRenderItem();
+    bri=background.nextRenderItem();
+    if (sri.present!=bri.present || !sameRendering(sri.rendering,bri.rendering))
+      mismatch++;
+  } while (sri.present && bri.present);
+  cout<<doc.pl[1].contours.size()<<" contours, "<<mismatch<<" rendered differently, "
+      <<background.renderCount()<<" rendered in background, latency "
+      <<ldecimal(background.renderLatency(),0.1)<<" ms mean, "<<ldecimal(background.maxRenderLatency(),0.1)<<" ms max"<<endl;
+  tassert(doc.pl[1].contours.size()>0);
+  tassert(mismatch==0);
+  tassert(background.renderCount()==doc.pl[1].contours.size());
+  // The lowest address is the first item in the cache.
+  oldHash=doc.pl[1].contours[0].hash();
+  doc.pl[1].contours[0]._roscat(xy(0,0),0,1,xy(1,0),xy(1,0));
+  tassert(doc.pl[1].contours[0].hash()!=oldHash);
+  background.clearPresent();
+  for (i=0;i<doc.pl[1].contours.size();i++)
+    background.checkInObject(&doc.pl[1].contours[i],0.01,-1,i,0,0);
+  background.deleteAbsent();
+  bri=background.nextRenderItem();
+  tassert(bri.hash==oldHash);
+  background.waitIdle();
+  background.collectFinished();
+  background.deleteAbsent();
+  bri=background.nextRenderItem();
+  tassert(bri.hash==doc.pl[1].contours[0].hash());
+  // Objects that go away before they're rendered are dropped.
+  background.clearPresent();
+  for (i=0;i<doc.pl[1].contours.size();i++)
+    background.checkInObject(&doc.pl[1].contours[i],0.001,-1,i,0,0);
+  background.clearPresent();
+  background.deleteAbsent();
+  background.waitIdle();
+  tassert(!background.collectFinished());
+  tassert(!background.nextRenderItem().present);
+}
+
 void testtracingstop()
 /* This is a test of one triangle from Independence Park in which the tracing
  * of the contour of elevation 205.6 starts at the side and gets lost in a loop
@@ -6329,6 +7638,513 @@ void testsmooth5()
   tassert(nearestSmooth(rint((double)DEG180/SMOOTH5LIMIT))==1620000);
 }
 
+void testrefinethreads()
+/* Converts the test geolattice to a cubemap on one thread and on four,
+ * and checks that the cubemaps are the same.
+ */
+{
+  cubemap cube1,cube4;
+  double area1,area4;
+  excerptcircles.clear();
+  geo.resize(1);
+  geo[0].glat=new geolattice;
+  geo[0].glat->settest();
+  geoChanged();
+  cube1.scale=cube4.scale=1/65536.;
+  totalArea.clear();
+  dataArea.clear();
+  refineCube(cube1,3e5,0.01,1000,1e5,4,false,1);
+  area1=dataArea.total();
+  totalArea.clear();
+  dataArea.clear();
+  refineCube(cube4,3e5,0.01,1000,1e5,4,false,4);
+  area4=dataArea.total();
+  outProgress();
+  cout<<endl;
+  cout<<"Data area "<<ldecimal(area1)<<" on one thread, "<<ldecimal(area4)<<" on four"<<endl;
+  tassert(cube1.hash()==cube4.hash());
+  tassert(area1>0);
+  tassert(fabs(area1-area4)<1e-6*area1);
+  geo.clear();
+  geoChanged();
+}
+
+bool sameDouble(double a,double b)
+{
+  return memcmp(&a,&b,sizeof(double))==0;
+}
+
+void testparsedouble()
+/* Checks that parsedouble gives the same bits as stod, and throws
+ * when readdouble would.
+ */
+{
+  int i,mismatch=0;
+  vector<string> words={"0","-0","+5",".5","5.","1e","1e+","e5",".","-","abc","0x1p3",
+    "nan","inf","-inf","1e-400","1e400","0e999","12345678901234567890123",
+    "9007199254740993","0.1","-2.5E-3","3.14159265358979323846","1.0e22","1.0e23","00000001.5",
+    "0e-23","-0e-999","0.000000000000000000000000"};
+  string str;
+  char buf[32];
+  double x,ref,got;
+  bool refThrew,gotThrew;
+  for (i=0;i<100000;i++)
+  {
+    x=((double)rng.uirandom()-2147483648.)/((rng.usrandom()&255)+1)/65536;
+    switch (i%4)
+    {
+      case 0:
+	words.push_back(ldecimal(x,1/131072.));
+	break;
+      case 1:
+	snprintf(buf,sizeof(buf),"%.17g",x);
+	words.push_back(buf);
+	break;
+      case 2:
+	snprintf(buf,sizeof(buf),"%.6e",x);
+	words.push_back(buf);
+	break;
+      case 3:
+	snprintf(buf,sizeof(buf),"%.4f",x);
+	words.push_back(buf);
+	break;
+    }
+  }
+  for (i=0;i<words.size();i++)
+  {
+    str=words[i];
+    refThrew=gotThrew=false;
+    ref=got=0;
+    try
+    {
+      istringstream in(str);
+      ref=readdouble(in);
+    }
+    catch (...)
+    {
+      refThrew=true;
+    }
+    try
+    {
+      got=parsedouble(str.data(),str.data()+str.length());
+    }
+    catch (...)
+    {
+      gotThrew=true;
+    }
+    if (refThrew!=gotThrew || !(sameDouble(ref,got) || (std::isnan(ref) && std::isnan(got))))
+    {
+      mismatch++;
+      if (mismatch<10)
+	cout<<"\""<<str<<"\" read as "<<ldecimal(ref)<<(refThrew?" (threw)":"")
+	    <<" parsed as "<<ldecimal(got)<<(gotThrew?" (threw)":"")<<endl;
+    }
+  }
+  cout<<mismatch<<" of "<<words.size()<<" words parsed differently"<<endl;
+  tassert(mismatch==0);
+}
+
+void testtextgeoid()
+/* Writes a half-degree whole-earth lattice as a GSF file and as an NGA text
+ * file, then reads them with the readers and with readdouble one number
+ * at a time, checking that the results are the same and timing them.
+ */
+{
+  int i,j,ret,readtime,oldtime;
+  geolattice lat,lat1,lat2;
+  cylinterval bound;
+  ifstream file;
+  vector<int> oldundula;
+  QTime starttime;
+  bound.sbd=-DEG90;
+  bound.nbd=DEG90;
+  bound.wbd=-DEG180;
+  bound.ebd=DEG180;
+  lat.setbound(bound);
+  lat.setfineness(360,360);
+  for (i=0;i<lat.undula.size();i++)
+    lat.undula[i]=(int)rng.usrandom()*64-2097152+rng.usrandom()%64;
+  lat.setslopes();
+  writecarlsongsf(lat,"textgeoid.gsf");
+  writeusngatxt(lat,"textgeoid.grd");
+  starttime.start();
+  ret=readcarlsongsf(lat1,"textgeoid.gsf");
+  readtime=starttime.elapsed();
+  tassert(ret==2);
+  starttime.start();
+  file.open("textgeoid.gsf",ios::binary);
+  for (i=0;i<6;i++)
+    readdouble(file);
+  oldundula.resize(lat.undula.size());
+  for (i=0;i<lat.height+1;i++)
+    for (j=0;j<lat.width+1;j++)
+      oldundula[i*(lat.width+1)+j]=rint(65536*(readdouble(file)));
+  file.close();
+  oldtime=starttime.elapsed();
+  cout<<"GSF: "<<readtime<<" ms mapped, "<<oldtime<<" ms one number at a time"<<endl;
+  tassert(lat1.undula==oldundula);
+  tassert(lat1.undula==lat.undula);
+  starttime.start();
+  ret=readusngatxt(lat2,"textgeoid.grd");
+  readtime=starttime.elapsed();
+  tassert(ret==2);
+  starttime.start();
+  file.open("textgeoid.grd",ios::binary);
+  for (i=0;i<6;i++)
+    readdouble(file);
+  for (i=0;i<lat.height+1;i++)
+    for (j=0;j<lat.width+1;j++)
+      oldundula[(lat.height-i)*(lat.width+1)+j]=rint(65536*(readdouble(file)));
+  file.close();
+  oldtime=starttime.elapsed();
+  cout<<"NGA text: "<<readtime<<" ms mapped, "<<oldtime<<" ms one number at a time"<<endl;
+  tassert(lat2.undula==oldundula);
+  tassert(lat2.undula==lat.undula);
+  ofstream trunc("textgeoid.gsf",ios::binary|ios::in);
+  trunc.seekp(-40,ios::end);
+  trunc<<"x";
+  trunc.close();
+  tassert(readcarlsongsf(lat1,"textgeoid.gsf")==1);
+}
+
+void testgeoidindex()
+/* Makes twenty small geolattices scattered over the earth, one of them
+ * straddling the 180th meridian, and checks that avgelev gives the same
+ * result with the index as without.
+ */
+{
+  int i,j,k,nfinite=0,mismatch=0,polltime,inxtime;
+  int lat,lon,latsize,lonsize;
+  cylinterval bound;
+  vector<xyz> pts;
+  vector<double> polled,indexed;
+  QTime starttime;
+  geo.clear();
+  geo.resize(20);
+  for (i=0;i<geo.size();i++)
+  {
+    lat=degtobin((int)(rng.usrandom()%140)-70);
+    lon=i?degtobin((int)(rng.usrandom()%360)-180):degtobin(175);
+    latsize=degtobin(2+rng.usrandom()%10);
+    lonsize=degtobin(2+rng.usrandom()%10);
+    bound.sbd=lat-latsize;
+    bound.nbd=lat+latsize;
+    bound.wbd=lon-lonsize;
+    bound.ebd=lon+lonsize;
+    geo[i].glat=new geolattice;
+    geo[i].glat->setbound(bound);
+    geo[i].glat->setfineness(1440,1440);
+    for (j=0;j<=geo[i].glat->height;j++)
+      for (k=0;k<=geo[i].glat->width;k++)
+	geo[i].glat->undula[j*(geo[i].glat->width+1)+k]=(i+1)*65536+j*4096-k*2048;
+    geo[i].glat->setslopes();
+  }
+  geoChanged();
+  tassert(!geoinx.current());
+  for (i=0;i<100000;i++)
+  {
+    if (i&1) // near a lattice, maybe in it
+    {
+      bound=geo[i%geo.size()].boundrect();
+      lat=bound.sbd+(bound.nbd-bound.sbd)/65536*((int)rng.usrandom()*5/4-8192);
+      lon=bound.wbd+(bound.ebd-bound.wbd)/65536*((int)rng.usrandom()*5/4-8192);
+    }
+    else
+    {
+      lat=asin(rng.usrandom()/32768.-1)/M_PI*DEG180;
+      lon=(rng.usrandom()<<15)+(rng.usrandom()>>1);
+    }
+    pts.push_back(Sphere.geoc(lat,lon,0));
+  }
+  starttime.start();
+  for (i=0;i<pts.size();i++)
+    polled.push_back(avgelev(pts[i]));
+  polltime=starttime.elapsed();
+  geoinx.build(geo);
+  tassert(geoinx.current());
+  starttime.start();
+  for (i=0;i<pts.size();i++)
+    indexed.push_back(avgelev(pts[i]));
+  inxtime=starttime.elapsed();
+  for (i=0;i<pts.size();i++)
+  {
+    if (std::isfinite(polled[i]))
+      nfinite++;
+    if (!(polled[i]==indexed[i] || (std::isnan(polled[i]) && std::isnan(indexed[i]))))
+      mismatch++;
+  }
+  cout<<nfinite<<" points with undulation, "<<mismatch<<" different"<<endl;
+  cout<<"Polling all geoids: "<<polltime<<" ms; with index: "<<inxtime<<" ms"<<endl;
+  tassert(nfinite>pts.size()/4);
+  tassert(mismatch==0);
+  geo.clear();
+  geoChanged();
+  tassert(!geoinx.current());
+}
+
+void setRandomLeaves(geoquad &quad)
+// Fills the leaves with random undulations, some NaN, for testmapgeoid.
+{
+  int i;
+  if (quad.subdivided())
+    for (i=0;i<4;i++)
+      setRandomLeaves(*quad.sub[i]);
+  else if (rng.ucrandom()<16)
+    quad.und[0]=0x80000000;
+  else
+  {
+    quad.und[0]=rng.usrandom()*1000;
+    for (i=1;i<6;i++)
+      quad.und[i]=(rng.usrandom()-32768)<<i;
+  }
+}
+
+void testmapgeoid()
+/* Writes a boldatni file, then reads it and maps it, and checks that
+ * both give the same undulations.
+ */
+{
+  int i,mismatch=0,nfinite=0;
+  geoid gd,readgd;
+  cubemap mapcube;
+  geoheader hdr;
+  vball v;
+  xyz dir;
+  double u0,u1;
+  gd.ghdr=new geoheader;
+  gd.cmap=new cubemap;
+  gd.cmap->scale=1/65536.;
+  gd.ghdr->logScale=-16;
+  gd.ghdr->planet=BOL_EARTH;
+  gd.ghdr->dataType=BOL_UNDULATION;
+  gd.ghdr->encoding=BOL_VARLENGTH;
+  gd.ghdr->ncomponents=1;
+  gd.ghdr->xComponentBits=0;
+  gd.ghdr->tolerance=0.003;
+  gd.ghdr->sublimit=1000;
+  gd.ghdr->spacing=10000;
+  for (i=0;i<6;i++)
+  {
+    gd.cmap->faces[i].filldepth(i+2);
+    gd.cmap->faces[i].sub[3]->filldepth(4);
+    setRandomLeaves(gd.cmap->faces[i]);
+  }
+  writeboldatni(gd,"mapgeoid.bol");
+  tassert(readboldatni(readgd,"mapgeoid.bol")==2);
+  ifstream file("mapgeoid.bol",ios::binary);
+  hdr.readBinary(file);
+  mapcube.mapBinary("mapgeoid.bol",file.tellg());
+  mapcube.scale=ldexp(1,hdr.logScale);
+  tassert(mapcube.mapped!=nullptr);
+  for (i=0;i<100000;i++)
+  {
+    v=vball(i%6+1,xy((rng.usrandom()+0.5)/32768.-1,(rng.usrandom()+0.5)/32768.-1));
+    u0=readgd.cmap->faces[v.face-1].undulation(v.x,v.y);
+    u1=mapcube.mapped->undulation(v);
+    if (std::isfinite(u0))
+      nfinite++;
+    if (!(u0==u1 || (std::isnan(u0) && std::isnan(u1))))
+      mismatch++;
+    dir=decodedir(v);
+    u0=readgd.cmap->undulation(dir);
+    u1=mapcube.undulation(dir);
+    if (!(u0==u1 || (std::isnan(u0) && std::isnan(u1))))
+      mismatch++;
+  }
+  cout<<nfinite<<" points with undulation, "<<mismatch<<" different, "
+      <<mapcube.mapped->indexSize()<<" quads indexed"<<endl;
+  tassert(nfinite>0);
+  tassert(mismatch==0);
+  tassert(mapcube.mapped->indexSize()>6);
+  tassert(mapcube.hash()==readgd.cmap->hash());
+  tassert(mapcube.undrange()==readgd.cmap->undrange());
+  tassert(mapcube.boundrects().size()==readgd.cmap->boundrects().size());
+  tassert(mapcube.gbounds().size()==readgd.cmap->gbounds().size());
+  try
+  {
+    mapcube.match(readgd.cmap->faces[0]);
+    tassert(false);
+  }
+  catch (BeziExcept e)
+  {
+    tassert(e.getNumber()==unsetgeoid);
+  }
+  try
+  {
+    mapcube.mapBinary("mapgeoid.bol",1<<30);
+    tassert(false);
+  }
+  catch (BeziExcept e)
+  {
+    tassert(e.getNumber()==baddata);
+  }
+  tassert(mapcube.mapped!=nullptr); // a bad file leaves it unchanged
+}
+
+void testundulations()
+/* Checks that the batch undulations of a cubemap, read and mapped, and of
+ * a geolattice are the same as one at a time.
+ */
+{
+  int i,j,mismatch=0,onetime,batchtime;
+  cubemap cube,mapcube;
+  geolattice lat;
+  cylinterval bound;
+  vector<xyz> pts;
+  vector<double> batch;
+  double one;
+  QTime starttime;
+  ofstream file("undulations.bol",ios::binary);
+  cube.scale=mapcube.scale=1/65536.;
+  for (i=0;i<6;i++)
+  {
+    cube.faces[i].filldepth(5);
+    setRandomLeaves(cube.faces[i]);
+  }
+  cube.writeBinary(file);
+  file.close();
+  mapcube.mapBinary("undulations.bol",0);
+  mapcube.scale=cube.scale;
+  bound.sbd=degtobin(30);
+  bound.nbd=degtobin(40);
+  bound.wbd=degtobin(-100);
+  bound.ebd=degtobin(-85);
+  lat.setbound(bound);
+  lat.setfineness(360,360);
+  for (i=0;i<lat.undula.size();i++)
+    lat.undula[i]=(rng.usrandom()%16)?(int)rng.usrandom()*64-2097152:-2147483648;
+  lat.setslopes();
+  for (i=0;i<100000;i++)
+    if (i%3)
+      pts.push_back(Sphere.geoc(degtobin(28+rng.usrandom()/4096.),degtobin(-102+rng.usrandom()/3641.),0));
+    else
+      pts.push_back(Sphere.geoc((int)(rng.usrandom()-32768)<<14,(int)rng.usrandom()<<15,0));
+  batch=cube.undulations(pts);
+  for (i=0;i<pts.size();i++)
+  {
+    one=cube.undulation(pts[i]);
+    if (!(one==batch[i] || (std::isnan(one) && std::isnan(batch[i]))))
+      mismatch++;
+  }
+  cout<<mismatch<<" cubemap undulations different"<<endl;
+  tassert(mismatch==0);
+  mismatch=0;
+  starttime.start();
+  batch=mapcube.undulations(pts);
+  batchtime=starttime.elapsed();
+  starttime.start();
+  for (i=0;i<pts.size();i++)
+  {
+    one=mapcube.undulation(pts[i]);
+    if (!(one==batch[i] || (std::isnan(one) && std::isnan(batch[i]))))
+      mismatch++;
+  }
+  onetime=starttime.elapsed();
+  cout<<mismatch<<" mapped undulations different; "<<onetime<<" ms one at a time, "
+      <<batchtime<<" ms in a batch"<<endl;
+  tassert(mismatch==0);
+  mismatch=j=0;
+  batch=lat.elevations(pts);
+  for (i=0;i<pts.size();i++)
+  {
+    one=lat.elev(pts[i]);
+    if (std::isfinite(one))
+      j++;
+    if (!(one==batch[i] || (std::isnan(one) && std::isnan(batch[i]))))
+      mismatch++;
+  }
+  cout<<mismatch<<" lattice undulations different, "<<j<<" finite"<<endl;
+  tassert(mismatch==0);
+  tassert(j>pts.size()/5);
+}
+
+void testleafcache()
+/* Queries many points within a few kilometers, one at a time, and checks
+ * that the leaf cache answers most of them and gives the same undulations
+ * as descending from the face.
+ */
+{
+  int i,mismatch=0,cachetime,descendtime;
+  long long hits,misses;
+  cubemap cube,mapcube;
+  vector<xyz> pts;
+  vector<vball> vpts;
+  vball v;
+  geoquad *leaf;
+  double x,y,u0,u1,sum=0;
+  QTime starttime;
+  ofstream file("leafcache.bol",ios::binary);
+  xyz site=Sphere.geoc(degtobin(35.6),degtobin(-82.55),0);
+  cube.scale=mapcube.scale=1/65536.;
+  for (i=0;i<6;i++)
+    cube.faces[i].filldepth(3);
+  v=encodedir(site);
+  for (i=0;i<9;i++)
+  { // leaves near the site are about 2 km
+    x=v.x;
+    y=v.y;
+    cube.faces[v.face-1].leaf(x,y)->subdivide();
+  }
+  for (i=0;i<6;i++)
+    setRandomLeaves(cube.faces[i]);
+  cube.writeBinary(file);
+  file.close();
+  mapcube.mapBinary("leafcache.bol",0);
+  mapcube.scale=cube.scale;
+  for (i=0;i<100000;i++)
+  {
+    pts.push_back(Sphere.geoc(degtobin(35.6+(rng.usrandom()-32768)/1638400.),
+                              degtobin(-82.55+(rng.usrandom()-32768)/1310720.),0));
+    vpts.push_back(encodedir(pts.back()));
+  }
+  leafCacheHits=leafCacheMisses=0;
+  for (i=0;i<pts.size();i++)
+  {
+    u0=cube.faces[vpts[i].face-1].undulation(vpts[i].x,vpts[i].y)*cube.scale;
+    u1=cube.undulation(pts[i]);
+    if (!(u0==u1 || (std::isnan(u0) && std::isnan(u1))))
+      mismatch++;
+  }
+  for (i=0;i<pts.size();i++)
+  {
+    u0=mapcube.mapped->undulation(vpts[i])*mapcube.scale;
+    u1=mapcube.undulation(pts[i]);
+    if (!(u0==u1 || (std::isnan(u0) && std::isnan(u1))))
+      mismatch++;
+  }
+  hits=leafCacheHits;
+  misses=leafCacheMisses;
+  cout<<mismatch<<" cached undulations different; "<<hits<<" hits, "<<misses<<" misses"<<endl;
+  tassert(mismatch==0);
+  tassert(hits+misses==2*pts.size());
+  tassert(hits>19*misses);
+  starttime.start();
+  for (i=0;i<pts.size();i++)
+    sum+=mapcube.mapped->undulation(encodedir(pts[i]));
+  descendtime=starttime.elapsed();
+  starttime.start();
+  for (i=0;i<pts.size();i++)
+    sum+=mapcube.undulation(pts[i]);
+  cachetime=starttime.elapsed();
+  cout<<"Mapped: "<<descendtime<<" ms descending, "<<cachetime<<" ms cached"<<endl;
+  /* Change the leaf at the site. Until uncache is called, the cache
+   * still has the old undulation.
+   */
+  v=encodedir(site);
+  x=v.x;
+  y=v.y;
+  leaf=cube.faces[v.face-1].leaf(x,y);
+  for (i=0;i<6;i++)
+    leaf->und[i]=i*65536;
+  cube.uncache();
+  u0=cube.undulation(site);
+  leaf->und[0]+=65536;
+  tassert(cube.undulation(site)==u0);
+  cube.uncache();
+  tassert(cube.undulation(site)==cube.faces[v.face-1].undulation(v.x,v.y)*cube.scale);
+  tassert(cube.undulation(site)!=u0);
+}
+
 void testquadhash()
 {
   int i,j,l,lastang=-1,hash,qsz=16;
@@ -6808,6 +8624,7 @@ void testgeoidboundary()
   excerptcircles.push_back(c);
   geo.clear();
   geo.push_back(gd);
+  geoChanged();
   outgd.ghdr=new geoheader;
   outgd.cmap=new cubemap;
   outgd.cmap->scale=1/65536.;
@@ -6920,6 +8737,7 @@ void testvballgeoid()
   }
   geo.clear();
   geo.push_back(gd);
+  geoChanged();
   outgd.ghdr=new geoheader;
   outgd.cmap=new cubemap;
   outgd.cmap->scale=1/65536.;
@@ -7235,6 +9053,7 @@ void testgeoid()
   geo.resize(1);
   geo[0].glat=new geolattice;
   geo[0].glat->settest();
+  geoChanged();
   for (i=0;i<5;i++)
     for (j=0;j<5;j++)
     {
@@ -7870,12 +9689,36 @@ int main(int argc, char *argv[])
     testmaketinwheel();
   if (shoulddo("maketinellipse"))
     testmaketinellipse();
+  if (shoulddo("maketinbig"))
+    testmaketinbig();
+  if (shoulddo("flipthreads"))
+    testflipthreads();
+  if (shoulddo("flippass"))
+    testflippass();
+  if (shoulddo("qindexbench"))
+    testqindexbench();
+  if (shoulddo("localsetsbench"))
+    testlocalsetsbench();
+  if (shoulddo("tinbench"))
+    testtinbench();
   if (shoulddo("intloop"))
     testintloop();
   if (shoulddo("tripolygon"))
     testtripolygon();
+  if (shoulddo("edgelevels"))
+    testedgelevels();
   if (shoulddo("tindxf"))
     testtindxf();
+  if (shoulddo("dxfstream"))
+    testdxfstream();
+  if (shoulddo("baretin"))
+    testbaretin();
+  if (shoulddo("baretinbench"))
+    testbaretinbench();
+  if (shoulddo("ptin"))
+    testptin();
+  if (shoulddo("coordcheck"))
+    testcoordcheck();
   if (shoulddo("break0"))
     testbreak0();
   if (shoulddo("brent"))
@@ -7914,8 +9757,14 @@ int main(int argc, char *argv[])
     testclosest();
   if (shoulddo("qindex"))
     testqindex();
+  if (shoulddo("localsets"))
+    testlocalsets();
   if (shoulddo("makegrad"))
     testmakegrad();
+  if (shoulddo("gradthreads"))
+    testgradthreads();
+  if (shoulddo("critthreads"))
+    testcritthreads();
   if (shoulddo("derivs"))
     testderivs();
   if (shoulddo("trianglecontours"))
@@ -7925,7 +9774,9 @@ int main(int argc, char *argv[])
     testparabinter();
 #endif
   if (shoulddo("rasterdraw"))
-    testrasterdraw(); // 2 s
+    testrasterdraw();
+  if (shoulddo("elevations"))
+    testelevations(); // 2 s
   if (shoulddo("dirbound"))
     testdirbound();
   if (shoulddo("stl"))
@@ -7946,6 +9797,10 @@ int main(int argc, char *argv[])
     testcsvline();
   if (shoulddo("pnezd"))
     testpnezd();
+  if (shoulddo("binpoints"))
+    testbinpoints();
+  if (shoulddo("binpointsbench"))
+    testbinpointsbench();
   if (shoulddo("ldecimal"))
     testldecimal();
   if (shoulddo("ellipsoid"))
@@ -7964,6 +9819,14 @@ int main(int argc, char *argv[])
     testzigzagcontour();
   if (shoulddo("tracingstop"))
     testtracingstop();
+  if (shoulddo("contourindex"))
+    testcontourindex();
+  if (shoulddo("roughthreads"))
+    testroughthreads();
+  if (shoulddo("smooththreads"))
+    testsmooththreads();
+  if (shoulddo("rendercache"))
+    testrendercache();
   if (shoulddo("roscat"))
     testroscat();
   if (shoulddo("absorient"))
@@ -7978,6 +9841,20 @@ int main(int argc, char *argv[])
     testsmooth5();
   if (shoulddo("quadhash"))
     testquadhash(); // 8 s
+  if (shoulddo("refinethreads"))
+    testrefinethreads();
+  if (shoulddo("mapgeoid"))
+    testmapgeoid();
+  if (shoulddo("geoidindex"))
+    testgeoidindex();
+  if (shoulddo("undulations"))
+    testundulations();
+  if (shoulddo("leafcache"))
+    testleafcache();
+  if (shoulddo("parsedouble"))
+    testparsedouble();
+  if (shoulddo("textgeoid"))
+    testtextgeoid();
   if (shoulddo("smallcircle"))
     testsmallcircle();
   if (shoulddo("cylinterval"))
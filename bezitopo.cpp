@@ -33,6 +33,7 @@
 #include "tin.h"
 #include "measure.h"
 #include "pnezd.h"
+#include "binpoint.h"
 #include "angle.h"
 #include "pointlist.h"
 #include "vcurve.h"
@@ -47,6 +48,7 @@
 #include "contour.h"
 #include "geoid.h"
 #include "ldecimal.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -123,12 +125,12 @@ void indpark(string args)
   doc.copytopopoints(1,0);
   //doc.changeOffset(xyz(443392,164096,208));
   doc.pl[1].maketin("bezitopo.ps");
-  doc.pl[1].makegrad(0.15);
+  doc.pl[1].makegrad(0.15,defaultThreads(),GRAD_TOLERANCE);
   doc.pl[1].maketriangles();
-  doc.pl[1].setgradient(false);
+  doc.pl[1].setgradient(false,defaultThreads());
   checkedgediscrepancies(doc.pl[1]);
   doc.pl[1].makeqindex();
-  doc.pl[1].findcriticalpts();
+  doc.pl[1].findcriticalpts(defaultThreads());
   doc.pl[1].addperimeter();
   w=doc.pl[1].dirbound(degtobin(0));
   s=doc.pl[1].dirbound(degtobin(90));
@@ -140,9 +142,9 @@ void indpark(string args)
    */
   rasterdraw(doc.pl[1],xy(443482.5,164115.5)-(xy)doc.offset,0.25,0.35,1000,0,10,"IPmicro.ppm");
   rasterdraw(doc.pl[1],xy(443482.5,164115.5)-(xy)doc.offset,7,7,100,0,10,"IPmini.ppm");
-  roughcontours(doc.pl[1],0.1);
+  roughcontours(doc.pl[1],0.1,defaultThreads());
   doc.pl[1].removeperimeter();
-  smoothcontours(doc.pl[1],0.1);
+  smoothcontours(doc.pl[1],0.1,true,false,defaultThreads());
   ps.open("IndependencePark.ps");
   ps.setpaper(papersizes["A4 landscape"],0);
   ps.prolog();
@@ -191,34 +193,54 @@ void indpark(string args)
 vector<command> commands;
 
 void readpoints(string args)
+// A binary point file is recognized whatever format is given.
 {
   string filename,format;
   filename=trim(firstarg(args));
   format=trim(args);
-  if (format=="pnezd" || format=="")
+  if (isbinpoints(filename))
+  {
+    try
+    {
+      doc.readbinpoints(filename,false,defaultThreads());
+    }
+    catch(BeziExcept e)
+    {
+      cout<<"Binary point file is corrupt."<<endl;
+    }
+  }
+  else if (format=="pnezd" || format=="")
     doc.readpnezd(filename,false);
   else if (format=="penzd")
     doc.readpenzd(filename,false);
   else
-    cout<<"Formats: pnezd (default), penzd"<<endl;
+    cout<<"Formats: pnezd (default), penzd, bin"<<endl;
 }
 
 void writepoints(string args)
+// If the filename ends in .bpnt, the default format is bin.
 {
   string filename,format;
   filename=trim(firstarg(args));
   format=trim(args);
+  if (format=="" && filename.length()>5 && filename.substr(filename.length()-5)==".bpnt")
+    format="bin";
   if (format=="pnezd" || format=="")
     doc.writepnezd(filename);
   else if (format=="penzd")
     doc.writepenzd(filename);
+  else if (format=="bin")
+    doc.writebinpoints(filename);
+  else if (format=="binz")
+    doc.writebinpoints(filename,true);
   else
-    cout<<"Formats: pnezd (default), penzd"<<endl;
+    cout<<"Formats: pnezd (default), penzd, bin, binz (compressed)"<<endl;
 }
 
 void maketin_i(string args)
+// args is the number of threads; if missing, one per core.
 {
-  int error=0;
+  int error=0,threads=defaultThreads();
   //criteria crit;
   criterion crit1;
   doc.makepointlist(1);
@@ -227,9 +249,14 @@ void maketin_i(string args)
   doc.pl[1].crit.clear();
   doc.pl[1].crit.push_back(crit1); // will later make a point-selection command
   doc.copytopopoints(1,0);
+  args=trim(args);
+  if (args.length())
+    threads=atoi(args.c_str());
+  if (threads<1)
+    threads=1;
   try
   {
-    doc.pl[1].maketin("maketin.ps");
+    doc.pl[1].maketin("maketin.ps",false,threads);
   }
   catch(BeziExcept e)
   {
@@ -248,9 +275,9 @@ void maketin_i(string args)
       break;
     default:
       cout<<"Successfully made TIN."<<endl;
-      doc.pl[1].makegrad(0.15);
+      doc.pl[1].makegrad(0.15,threads,GRAD_TOLERANCE);
       doc.pl[1].maketriangles();
-      doc.pl[1].setgradient(false);
+      doc.pl[1].setgradient(false,threads);
       doc.pl[1].makeqindex();
   }
 }
@@ -333,11 +360,11 @@ void contourdraw_i(string args)
   if (conterval>5e-6 && conterval<1e5)
     if (doc.pl.size()>1 && doc.pl[1].edges.size())
     {
-      doc.pl[1].findcriticalpts();
+      doc.pl[1].findcriticalpts(defaultThreads());
       doc.pl[1].addperimeter();
-      roughcontours(doc.pl[1],conterval);
+      roughcontours(doc.pl[1],conterval,defaultThreads());
       doc.pl[1].removeperimeter();
-      smoothcontours(doc.pl[1],conterval,true,true);
+      smoothcontours(doc.pl[1],conterval,true,true,defaultThreads());
       w=doc.pl[1].dirbound(degtobin(0));
       s=doc.pl[1].dirbound(degtobin(90));
       e=-doc.pl[1].dirbound(degtobin(180));
@@ -396,7 +423,9 @@ void save_i(string args)
 }
 
 void readgeoid_i(string args)
-// Attempting to read a non-geoid file leaves the geoid unchanged.
+/* Attempting to read a non-geoid file leaves the geoid unchanged.
+ * The file is mapped, not read, so only the part needed is decoded.
+ */
 {
   string geoidfilename;
   args=trim(args);
@@ -408,8 +437,8 @@ void readgeoid_i(string args)
     {
       ifstream geofile(geoidfilename,ios::binary);
       ghead.readBinary(geofile);
+      cube.mapBinary(geoidfilename,geofile.tellg());
       cube.scale=pow(2,ghead.logScale);
-      cube.readBinary(geofile);
       cout<<"read "<<geoidfilename<<endl;
       //ofstream geodump("readgeoid.dump");
       //cube.dump(geodump);
@@ -423,6 +452,20 @@ void readgeoid_i(string args)
     cout<<"No filename specified"<<endl;
 }
 
+void geoidcache_i(string args)
+/* Shows how many undulation queries were answered from the leaf cache.
+ * "geoidcache reset" zeroes the counts.
+ */
+{
+  long long hits=leafCacheHits,misses=leafCacheMisses;
+  cout<<hits<<" hits, "<<misses<<" misses";
+  if (hits+misses)
+    cout<<", "<<ldecimal(100.*hits/(hits+misses),0.1)<<"% hit";
+  cout<<endl;
+  if (trim(args)=="reset")
+    leafCacheHits=leafCacheMisses=0;
+}
+
 void help(string args)
 {
   int i;
@@ -449,10 +492,11 @@ int main(int argc, char *argv[])
   commands.push_back(command("setlunit",setlengthunit_i,"Set length unit: m, ft, ch"));
   commands.push_back(command("cvtmeas",cvtmeas_i,"Convert measurements"));
   commands.push_back(command("geoid",readgeoid_i,"Read geoid file: filename"));
+  commands.push_back(command("geoidcache",geoidcache_i,"Show geoid leaf cache hits and misses: [reset]"));
   commands.push_back(command("read",readpoints,"Read coordinate file: filename format"));
   commands.push_back(command("write",writepoints,"Write coordinate file: filename format"));
   commands.push_back(command("save",save_i,"Write scene file: filename.bez"));
-  commands.push_back(command("maketin",maketin_i,"Make triangulated irregular network"));
+  commands.push_back(command("maketin",maketin_i,"Make triangulated irregular network: threads"));
   commands.push_back(command("drawtin",drawtin_i,"Draw TIN: filename.ps"));
   commands.push_back(command("raster",rasterdraw_i,"Draw raster topo: filename.ppm"));
   commands.push_back(command("contour",contourdraw_i,"Draw contour topo: interval filename.ps"));
@@ -66,6 +66,7 @@
 #include <bezitopo/ps.h>
 #include <bezitopo/contour.h>
 #include <bezitopo/pnezd.h>
+#include <bezitopo/binpoint.h>
 #include <bezitopo/penwidth.h>
 #include <bezitopo/layer.h>
 #include <bezitopo/objlist.h>
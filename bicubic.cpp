@@ -48,9 +48,8 @@ double beziersquare(array<double,16> controlPoints,double x,double y)
   return ret;
 }
 
-double bicubic(double swelev,xy swslope,double seelev,xy seslope,
-	       double nwelev,xy nwslope,double neelev,xy neslope,
-	       double x,double y)
+array<double,16> bicubicControls(double swelev,xy swslope,double seelev,xy seslope,
+	       double nwelev,xy nwslope,double neelev,xy neslope)
 // The slopes assume a unit square.
 {
   array<double,16> controlPoints;
@@ -70,5 +69,12 @@ double bicubic(double swelev,xy swslope,double seelev,xy seslope,
   controlPoints[ 6]=controlPoints[ 2]+controlPoints[ 7]-controlPoints[ 3];
   controlPoints[ 9]=controlPoints[13]+controlPoints[ 8]-controlPoints[12];
   controlPoints[10]=controlPoints[14]+controlPoints[11]-controlPoints[15];
-  return beziersquare(controlPoints,x,y);
+  return controlPoints;
+}
+
+double bicubic(double swelev,xy swslope,double seelev,xy seslope,
+	       double nwelev,xy nwslope,double neelev,xy neslope,
+	       double x,double y)
+{
+  return beziersquare(bicubicControls(swelev,swslope,seelev,seslope,nwelev,nwslope,neelev,neslope),x,y);
 }
@@ -29,6 +29,8 @@
 #include "xyz.h"
 
 double beziersquare(std::array<double,16> controlPoints,double x,double y);
+std::array<double,16> bicubicControls(double swelev,xy swslope,double seelev,xy seslope,
+	       double nwelev,xy nwslope,double neelev,xy neslope);
 double bicubic(double swelev,xy swslope,double seelev,xy seslope,
 	       double nwelev,xy nwslope,double neelev,xy neslope,
 	       double x,double y);
@@ -22,8 +22,15 @@
  * <http://www.gnu.org/licenses/>.
  */
 #include <cstring>
+#include <iterator>
 #include "binio.h"
 #include "config.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -250,6 +257,56 @@ double readledouble(std::istream &file)
   return *(double *)buf;
 }
 
+short readleshort(const char *buf)
+{
+  short ret;
+  memcpy(&ret,buf,2);
+#ifdef BIGENDIAN
+  endianflip(&ret,2);
+#endif
+  return ret;
+}
+
+int readleint(const char *buf)
+{
+  int ret;
+  memcpy(&ret,buf,4);
+#ifdef BIGENDIAN
+  endianflip(&ret,4);
+#endif
+  return ret;
+}
+
+long long readlelong(const char *buf)
+{
+  long long ret;
+  memcpy(&ret,buf,8);
+#ifdef BIGENDIAN
+  endianflip(&ret,8);
+#endif
+  return ret;
+}
+
+float readlefloat(const char *buf)
+{
+  float ret;
+  memcpy(&ret,buf,4);
+#ifdef BIGENDIAN
+  endianflip(&ret,4);
+#endif
+  return ret;
+}
+
+double readledouble(const char *buf)
+{
+  double ret;
+  memcpy(&ret,buf,8);
+#ifdef BIGENDIAN
+  endianflip(&ret,8);
+#endif
+  return ret;
+}
+
 void writegeint(std::ostream &file,int i)
 /* Numbers in Bezitopo's geoid files are in 65536ths of a meter and are less than 110 m
  * (7208960) in absolute value. They are encoded as follows:
@@ -424,3 +481,53 @@ string readustring(istream &file)
   } while (ch>0);
   return ret;
 }
+
+mappedfile::mappedfile(string filename)
+{
+  start=nullptr;
+  len=0;
+  mapAddress=nullptr;
+#ifdef HAVE_SYS_MMAN_H
+  int fd;
+  struct stat st;
+  fd=open(filename.c_str(),O_RDONLY);
+  if (fd>=0 && fstat(fd,&st)==0 && st.st_size>0)
+  {
+    mapAddress=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (mapAddress==MAP_FAILED)
+      mapAddress=nullptr;
+    else
+    {
+      start=static_cast<const char *>(mapAddress);
+      len=st.st_size;
+    }
+  }
+  if (fd>=0)
+    close(fd);
+#endif
+  if (!mapAddress)
+  {
+    ifstream file(filename,ios::binary);
+    buffer.assign(istreambuf_iterator<char>(file),istreambuf_iterator<char>());
+    start=buffer.data();
+    len=buffer.size();
+  }
+}
+
+mappedfile::~mappedfile()
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (mapAddress)
+    munmap(mapAddress,len);
+#endif
+}
+
+const char *mappedfile::data()
+{
+  return start;
+}
+
+size_t mappedfile::size()
+{
+  return len;
+}
@@ -21,8 +21,11 @@
  * and Lesser General Public License along with Bezitopo. If not, see
  * <http://www.gnu.org/licenses/>.
  */
+#ifndef BINIO_H
+#define BINIO_H
 #include <fstream>
 #include <string>
+#include <vector>
 
 #define FP_IEEE 754
 /* Used in the header of transmer.dat.
@@ -55,8 +58,33 @@ void writebedouble(std::ostream &file,double f);
 void writeledouble(std::ostream &file,double f);
 double readbedouble(std::istream &file);
 double readledouble(std::istream &file);
+short readleshort(const char *buf); // for mapped files
+int readleint(const char *buf);
+long long readlelong(const char *buf);
+float readlefloat(const char *buf);
+double readledouble(const char *buf);
 void writegeint(std::ostream &file,int i); // for Bezitopo's geoid files
 int readgeint(std::istream &file);
 void writeustring(std::ostream &file,std::string s);
 std::string readustring(std::istream &file);
 
+class mappedfile
+/* A file mapped into memory for reading. If it can't be mapped, it's read
+ * into memory. If it can't be opened, it's empty.
+ */
+{
+public:
+  mappedfile(std::string filename);
+  ~mappedfile();
+  mappedfile(const mappedfile &b)=delete;
+  mappedfile &operator=(const mappedfile &b)=delete;
+  const char *data();
+  size_t size();
+private:
+  const char *start;
+  size_t len;
+  void *mapAddress;
+  std::vector<char> buffer;
+};
+#endif
+
@@ -0,0 +1,329 @@
+/******************************************************/
+/*                                                    */
+/* binpoint.cpp - binary point files                  */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <unordered_map>
+#include "binpoint.h"
+#include "binio.h"
+#include "except.h"
+#include "threads.h"
+#include "pointlist.h"
+#include "document.h"
+using namespace std;
+
+#define BP_HEADER_SIZE 64
+#define BP_VERSION 1
+const char bpMagic[]="bezipnts";
+
+/* The read routine throws badHeader if the file is not a binary point file
+ * or was written by a newer version, and badData if it is corrupt or cut
+ * off. It returns the number of points read, or -1 if the file can't be
+ * opened, like readpnezd.
+ */
+
+static void putVarint(ostream &col,unsigned long long n)
+{
+  while (n>=128)
+  {
+    col.put((char)(n|128));
+    n>>=7;
+  }
+  col.put((char)n);
+}
+
+static unsigned long long getVarint(const char *&p,const char *end)
+{
+  int shift=0;
+  unsigned long long ret=0;
+  unsigned char byte;
+  do
+  {
+    if (p>=end || shift>63)
+      throw badData;
+    byte=*p++;
+    ret|=(unsigned long long)(byte&127)<<shift;
+    shift+=7;
+  } while (byte&128);
+  return ret;
+}
+
+static unsigned long long zigzag(long long n)
+{
+  return ((unsigned long long)n<<1)^(n>>63);
+}
+
+static long long unzigzag(unsigned long long n)
+{
+  return (long long)(n>>1)^-(long long)(n&1);
+}
+
+static void putXorDouble(ostream &col,double x,unsigned long long &prev)
+{
+  unsigned long long bits,diff;
+  int nbytes=0;
+  memcpy(&bits,&x,8);
+  diff=bits^prev;
+  prev=bits;
+  while (nbytes<8 && (diff>>(8*nbytes)))
+    nbytes++;
+  col.put((char)nbytes);
+  while (nbytes--)
+  {
+    col.put((char)diff);
+    diff>>=8;
+  }
+}
+
+static double getXorDouble(const char *&p,const char *end,unsigned long long &prev)
+{
+  int i,nbytes;
+  unsigned long long diff=0;
+  double ret;
+  if (p>=end)
+    throw badData;
+  nbytes=(unsigned char)*p++;
+  if (nbytes>8 || end-p<nbytes)
+    throw badData;
+  for (i=0;i<nbytes;i++)
+    diff|=(unsigned long long)(unsigned char)*p++<<(8*i);
+  prev^=diff;
+  memcpy(&ret,&prev,8);
+  return ret;
+}
+
+bool isbinpoints(string fname)
+{
+  char magic[8];
+  ifstream file(fname,ios::binary);
+  file.read(magic,8);
+  return file.good() && memcmp(magic,bpMagic,8)==0;
+}
+
+int writebinpoints(document *doc,string fname,bool compress)
+/* The columns are put together in memory, since the header needs their
+ * lengths.
+ */
+{
+  ofstream outfile;
+  int i,j,n,npoints,lastNum=0;
+  double coord[3];
+  unsigned long long prevBits[3]={0,0,0};
+  ptlist::iterator k;
+  ostringstream cols[5];
+  string text,colText[5];
+  unordered_map<string,int> descIndex;
+  vector<int> descs;
+  pointlist &pl=doc->pl[0];
+  outfile.open(fname,ios::binary);
+  npoints=-(!outfile.is_open());
+  if (outfile.is_open())
+  {
+    n=pl.points.size();
+    if (!compress)
+      writelelong(cols[4],0);
+    for (k=pl.points.begin();k!=pl.points.end();k++)
+    {
+      coord[0]=k->second.east();
+      coord[1]=k->second.north();
+      coord[2]=k->second.elev();
+      if (compress)
+      {
+	putVarint(cols[0],zigzag((long long)k->first-lastNum));
+	lastNum=k->first;
+	for (j=0;j<3;j++)
+	  putXorDouble(cols[j+1],coord[j],prevBits[j]);
+	auto found=descIndex.emplace(k->second.note,descIndex.size());
+	if (found.second)
+	{
+	  putVarint(cols[4],k->second.note.length());
+	  cols[4]<<k->second.note;
+	}
+	descs.push_back(found.first->second);
+      }
+      else
+      {
+	writeleint(cols[0],k->first);
+	for (j=0;j<3;j++)
+	  writeledouble(cols[j+1],coord[j]);
+	text+=k->second.note;
+	writelelong(cols[4],text.length());
+      }
+    }
+    for (j=0;j<5;j++)
+      colText[j]=cols[j].str();
+    if (compress)
+    {
+      cols[4].str("");
+      putVarint(cols[4],descIndex.size());
+      cols[4]<<colText[4];
+      for (i=0;i<descs.size();i++)
+	putVarint(cols[4],descs[i]);
+      colText[4]=cols[4].str();
+    }
+    else
+      colText[4]+=text;
+    outfile.write(bpMagic,8);
+    writeleint(outfile,BP_VERSION);
+    writeleint(outfile,compress?BP_COMPRESSED:0);
+    writeleint(outfile,n);
+    writeleint(outfile,0);
+    for (j=0;j<5;j++)
+      writelelong(outfile,colText[j].length());
+    for (j=0;j<5;j++)
+      outfile.write(colText[j].data(),colText[j].length());
+    if (outfile.good())
+      npoints=n;
+    outfile.close();
+  }
+  return npoints;
+}
+
+int readbinpoints(document *doc,string fname,bool overwrite,int threads)
+/* The file is mapped, not read. In an uncompressed file, every point's
+ * place in each column is known, so the points are decoded on all threads.
+ * In a compressed file, each column is decoded on its own thread. The
+ * points are then put into the pointlist in order, which takes no searching
+ * if the pointlist is empty, or all the numbers are greater.
+ */
+{
+  int i,j,n,version,flags;
+  size_t len,colStart[6];
+  long long colLen;
+  const char *data;
+  vector<int> nums;
+  vector<double> coords[3];
+  vector<string> descs;
+  ptlist::iterator pnti;
+  pointlist &pl=doc->pl[0];
+  ifstream infile(fname,ios::binary);
+  if (!infile.is_open())
+    return -1;
+  infile.close();
+  mappedfile file(fname);
+  data=file.data();
+  len=file.size();
+  if (len<BP_HEADER_SIZE || memcmp(data,bpMagic,8))
+    throw badHeader;
+  version=readleint(data+8);
+  flags=readleint(data+12);
+  n=readleint(data+16);
+  if (version!=BP_VERSION || (flags&~BP_COMPRESSED))
+    throw badHeader;
+  if (n<0)
+    throw badData;
+  colStart[0]=BP_HEADER_SIZE;
+  for (j=0;j<5;j++)
+  {
+    colLen=readlelong(data+24+8*j);
+    if (colLen<0 || (size_t)colLen>len-colStart[j])
+      throw badData;
+    colStart[j+1]=colStart[j]+colLen;
+  }
+  if (flags&BP_COMPRESSED)
+  { // Every point takes at least one byte in each column.
+    for (j=0;j<5;j++)
+      if (colStart[j+1]-colStart[j]<(size_t)n)
+	throw badData;
+  }
+  else if (colStart[1]-colStart[0]!=4*(size_t)n ||
+	   colStart[2]-colStart[1]!=8*(size_t)n ||
+	   colStart[3]-colStart[2]!=8*(size_t)n ||
+	   colStart[4]-colStart[3]!=8*(size_t)n ||
+	   colStart[5]-colStart[4]<8*((size_t)n+1))
+    throw badData;
+  nums.resize(n);
+  for (j=0;j<3;j++)
+    coords[j].resize(n);
+  descs.resize(n);
+  if (flags&BP_COMPRESSED)
+    parallelFor(0,5,threads,[&](int j)
+    {
+      int i,num=0;
+      long long delta;
+      unsigned long long count,index,prevBits=0,descLen;
+      vector<string> texts;
+      const char *p=data+colStart[j],*end=data+colStart[j+1];
+      if (j==0)
+	for (i=0;i<n;i++)
+	{
+	  delta=unzigzag(getVarint(p,end));
+	  if (delta<(long long)INT_MIN-num || delta>(long long)INT_MAX-num)
+	    throw badData;
+	  nums[i]=num+=delta;
+	}
+      else if (j<4)
+	for (i=0;i<n;i++)
+	  coords[j-1][i]=getXorDouble(p,end,prevBits);
+      else
+      {
+	count=getVarint(p,end);
+	if (count>(size_t)(end-p))
+	  throw badData;
+	for (i=0;i<count;i++)
+	{
+	  descLen=getVarint(p,end);
+	  if (descLen>(size_t)(end-p))
+	    throw badData;
+	  texts.push_back(string(p,descLen));
+	  p+=descLen;
+	}
+	for (i=0;i<n;i++)
+	{
+	  index=getVarint(p,end);
+	  if (index>=count)
+	    throw badData;
+	  descs[i]=texts[index];
+	}
+      }
+    },1);
+  else
+    parallelFor(0,n,threads,[&](int i)
+    {
+      int j;
+      long long descStart,descEnd,textLen=colStart[5]-colStart[4]-8*((size_t)n+1);
+      const char *text=data+colStart[4]+8*((size_t)n+1);
+      nums[i]=readleint(data+colStart[0]+4*(size_t)i);
+      for (j=0;j<3;j++)
+	coords[j][i]=readledouble(data+colStart[j+1]+8*(size_t)i);
+      descStart=readlelong(data+colStart[4]+8*(size_t)i);
+      descEnd=readlelong(data+colStart[4]+8*((size_t)i+1));
+      if (descStart<0 || descStart>descEnd || descEnd>textLen)
+	throw badData;
+      descs[i].assign(text+descStart,descEnd-descStart);
+    },4096);
+  for (i=0;i<n;i++)
+    if (pl.points.empty() || nums[i]>pl.points.rbegin()->first)
+    {
+      pnti=pl.points.emplace_hint(pl.points.end(),nums[i],
+				  point(coords[0][i],coords[1][i],coords[2][i],move(descs[i])));
+      pl.revpoints[&pnti->second]=nums[i];
+    }
+    else
+      pl.addpoint(nums[i],point(coords[0][i],coords[1][i],coords[2][i],move(descs[i])),overwrite);
+  return n;
+}
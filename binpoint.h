@@ -0,0 +1,66 @@
+/******************************************************/
+/*                                                    */
+/* binpoint.h - binary point files                    */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef BINPOINT_H
+#define BINPOINT_H
+#include <string>
+
+/* A binary point file holds the same things as a PNEZD file (number,
+ * coordinates in meters, and description), one column after another.
+ * All numbers are little-endian.
+ *
+ * Header, 64 bytes:
+ * "bezipnts"
+ * int version (1)
+ * int flags (BP_COMPRESSED)
+ * int number of points
+ * int 0
+ * long long length in bytes of each of the five columns
+ *
+ * Uncompressed columns:
+ * numbers: int each
+ * eastings, northings, elevations: double each
+ * descriptions: n+1 long long offsets, then the text of all descriptions
+ * run together; description i is from offset i to offset i+1.
+ *
+ * Compressed columns:
+ * numbers: each one's difference from the previous, zigzag-encoded, in
+ * 7-bit groups, least significant first, with the high bit set in all
+ * but the last byte.
+ * eastings, northings, elevations: each one's bits XORed with the previous
+ * one's, written as the number of bytes left after dropping leading zero
+ * bytes, followed by those bytes, least significant first.
+ * descriptions: the number of different descriptions and each one, as a
+ * length and text, in the order they first appear, followed by each point's
+ * description as an index into them. Lengths and indices are written like
+ * numbers, but not differenced.
+ */
+
+#define BP_COMPRESSED 1
+
+class document;
+
+bool isbinpoints(std::string fname);
+int readbinpoints(document *doc,std::string fname,bool overwrite=false,int threads=1);
+int writebinpoints(document *doc,std::string fname,bool compress=false);
+#endif
@@ -0,0 +1,167 @@
+/******************************************************/
+/*                                                    */
+/* chunkvector.h - array that doesn't move its items  */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHUNKVECTOR_H
+#define CHUNKVECTOR_H
+#include <vector>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
+/* An array indexed from 0 to size()-1, stored in chunks of 4096 items.
+ * Growing it allocates a new chunk, but never moves an item, so pointers
+ * to items stay valid until clear(). Indexing is a shift and a mask.
+ * Like std::map<int,T>, operator[] creates the item if it doesn't exist,
+ * along with all items below it. indexOf finds the index of an item from
+ * its address by binary search on the chunks' addresses.
+ */
+
+template <typename T> class chunkvector
+{
+public:
+  chunkvector()
+  {
+    count=0;
+  }
+  chunkvector(const chunkvector &other)
+  {
+    count=0;
+    *this=other;
+  }
+  chunkvector(chunkvector &&other) noexcept
+  {
+    count=other.count;
+    chunks.swap(other.chunks);
+    byAddress.swap(other.byAddress);
+    other.count=0;
+  }
+  ~chunkvector()
+  {
+    clear();
+  }
+  chunkvector &operator=(const chunkvector &other)
+  {
+    int i;
+    if (this!=&other)
+    {
+      clear();
+      for (i=0;i<other.count;i++)
+      {
+	new(slot(i)) T(other.at(i));
+	count++;
+      }
+    }
+    return *this;
+  }
+  chunkvector &operator=(chunkvector &&other) noexcept
+  {
+    if (this!=&other)
+    {
+      clear();
+      count=other.count;
+      chunks.swap(other.chunks);
+      byAddress.swap(other.byAddress);
+      other.count=0;
+    }
+    return *this;
+  }
+  T &operator[](int n)
+  {
+    while (n>=count)
+    {
+      new(slot(count)) T();
+      count++;
+    }
+    return at(n);
+  }
+  const T &operator[](int n) const
+  {
+    return at(n);
+  }
+  size_t size() const
+  {
+    return count;
+  }
+  bool empty() const
+  {
+    return count==0;
+  }
+  int indexOf(const T *item) const
+  // Returns -1 if item is not in this chunkvector.
+  {
+    int n;
+    auto it=std::upper_bound(byAddress.begin(),byAddress.end(),
+			     std::make_pair(item,0),addressLess);
+    if (it==byAddress.begin())
+      return -1;
+    --it;
+    if (std::less<const T *>()(item,it->first+CHUNKSIZE))
+    {
+      n=(it->second<<CHUNKBITS)+(item-it->first);
+      if (n<count)
+	return n;
+    }
+    return -1;
+  }
+  void clear()
+  {
+    int i;
+    for (i=count-1;i>=0;i--)
+      at(i).~T();
+    for (i=0;i<chunks.size();i++)
+      ::operator delete(chunks[i]);
+    chunks.clear();
+    byAddress.clear();
+    count=0;
+  }
+private:
+  enum {CHUNKBITS=12,CHUNKSIZE=1<<CHUNKBITS};
+  std::vector<T *> chunks;
+  std::vector<std::pair<const T *,int> > byAddress; // chunks sorted by address
+  int count;
+  static bool addressLess(const std::pair<const T *,int> &a,const std::pair<const T *,int> &b)
+  {
+    return std::less<const T *>()(a.first,b.first);
+  }
+  T &at(int n) const
+  {
+    return chunks[n>>CHUNKBITS][n&(CHUNKSIZE-1)];
+  }
+  void *slot(int n)
+  /* Returns the raw memory for item n, which must be count.
+   * The caller constructs the item in it, then counts it.
+   */
+  {
+    std::pair<const T *,int> newChunk;
+    if ((n>>CHUNKBITS)>=chunks.size())
+    {
+      chunks.push_back(static_cast<T *>(::operator new(CHUNKSIZE*sizeof(T))));
+      newChunk=std::make_pair(chunks.back(),(int)chunks.size()-1);
+      byAddress.insert(std::upper_bound(byAddress.begin(),byAddress.end(),newChunk,addressLess),newChunk);
+    }
+    return &chunks[n>>CHUNKBITS][n&(CHUNKSIZE-1)];
+  }
+};
+
+#endif
@@ -34,12 +34,19 @@
  */
 #include <iostream>
 #include <cassert>
+#include <atomic>
+#include <set>
+#include <algorithm>
+#include <mutex>
 #include "pointlist.h"
 #include "contour.h"
 #include "relprime.h"
 #include "ldecimal.h"
+#include "threads.h"
 using namespace std;
 
+mutex psMutex; // for the smoothcontours log and progress output
+
 float splittab[65]=
 {
   0.2113,0.2123,0.2134,0.2145,0.2156,0.2167,0.2179,0.2191,0.2204,0.2216,0.2229,0.2244,0.2257,
@@ -175,13 +182,203 @@ float splitpoint(double leftclamp,double rightclamp,double tolerance)
   return sp;
 }
 
+array<double,2> crossRange(segment &seg)
+/* Returns lo and hi such that seg.crosses(e) implies lo<e<=hi.
+ * If one end is NaN, it never compares less, so the range goes up forever.
+ */
+{
+  array<double,2> ret;
+  double s=seg.getstart().elev(),e=seg.getend().elev();
+  if (std::isnan(s))
+    s=INFINITY;
+  if (std::isnan(e))
+    e=INFINITY;
+  ret[0]=min(s,e);
+  ret[1]=max(s,e);
+  if (ret[0]==INFINITY)
+    ret[0]=ret[1]=NAN;
+  return ret;
+}
+
+contourindex::contourindex()
+{
+  clear();
+}
+
+contourindex::contourindex(const contourindex &other)
+{
+  clear();
+}
+
+contourindex &contourindex::operator=(const contourindex &other)
+{
+  clear();
+  return *this;
+}
+
+void contourindex::clear()
+{
+  built=false;
+  nbuckets=1;
+  base=0;
+  width=1;
+  edgeEntries.clear();
+  triEntries.clear();
+  edgeStart.clear();
+  edgeItems.clear();
+  triStart.clear();
+  triItems.clear();
+}
+
+bool contourindex::empty()
+{
+  return !built;
+}
+
+int contourindex::bucket(double elev)
+{
+  double b=floor((elev-base)/width);
+  if (b<0)
+    b=0;
+  if (b>nbuckets-1 || std::isnan(b))
+    b=nbuckets-1;
+  return b;
+}
+
+void contourindex::fill(const vector<array<double,2> > &ranges,vector<int> &start,vector<int> &items)
+/* Puts each item in the buckets its range spans, in order of item number
+ * within each bucket. Items whose range is NaN are in no bucket.
+ */
+{
+  int i,j;
+  vector<int> pos;
+  start.assign(nbuckets+1,0);
+  for (i=0;i<ranges.size();i++)
+    if (!std::isnan(ranges[i][0]))
+      for (j=bucket(ranges[i][0]);j<=bucket(ranges[i][1]);j++)
+        start[j+1]++;
+  for (j=0;j<nbuckets;j++)
+    start[j+1]+=start[j];
+  items.resize(start[nbuckets]);
+  pos.assign(start.begin(),start.end()-1);
+  for (i=0;i<ranges.size();i++)
+    if (!std::isnan(ranges[i][0]))
+      for (j=bucket(ranges[i][0]);j<=bucket(ranges[i][1]);j++)
+        items[pos[j]++]=i;
+}
+
+void contourindex::build(pointlist &pl)
+/* The edge parts are in the same order that contstarts looks at them:
+ * exterior edges, then interior edges. Exterior edge parts where up is not
+ * on the left are left out, since contours don't start there.
+ */
+{
+  int i,j,io,sd;
+  uintptr_t ep;
+  triangle *tri;
+  array<double,2> r;
+  vector<array<double,2> > edgeRanges,triRanges;
+  double lo=INFINITY,hi=-INFINITY;
+  edgeEntry ent;
+  clear();
+  for (io=0;io<2;io++)
+    for (i=0;i<pl.edges.size();i++)
+      if (io==pl.edges[i].isinterior())
+      {
+	tri=pl.edges[i].tria;
+	if (!tri)
+	  tri=pl.edges[i].trib;
+	assert(tri);
+	for (j=0;j<3;j++)
+	{
+	  ep=j+(uintptr_t)&pl.edges[i];
+	  sd=tri->subdir(ep);
+	  if ((sd&65535)<tri->subdiv.size() && (io || tri->upleft(sd)))
+	  {
+	    ent.ep=ep;
+	    ent.tri=tri;
+	    ent.sd=sd;
+	    edgeEntries.push_back(ent);
+	    edgeRanges.push_back(crossRange(tri->subdiv[sd&65535]));
+	  }
+	}
+      }
+  for (i=0;i<pl.triangles.size();i++)
+  {
+    r[0]=INFINITY;
+    r[1]=-INFINITY;
+    for (j=0;j<pl.triangles[i].subdiv.size();j++)
+    {
+      array<double,2> sr=crossRange(pl.triangles[i].subdiv[j]);
+      if (!std::isnan(sr[0]))
+      {
+	r[0]=min(r[0],sr[0]);
+	r[1]=max(r[1],sr[1]);
+      }
+    }
+    if (r[0]>r[1])
+      r[0]=r[1]=NAN;
+    triEntries.push_back(&pl.triangles[i]);
+    triRanges.push_back(r);
+  }
+  for (i=0;i<edgeRanges.size();i++)
+    if (std::isfinite(edgeRanges[i][0]))
+    {
+      lo=min(lo,edgeRanges[i][0]);
+      if (std::isfinite(edgeRanges[i][1]))
+	hi=max(hi,edgeRanges[i][1]);
+    }
+  nbuckets=edgeEntries.size()/4+1;
+  if (lo<hi)
+  {
+    base=lo;
+    width=(hi-lo)/nbuckets;
+  }
+  else
+    nbuckets=1;
+  fill(edgeRanges,edgeStart,edgeItems);
+  fill(triRanges,triStart,triItems);
+  built=true;
+}
+
+vector<uintptr_t> contourindex::edgeParts(double elev)
+// Returns the same as a full scan by contstarts.
+{
+  vector<uintptr_t> ret;
+  int i,b=bucket(elev);
+  edgeEntry *ent;
+  for (i=edgeStart[b];i<edgeStart[b+1];i++)
+  {
+    ent=&edgeEntries[edgeItems[i]];
+    if (ent->tri->crosses(ent->sd,elev))
+      ret.push_back(ent->ep);
+  }
+  return ret;
+}
+
+vector<triangle *> contourindex::triangles(double elev)
+// Returns, in order, the triangles that contours of elevation elev may cross.
+{
+  vector<triangle *> ret;
+  int i,b=bucket(elev);
+  for (i=triStart[b];i<triStart[b+1];i++)
+    ret.push_back(triEntries[triItems[i]]);
+  return ret;
+}
+
 vector<uintptr_t> contstarts(pointlist &pts,double elev)
+/* Returns the edge parts where contours of elevation elev start: the exterior
+ * ones where up is on the left, then all interior ones. Uses pts.cinx if
+ * it's been built.
+ */
 {
   vector<uintptr_t> ret;
   uintptr_t ep;
   int sd,io;
   triangle *tri;
   int i,j;
+  if (!pts.cinx.empty())
+    return pts.cinx.edgeParts(elev);
   //cout<<"Exterior edges:";
   for (io=0;io<2;io++)
     for (i=0;i<pts.edges.size();i++)
@@ -207,14 +404,29 @@ vector<uintptr_t> contstarts(pointlist &pts,double elev)
   return ret;
 }
 
-void mark(uintptr_t ep)
+contourmarks::contourmarks(pointlist &plist)
+{
+  pl=&plist;
+  bits.resize((3*pl->edges.size()+63)/64);
+}
+
+void contourmarks::clear()
+{
+  fill(bits.begin(),bits.end(),0);
+}
+
+void contourmarks::mark(uintptr_t ep)
 {
-  ((edge *)(ep&-4))->mark(ep&3);
+  int n=3*pl->edges.indexOf((edge *)(ep&-4))+(ep&3);
+  assert(n>=0);
+  bits[n>>6]|=1ULL<<(n&63);
 }
 
-bool ismarked(uintptr_t ep)
+bool contourmarks::ismarked(uintptr_t ep)
 {
-  return ((edge *)(ep&-4))->ismarked(ep&3);
+  int n=3*pl->edges.indexOf((edge *)(ep&-4))+(ep&3);
+  assert(n>=0);
+  return (bits[n>>6]>>(n&63))&1;
 }
 
 polyline intrace(triangle *tri,double elev)
@@ -253,7 +465,7 @@ polyline intrace(triangle *tri,double elev)
   return ret;
 }
 
-polyline trace(uintptr_t edgep,double elev)
+polyline trace(uintptr_t edgep,double elev,contourmarks &marks)
 {
   polyline ret(elev);
   int subedge,subnext,i;
@@ -265,7 +477,7 @@ polyline trace(uintptr_t edgep,double elev)
   ntri=((edge *)(edgep&-4))->trib;
   if (tri==nullptr || !tri->upleft(tri->subdir(edgep)))
     tri=ntri;
-  mark(edgep);
+  marks.mark(edgep);
   firstcept=lastcept=tri->contourcept(tri->subdir(edgep),elev);
   if (firstcept.isnan())
   {
@@ -339,7 +551,7 @@ polyline trace(uintptr_t edgep,double elev)
     }
     else
     {
-      wasmarked=ismarked(edgep);
+      wasmarked=marks.ismarked(edgep);
       if (!wasmarked)
       {
 	thiscept=tri->contourcept(tri->subdir(edgep),elev);
@@ -351,7 +563,7 @@ polyline trace(uintptr_t edgep,double elev)
         }
 	lastcept=thiscept;
       }
-      mark(edgep);
+      marks.mark(edgep);
       ntri=((edge *)(edgep&-4))->othertri(tri);
     }
     if (ntri)
@@ -387,50 +599,155 @@ void checkedgediscrepancies(pointlist &pl)
   }
 }
 
-void rough1contour(pointlist &pl,double elev)
+vector<polyline> trace1elevation(pointlist &pl,double elev,contourmarks &marks)
+/* Traces all the contours at elevation elev. Reads the TIN but writes only
+ * marks, so several elevations can be traced at once, each with its own marks.
+ */
 {
   vector<uintptr_t> cstarts;
+  vector<polyline> ret;
+  vector<triangle *> tris;
   polyline ctour;
   int j;
   cstarts=contstarts(pl,elev);
-  pl.clearmarks();
+  marks.clear();
   for (j=0;j<cstarts.size();j++)
-    if (!ismarked(cstarts[j]))
+    if (!marks.ismarked(cstarts[j]))
     {
-      ctour=trace(cstarts[j],elev);
+      ctour=trace(cstarts[j],elev,marks);
       ctour.dedup();
-      pl.contours.push_back(ctour);
+      ret.push_back(ctour);
     }
-  for (j=0;j<pl.triangles.size();j++)
+  if (pl.cinx.empty())
+    for (j=0;j<pl.triangles.size();j++)
+      tris.push_back(&pl.triangles[j]);
+  else
+    tris=pl.cinx.triangles(elev);
+  for (j=0;j<tris.size();j++)
   {
-    ctour=intrace(&pl.triangles[j],elev);
+    ctour=intrace(tris[j],elev);
     if (ctour.size())
     {
       ctour.setlengths();
-      pl.contours.push_back(ctour);
+      ret.push_back(ctour);
     }
   }
+  return ret;
+}
+
+void rough1contour(pointlist &pl,double elev)
+{
+  vector<polyline> ctours;
+  contourmarks marks(pl);
+  int j;
+  if (pl.cinx.empty())
+    pl.cinx.build(pl);
+  ctours=trace1elevation(pl,elev,marks);
+  for (j=0;j<ctours.size();j++)
+    pl.contours.push_back(ctours[j]);
 }
 
-void roughcontours(pointlist &pl,double conterval)
+void roughcontours(pointlist &pl,double conterval,int threads)
 /* Draws contours consisting of line segments.
  * The perimeter must be present in the triangles.
  * Do not attempt to draw contours in the Mariana Trench with conterval
  * less than 5 µm or of Chomolungma with conterval less than 4 µm. It will fail.
+ * The elevations are traced on threads threads, then the contours are put
+ * in pl.contours in order of elevation, the same for any number of threads.
  */
 {
   array<double,2> tinlohi;
-  int i;
+  int i,j,lo,hi;
+  vector<vector<polyline> > ctours;
   pl.contours.clear();
   tinlohi=pl.lohi();
-  for (i=floor(tinlohi[0]/conterval);i<=ceil(tinlohi[1]/conterval);i++)
-    rough1contour(pl,i*conterval);
+  lo=floor(tinlohi[0]/conterval);
+  hi=ceil(tinlohi[1]/conterval);
+  if (hi<lo)
+    return;
+  if (pl.cinx.empty())
+    pl.cinx.build(pl);
+  ctours.resize(hi-lo+1);
+  parallelForEach(0,ctours.size(),threads,[&](int k)
+  {
+    contourmarks marks(pl);
+    ctours[k]=trace1elevation(pl,(lo+k)*conterval,marks);
+  });
+  for (i=0;i<ctours.size();i++)
+    for (j=0;j<ctours[i].size();j++)
+      pl.contours.push_back(ctours[i][j]);
+}
+
+void retraceContours(pointlist &pl,double conterval,const vector<triangle *> &changed,int threads)
+/* Retraces the rough contours that cross triangles that have changed,
+ * e.g. by flipping an edge, since roughcontours was run with conterval.
+ * An elevation is retraced if it is within the range of a changed triangle
+ * (this catches every contour that now crosses it, and every old contour
+ * that crosses its edges, since the corners are the same) or if an old
+ * contour of that elevation has a vertex in a changed triangle. The other
+ * contours are left alone, so pl.contours is as roughcontours would make it,
+ * except that contours already smoothed stay smoothed.
+ *
+ * changed must include every triangle whose surface changed. Flipping an edge
+ * changes the gradients at the four corners of its quadrilateral, so after
+ * setgradient, every triangle touching one of those corners has changed.
+ */
+{
+  int i,j,k,elevnum;
+  array<double,4> tlohi;
+  set<int> redoSet;
+  vector<int> redo;
+  vector<vector<polyline> > ctours;
+  vector<polyspiral> newContours;
+  for (i=0;i<changed.size();i++)
+  {
+    tlohi=changed[i]->lohi();
+    for (j=floor(tlohi[0]/conterval);j<=ceil(tlohi[3]/conterval);j++)
+      redoSet.insert(j);
+  }
+  for (i=0;i<pl.contours.size();i++)
+  {
+    elevnum=lrint(pl.contours[i].getElevation()/conterval);
+    for (j=0;!redoSet.count(elevnum) && j<pl.contours[i].size();j++)
+      for (k=0;k<changed.size();k++)
+        if (changed[k]->in(pl.contours[i].getEndpoint(j)))
+        {
+          redoSet.insert(elevnum);
+          break;
+        }
+  }
+  redo.assign(redoSet.begin(),redoSet.end());
+  if (pl.cinx.empty())
+    pl.cinx.build(pl);
+  ctours.resize(redo.size());
+  parallelForEach(0,redo.size(),threads,[&](int n)
+  {
+    contourmarks marks(pl);
+    ctours[n]=trace1elevation(pl,redo[n]*conterval,marks);
+  });
+  for (i=j=0;i<pl.contours.size();i++)
+  {
+    elevnum=lrint(pl.contours[i].getElevation()/conterval);
+    for (;j<redo.size() && redo[j]<elevnum;j++)
+      newContours.insert(newContours.end(),ctours[j].begin(),ctours[j].end());
+    if (!redoSet.count(elevnum))
+      newContours.push_back(pl.contours[i]);
+  }
+  for (;j<redo.size();j++)
+    newContours.insert(newContours.end(),ctours[j].begin(),ctours[j].end());
+  pl.contours.swap(newContours);
 }
 
 void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript &ps,
                     double we,double ea,double so,double no)
+/* Smooths contour i. This touches only pl.contours[i], so several contours
+ * can be smoothed at once on different threads. The position n, which steps
+ * through the segments, starts at 0 for each contour, so that the result
+ * doesn't depend on which contours were smoothed before. If ps is open,
+ * each page is written while holding psMutex.
+ */
 {
-  static int n=0;
+  int n=0;
   int j,k,sz,origsz,whichParts;
   double sp,wide,thisElev;
   xy spt;
@@ -451,7 +768,7 @@ void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript
   for (j=0;flatTriangles && j<pl.contours[i].size();j+=lrint(sqrt(pl.contours[i].size())))
   {
     sarc=pl.contours[i].getspiralarc(j);
-    midptri=pl.qinx.findt((sarc.getstart()+sarc.getend())/2);
+    midptri=pl.findt((sarc.getstart()+sarc.getend())/2);
     if (midptri)
       flatTriangles=flatTriangles&&midptri->isFlat();
   }
@@ -473,7 +790,7 @@ void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript
       rpt=sarc.station(sarc.length()*(1-CCHALONG));
       if (lpt.isfinite() && rpt.isfinite())
       {
-        midptri=pl.qinx.findt((sarc.getstart()+sarc.getend())/2);
+        midptri=pl.findt((sarc.getstart()+sarc.getend())/2);
         if (midptri)
           if (allin=(midptri->in(sarc.getstart()) && midptri->in(sarc.getend()) &&
             !(midptri->in(lpt) && midptri->in(rpt))))
@@ -491,7 +808,7 @@ void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript
         {
           //cout<<"segment "<<n<<" of "<<sz<<" of contour "<<i<<" needs splitting at "<<sp<<endl;
           spt=sarc.getstart()+sp*(sarc.getend()-sarc.getstart());
-          splitseg=pl.qinx.findt(spt,true)->dirclip(spt,dir(xy(sarc.getend()),xy(sarc.getstart()))+DEG90);
+          splitseg=pl.findt(spt,true)->dirclip(spt,dir(xy(sarc.getend()),xy(sarc.getstart()))+DEG90);
           if (splitseg.getstart().elev()<splitseg.getend().elev()
               || splitseg.startslope()>0 || splitseg.endslope()>0)
           {
@@ -558,6 +875,7 @@ void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript
           }
           if (ps.isOpen())
           {
+            lock_guard<mutex> lock(psMutex);
             ps.startpage();
             ps.setscale(we,so,ea,no,0);
             ps.setcolor(0,0,0);
@@ -578,9 +896,14 @@ void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript
 }
 
 
-void smoothcontours(pointlist &pl,double conterval,bool spiral,bool log)
+void smoothcontours(pointlist &pl,double conterval,bool spiral,bool log,int threads)
+/* Smooths all contours, using threads threads. Contours take very different
+ * times to smooth, so each thread takes the next contour when it's done
+ * with one. The contours are the same for any number of threads, but
+ * the pages of the log are in the order they're written.
+ */
 {
-  int i;
+  atomic<int> done(0);
   PostScript ps;
   double we,ea,so,no;
   ofstream logfile;
@@ -598,12 +921,13 @@ void smoothcontours(pointlist &pl,double conterval,bool spiral,bool log)
     ps.setpaper(papersizes["A4 portrait"],0);
     ps.prolog();
   }
-  for (i=0;i<pl.contours.size();i++)
+  parallelForEach(0,pl.contours.size(),threads,[&](int i)
   {
-    cout<<"smoothcontours "<<i<<'/'<<pl.contours.size()<<" elev "<<i*conterval<<" \r";
-    cout.flush();
     smooth1contour(pl,conterval,i,spiral,ps,we,ea,so,no);
-  }
+    lock_guard<mutex> lock(psMutex);
+    cout<<"smoothcontours "<<++done<<'/'<<pl.contours.size()<<" elev "<<pl.contours[i].getElevation()<<" \r";
+    cout.flush();
+  });
   if (log)
   {
     ps.trailer();
@@ -25,6 +25,7 @@
 #ifndef CONTOUR_H
 #define CONTOUR_H
 #include <vector>
+#include <array>
 #include "polyline.h"
 #include "measure.h"
 #include "ps.h"
@@ -72,15 +73,68 @@ private:
   int fineRatio,coarseRatio;
 };
 
+class contourmarks
+/* Marks which parts of which edges a contour has been traced through.
+ * Each edge has three bits, one for each of the three parts of edge pointer
+ * (uintptr_t) values. A contourmarks belongs to whoever is tracing one
+ * elevation, so several elevations can be traced at once.
+ */
+{
+public:
+  contourmarks(pointlist &pl);
+  void clear();
+  void mark(uintptr_t ep);
+  bool ismarked(uintptr_t ep);
+private:
+  pointlist *pl;
+  std::vector<unsigned long long> bits;
+};
+
+class contourindex
+/* Finds the edge parts where contours of an elevation may start, and the
+ * triangles they may cross, without looking at every edge and triangle.
+ * Each edge part and triangle is put in every bucket of elevation that
+ * its subdivisions span. Build it after adding the perimeter; it's cleared
+ * when the subdivisions change. Copying it gives an empty index, since
+ * the copy's pointers would be to the wrong pointlist.
+ */
+{
+public:
+  contourindex();
+  contourindex(const contourindex &other);
+  contourindex &operator=(const contourindex &other);
+  void build(pointlist &pl);
+  void clear();
+  bool empty();
+  std::vector<uintptr_t> edgeParts(double elev);
+  std::vector<triangle *> triangles(double elev);
+private:
+  struct edgeEntry
+  {
+    uintptr_t ep;
+    triangle *tri;
+    int sd;
+  };
+  double base,width;
+  int nbuckets;
+  bool built;
+  std::vector<edgeEntry> edgeEntries;
+  std::vector<triangle *> triEntries;
+  std::vector<int> edgeStart,edgeItems,triStart,triItems;
+  int bucket(double elev);
+  void fill(const std::vector<std::array<double,2> > &ranges,std::vector<int> &start,std::vector<int> &items);
+};
+
 float splitpoint(double leftclamp,double rightclamp,double tolerance);
 std::vector<uintptr_t> contstarts(pointlist &pts,double elev);
-polyline trace(uintptr_t edgep,double elev);
+polyline trace(uintptr_t edgep,double elev,contourmarks &marks);
 polyline intrace(triangle *tri,double elev);
-bool ismarked(uintptr_t ep);
+std::vector<polyline> trace1elevation(pointlist &pl,double elev,contourmarks &marks);
 void rough1contour(pointlist &pl,double elev);
-void roughcontours(pointlist &pl,double conterval);
+void roughcontours(pointlist &pl,double conterval,int threads=1);
+void retraceContours(pointlist &pl,double conterval,const std::vector<triangle *> &changed,int threads=1);
 void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript &ps,
                     double we,double ea,double so,double no);
-void smoothcontours(pointlist &pl,double conterval,bool spiral=true,bool log=false);
+void smoothcontours(pointlist &pl,double conterval,bool spiral=true,bool log=false,int threads=1);
 void checkedgediscrepancies(pointlist &pl);
 #endif
@@ -23,7 +23,12 @@
  */
 #include <iostream>
 #include <ctime>
+#include <chrono>
+#include <cstdlib>
 #include "config.h"
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 #include "geoid.h"
 #include "sourcegeoid.h"
 #include "refinegeoid.h"
@@ -39,13 +44,14 @@
 #include "kml.h"
 #include "smooth5.h"
 #include "cmdopt.h"
+#include "threads.h"
 using namespace std;
 
 document doc;
 vector<geoformat> formatlist;
 int verbosity=1;
 bool helporversion=false,commandError=false,inputKml=false,didConvert=false;
-int qsz=4;
+int qsz=4,nThreads=0;
 int latFineness=0,lonFineness=0;
 double bolTolerance=0,bolSubdivision=0,bolSpacing=0;
 int nInputFiles=0;
@@ -68,7 +74,8 @@ vector<option> options(
     {'s',"subdiv","distance","Subdivision limit of geoquads, typ. 1 km"},
     {'e',"endian","big/native/little","Output endianness (for ngs)"},
     {'q',"quadsample","n 4-16","Geoquad sampling fineness"},
-    {'S',"spacing","distance","Geoquad search spacing, typ. 100 km"}
+    {'S',"spacing","distance","Geoquad search spacing, typ. 100 km"},
+    {'j',"threads","n","Number of threads, default one per core"}
   });
 
 vector<token> cmdline;
@@ -154,14 +161,14 @@ void plotinter(PostScript &ps,geoquad &quad)
   if (quad.subdivided())
     for (i=0;i<4;i++)
       plotinter(ps,*quad.sub[i]);
-  else
+  else if (quad.samples)
   {
     ps.setcolor(0,0,1);
-    for (i=0;i<quad.nums.size();i++)
-      ps.dot(unfold(vball(quad.face,quad.nums[i])));
+    for (i=0;i<quad.samples->nums.size();i++)
+      ps.dot(unfold(vball(quad.face,quad.samples->nums[i])));
     ps.setcolor(1,0,0);
-    for (i=0;i<quad.nans.size();i++)
-      ps.dot(unfold(vball(quad.face,quad.nans[i])));
+    for (i=0;i<quad.samples->nans.size();i++)
+      ps.dot(unfold(vball(quad.face,quad.samples->nans[i])));
   }
 }
 
@@ -246,6 +253,7 @@ int readgeoid(string filename)
   if (ret==2)
   {
     geo.push_back(gd);
+    geoChanged();
     outputgeoid.ghdr->namesFormats.push_back(filename);
     outputgeoid.ghdr->namesFormats.push_back(formatlist[i].cmd);
     cout<<"Read "<<filename<<" in format "<<formatlist[i].cmd<<endl;
@@ -564,6 +572,18 @@ void argpass2()
           commandError=true;
 	}
 	break;
+      case 15:
+	if (i+1<cmdline.size() && cmdline[i+1].optnum<0)
+	{
+	  i++;
+          nThreads=atoi(cmdline[i].nonopt.c_str());
+	}
+	else
+	{
+	  cerr<<"-j / --threads requires an argument, a number of threads"<<endl;
+          commandError=true;
+	}
+	break;
       default:
 	if (!helporversion)
 	  readgeoid(cmdline[i].nonopt);
@@ -602,7 +622,7 @@ int main(int argc, char *argv[])
   PostScript ps;
   histogram errorHist,areaHist;
   histobar intervalBar;
-  double percentage;
+  double percentage,refineSeconds=0;
   vector<cylinterval> excerptintervals,inputbounds;
   array<int,6> undrange;
   array<int,5> undhisto;
@@ -636,6 +656,8 @@ int main(int argc, char *argv[])
     qsz=4;
   if (qsz>16)
     qsz=16;
+  if (nThreads<1)
+    nThreads=defaultThreads();
   for (i=0;i<excerptcircles.size();i++)
     excerptintervals.push_back(excerptcircles[i].boundrect());
   for (i=0;i<geo.size();i++)
@@ -653,6 +675,7 @@ int main(int argc, char *argv[])
     if (bolSpacing==0 && geo[i].ghdr)
       bolSpacing=geo[i].ghdr->spacing;
   }
+  geoinx.build(geo);
   if (excerptintervals.size())
     excerptinterval=combine(excerptintervals);
   else
@@ -699,17 +722,10 @@ int main(int argc, char *argv[])
 	}
 	else
 	  outputgeoid.ghdr->excerpted=false;
-        for (i=0;i<6;i++)
-        {
-          //cout<<"Face "<<i+1;
-          //cout.flush();
-          interroquad(outputgeoid.cmap->faces[i],outputgeoid.ghdr->spacing);
-          /*if (cube.faces[i].isfull()>=0)
-            cout<<" has data"<<endl;
-          else
-            cout<<" is empty"<<endl;*/
-          refine(outputgeoid.cmap->faces[i],outputgeoid.cmap->scale,outputgeoid.ghdr->tolerance,outputgeoid.ghdr->sublimit,outputgeoid.ghdr->spacing,qsz,allBoldatni());
-        }
+        auto refineStart=chrono::steady_clock::now();
+        refineCube(*outputgeoid.cmap,outputgeoid.ghdr->spacing,outputgeoid.ghdr->tolerance,
+                   outputgeoid.ghdr->sublimit,outputgeoid.ghdr->spacing,qsz,allBoldatni(),nThreads);
+        refineSeconds=chrono::duration<double>(chrono::steady_clock::now()-refineStart).count();
         outProgress();
         cout<<endl;
         undrange=outputgeoid.cmap->undrange();
@@ -763,6 +779,14 @@ int main(int argc, char *argv[])
     if (didConvert && !conversionError)
     {
       cout<<"avgelev called "<<avgelev_interrocount<<" times from interroquad, "<<avgelev_refinecount<<" times from refine"<<endl;
+      if (refineSeconds>0)
+        cout<<"Refined in "<<ldecimal(refineSeconds,0.01)<<" s, "
+            <<rint((avgelev_interrocount+avgelev_refinecount)/refineSeconds)<<" samples per second"<<endl;
+#ifdef HAVE_SYS_RESOURCE_H
+      struct rusage usage;
+      if (getrusage(RUSAGE_SELF,&usage)==0)
+        cout<<"Peak memory "<<usage.ru_maxrss/1024<<" MiB"<<endl; // ru_maxrss is in KiB on Linux
+#endif
       cout<<"Computing error histogram"<<endl;
       errorHist=errorspread(bolTolerance);
       areaHist=quadsizes();
@@ -23,6 +23,7 @@
  */
 #include "globals.h"
 #include "pnezd.h"
+#include "binpoint.h"
 #include "document.h"
 #include "except.h"
 #include "penwidth.h"
@@ -91,6 +92,18 @@ int document::writepenzd(string fname)
   return ::writepenzd(this,fname,mscopy);
 }
 
+int document::readbinpoints(string fname,bool overwrite,int threads)
+// Binary point files are in meters, so they don't need ms.
+{
+  makepointlist(0);
+  return ::readbinpoints(this,fname,overwrite,threads);
+}
+
+int document::writebinpoints(string fname,bool compress)
+{
+  return ::writebinpoints(this,fname,compress);
+}
+
 void document::addobject(drawobj *obj)
 // The drawobj must be created with new; it will be destroyed with delete.
 {
@@ -60,6 +60,8 @@ public:
   int writepnezd(std::string fname);
   int readpenzd(std::string fname,bool overwrite=false);
   int writepenzd(std::string fname);
+  int readbinpoints(std::string fname,bool overwrite=false,int threads=1);
+  int writebinpoints(std::string fname,bool compress=false);
   void addobject(drawobj *obj); // obj must be created with new
   virtual void writeXml(std::ofstream &ofile);
   void changeOffset (xyz newOffset);
@@ -101,6 +101,10 @@ unsigned memHash(void *mem,unsigned len,unsigned previous)
   return previous;
 }
 
+drawobj::~drawobj()
+{
+}
+
 bsph drawobj::boundsphere()
 {
   bsph ret;
@@ -129,6 +133,11 @@ unsigned drawobj::hash()
   return 0;
 }
 
+drawobj *drawobj::clone()
+{
+  return nullptr;
+}
+
 double drawobj::dirbound(int angle,double boundsofar)
 {
   return INFINITY;
@@ -110,6 +110,7 @@ class drawobj
  */
 {
 public:
+  virtual ~drawobj();
   virtual bsph boundsphere();
   virtual bool hittest(hline hitline);
   virtual void _roscat(xy tfrom,int ro,double sca,xy cis,xy tto)
@@ -117,6 +118,11 @@ public:
   }
   virtual void roscat(xy tfrom,int ro,double sca,xy tto); // rotate, scale, translate
   virtual unsigned hash();
+  virtual drawobj *clone();
+  /* Returns a new copy, which the caller deletes, or nullptr if the class
+   * can't be copied. Used to render in the background while the original
+   * may change.
+   */
   virtual double dirbound(int angle,double boundsofar=INFINITY);
   virtual std::vector<drawingElement> render3d(double precision,int layer,int color,int width,int linetype);
   /* render3d is normally called with layer=-1 and color, width, and linetype
@@ -23,6 +23,8 @@
  */
 
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include "dxf.h"
 #include "binio.h"
 #include "textfile.h"
@@ -74,7 +76,7 @@ TagRange tagTable[]=
   {1072,0}
 };
 
-int tagFormat(int tag)
+static int searchTagFormat(int tag)
 {
   int lo=0,hi=sizeof(tagTable)/sizeof(tagTable[0]),mid;
   while (hi-lo>1)
@@ -91,6 +93,27 @@ int tagFormat(int tag)
     return tagTable[lo].format;
 }
 
+static array<unsigned char,1072> makeFormatTable()
+{
+  int i;
+  array<unsigned char,1072> ret;
+  for (i=0;i<ret.size();i++)
+    ret[i]=searchTagFormat(i);
+  return ret;
+}
+
+int tagFormat(int tag)
+/* Looks up the format of tag directly, since GroupCode looks it up at least
+ * twice for each code read. All tags 1072 and above are invalid.
+ */
+{
+  static const array<unsigned char,1072> formats=makeFormatTable();
+  if (tag<0 || tag>=formats.size())
+    return 0;
+  else
+    return formats[tag];
+}
+
 GroupCode::GroupCode()
 {
   tag=-1;
@@ -334,6 +357,214 @@ GroupCode readDxfBinary(istream &file)
   return ret;
 }
 
+class DxfBuffer
+/* Reads a DXF file a block at a time, so that group codes can be parsed
+ * where they lie in the buffer, instead of a byte at a time from the stream.
+ * Lines end as in TextFile: the first CR or LF seen ends every line, and
+ * the other is dropped.
+ */
+{
+public:
+  DxfBuffer(istream &fil);
+  bool fill(size_t n);
+  const char *find(char c);
+  bool getline(string &line);
+  const char *ptr,*end;
+private:
+  istream *file;
+  vector<char> buf;
+  int lineend;
+};
+
+DxfBuffer::DxfBuffer(istream &fil)
+{
+  file=&fil;
+  buf.resize(65536);
+  ptr=end=buf.data();
+  lineend=-2;
+}
+
+bool DxfBuffer::fill(size_t n)
+// Makes at least n bytes available at ptr. Returns false at end of file.
+{
+  size_t have=end-ptr;
+  if (have<n)
+  {
+    memmove(buf.data(),ptr,have);
+    if (n>buf.size())
+      buf.resize(max(n,2*buf.size()));
+    ptr=buf.data();
+    end=ptr+have;
+    if (file->good())
+    {
+      file->read(buf.data()+have,buf.size()-have);
+      end+=file->gcount();
+    }
+  }
+  return end-ptr>=n;
+}
+
+const char *DxfBuffer::find(char c)
+// Returns where the next c is, or nullptr if there is none before the end.
+{
+  size_t searched=0;
+  const char *p;
+  while (!(p=(const char *)memchr(ptr+searched,c,end-ptr-searched)))
+  {
+    searched=end-ptr;
+    if (!fill(searched+1))
+      return nullptr;
+  }
+  return p;
+}
+
+bool DxfBuffer::getline(string &line)
+/* Returns false if the file ends before the line does, which TextFile
+ * also treats as the end.
+ */
+{
+  const char *p=nullptr;
+  size_t i;
+  char other;
+  if (lineend<0)
+    for (i=0;!p;i++)
+    {
+      if (!fill(i+1))
+	return false;
+      if (ptr[i]=='\n' || ptr[i]=='\r')
+      {
+	lineend=ptr[i];
+	p=ptr+i;
+      }
+    }
+  else
+    p=find(lineend);
+  if (!p)
+    return false;
+  other=(lineend=='\n')?'\r':'\n';
+  line.assign(ptr,p);
+  if (line.find(other)!=string::npos)
+    line.erase(remove(line.begin(),line.end(),other),line.end());
+  ptr=p+1;
+  return true;
+}
+
+bool readDxfText(istream &file,function<void(const GroupCode &)> sink)
+/* Keeps one GroupCode for strings and one for numbers, and reuses them,
+ * so that reading a group code allocates nothing.
+ */
+{
+  DxfBuffer buf(file);
+  string tagstr,datastr;
+  GroupCode strCode(0),numCode(10);
+  GroupCode *code;
+  char *numEnd;
+  int tag;
+  while (buf.getline(tagstr) && buf.getline(datastr))
+  {
+    tag=strtol(tagstr.c_str(),&numEnd,10);
+    if (numEnd==tagstr.c_str())
+      return false;
+    code=((tagFormat(tag)&-2)==128)?&strCode:&numCode;
+    code->tag=tag;
+    numEnd=nullptr;
+    switch (tagFormat(tag))
+    {
+      case 0:
+	return false;
+      case 1: // bools are stored in text as numbers
+	code->flag=strtol(datastr.c_str(),&numEnd,10)!=0;
+	break;
+      case 2:
+      case 4:
+      case 8:
+	code->integer=strtoll(datastr.c_str(),&numEnd,10);
+	break;
+      case 72:
+	code->real=strtod(datastr.c_str(),&numEnd);
+	break;
+      case 128:
+	code->str=datastr;
+	break;
+      case 129:
+	code->str=hexDecodeString(datastr);
+	break;
+      case 132:
+	code->integer=hexDecodeInt(datastr);
+	break;
+    }
+    if (numEnd==datastr.c_str()) // stoi and the like would throw
+      return false;
+    sink(*code);
+  }
+  return true;
+}
+
+bool readDxfBinary(istream &file,function<void(const GroupCode &)> sink)
+// Call readDxfMagic first. A code cut off by the end of the file is dropped.
+{
+  DxfBuffer buf(file);
+  GroupCode strCode(0),numCode(10);
+  GroupCode *code;
+  const char *strEnd;
+  int tag,fmt;
+  while (buf.fill(2))
+  {
+    tag=readleshort(buf.ptr);
+    buf.ptr+=2;
+    fmt=tagFormat(tag);
+    if (fmt==0)
+      return false;
+    code=((fmt&-2)==128)?&strCode:&numCode;
+    code->tag=tag;
+    if (fmt>=128)
+    {
+      strEnd=buf.find(0);
+      if (!strEnd)
+	break;
+      switch (fmt)
+      {
+	case 128:
+	  code->str.assign(buf.ptr,strEnd);
+	  break;
+	case 129:
+	  code->str=hexDecodeString(string(buf.ptr,strEnd));
+	  break;
+	case 132:
+	  code->integer=hexDecodeInt(string(buf.ptr,strEnd));
+	  break;
+      }
+      buf.ptr=strEnd+1;
+    }
+    else
+    {
+      if (!buf.fill(fmt&15))
+	break;
+      switch (fmt)
+      {
+	case 1:
+	  code->flag=*buf.ptr;
+	  break;
+	case 2:
+	  code->integer=readleshort(buf.ptr);
+	  break;
+	case 4:
+	  code->integer=readleint(buf.ptr);
+	  break;
+	case 8:
+	  code->integer=readlelong(buf.ptr);
+	  break;
+	case 72:
+	  code->real=readledouble(buf.ptr);
+	  break;
+      }
+      buf.ptr+=fmt&15;
+    }
+    sink(*code);
+  }
+  return true;
+}
+
 void writeDxfText(std::ostream &file,GroupCode code)
 {
   string tagstr,datastr;
@@ -471,44 +702,81 @@ vector<GroupCode> readDxfGroups(string filename)
   return ret;
 }
 
-vector<array<xyz,3> > extractTriangles(vector<GroupCode> dxfData)
-/* Scans dxfData looking for 3DFACE objects, extracting the first three
- * corners of each. The fourth corner is ignored. It should be the same as
- * one of the first three. If it isn't, the 3DFACE is a quadrilateral,
- * which might should be turned into two triangles.
+TriangleExtractor::TriangleExtractor()
+{
+  ncoords=16;
+}
+
+void TriangleExtractor::clear()
+{
+  ncoords=16;
+  triangles.clear();
+}
+
+void TriangleExtractor::add(const GroupCode &code)
+/* Looks for 3DFACE objects, extracting the first three corners of each.
+ * The fourth corner is ignored. It should be the same as one of the first
+ * three. If it isn't, the 3DFACE is a quadrilateral, which might should be
+ * turned into two triangles.
  * 
- * This function ignores sections; if there's a 3DFACE in the BLOCKS section,
+ * This ignores sections; if there's a 3DFACE in the BLOCKS section,
  * it will output it once, not every place the block is used.
  */
 {
-  int i,ncorner,coord;
-  array<xyz,3> face;
-  vector<array<xyz,3> > ret;
-  int ncoords=16;
+  int ncorner,coord;
+  if (code.tag==0 && code.str=="3DFACE")
+    ncoords=0;
+  if (ncoords<12 && code.tag>=10 && code.tag<40)
+  {
+    coord=code.tag/10;
+    ncorner=code.tag%10;
+    if (ncorner<3)
+      switch (coord)
+      {
+	case 1:
+	  face[ncorner]=xyz(code.real,face[ncorner].gety(),face[ncorner].getz());
+	  break;
+	case 2:
+	  face[ncorner]=xyz(face[ncorner].getx(),code.real,face[ncorner].getz());
+	  break;
+	case 3:
+	  face[ncorner]=xyz(face[ncorner].getx(),face[ncorner].gety(),code.real);
+	  break;
+      }
+    if (12==++ncoords)
+      triangles.push_back(face);
+  }
+}
+
+vector<array<xyz,3> > extractTriangles(const vector<GroupCode> &dxfData)
+{
+  int i;
+  TriangleExtractor extractor;
   for (i=0;i<dxfData.size();i++)
+    extractor.add(dxfData[i]);
+  return extractor.triangles;
+}
+
+vector<array<xyz,3> > readDxfTriangles(string filename)
+/* Same as extractTriangles(readDxfGroups(filename)), but extracts the
+ * triangles as the file is read, without holding all its group codes.
+ */
+{
+  int mode;
+  bool valid;
+  ifstream file;
+  TriangleExtractor extractor;
+  auto sink=[&](const GroupCode &code){extractor.add(code);};
+  for (mode=0;mode<2 && extractor.triangles.size()==0;mode++)
   {
-    if (dxfData[i].tag==0 && dxfData[i].str=="3DFACE")
-      ncoords=0;
-    if (ncoords<12 && dxfData[i].tag>=10 && dxfData[i].tag<40)
-    {
-      coord=dxfData[i].tag/10;
-      ncorner=dxfData[i].tag%10;
-      if (ncorner<3)
-	switch (coord)
-	{
-	  case 1:
-	    face[ncorner]=xyz(dxfData[i].real,face[ncorner].gety(),face[ncorner].getz());
-	    break;
-	  case 2:
-	    face[ncorner]=xyz(face[ncorner].getx(),dxfData[i].real,face[ncorner].getz());
-	    break;
-	  case 3:
-	    face[ncorner]=xyz(face[ncorner].getx(),face[ncorner].gety(),dxfData[i].real);
-	    break;
-	}
-      if (12==++ncoords)
-	ret.push_back(face);
-    }
+    file.open(filename,ios::binary);
+    if (mode)
+      valid=readDxfText(file,sink);
+    else
+      valid=readDxfMagic(file) && readDxfBinary(file,sink);
+    file.close();
+    if (!valid)
+      extractor.clear();
   }
-  return ret;
+  return move(extractor.triangles);
 }
@@ -25,6 +25,7 @@
 #include <fstream>
 #include <vector>
 #include <array>
+#include <functional>
 #include "xyz.h"
 
 struct TagRange
@@ -73,4 +74,28 @@ void writeDxfText(std::ostream &file,GroupCode code);
 void writeDxfBinary(std::ostream &file,GroupCode code);
 std::vector<GroupCode> readDxfGroups(std::istream &file,bool mode);
 std::vector<GroupCode> readDxfGroups(std::string filename);
-std::vector<std::array<xyz,3> > extractTriangles(std::vector<GroupCode> dxfData);
+
+class TriangleExtractor
+/* Picks the first three corners of each 3DFACE out of group codes, which
+ * can be fed to it one at a time as they are read.
+ */
+{
+public:
+  TriangleExtractor();
+  void clear();
+  void add(const GroupCode &code);
+  std::vector<std::array<xyz,3> > triangles;
+private:
+  int ncoords;
+  std::array<xyz,3> face;
+};
+
+/* These read group codes and pass each to sink as it is read, keeping
+ * none of them. They return false if the file isn't DXF in that form.
+ */
+bool readDxfText(std::istream &file,std::function<void(const GroupCode &)> sink);
+bool readDxfBinary(std::istream &file,std::function<void(const GroupCode &)> sink);
+bool readDxfMagic(std::istream &file);
+void writeDxfMagic(std::ostream &file);
+std::vector<std::array<xyz,3> > extractTriangles(const std::vector<GroupCode> &dxfData);
+std::vector<std::array<xyz,3> > readDxfTriangles(std::string filename);
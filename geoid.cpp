@@ -28,12 +28,15 @@
 #include <algorithm>
 #include <cassert>
 #include <map>
+#include <mutex>
 #include "except.h"
 #include "geoid.h"
 #include "binio.h"
 #include "angle.h"
 #include "ldecimal.h"
 #include "config.h"
+#include <fstream>
+#include <streambuf>
 using namespace std;
 
 /* face=0: point is the center of the earth
@@ -89,6 +92,9 @@ using namespace std;
  */
 
 cubemap cube;
+atomic<long long> leafCacheHits(0),leafCacheMisses(0);
+static atomic<unsigned> lastGeneration(0);
+static thread_local leafcache leafCache;
 
 double cylinterval::area()
 {
@@ -377,6 +383,59 @@ bool geoquad::isValidLeaf()
   return ret;
 }
 
+/* Subquads are allocated four at a time from chunks of QUADCHUNK blocks,
+ * instead of one at a time with new, which saves the allocator's overhead
+ * on each of millions of geoquads and keeps siblings together. Freed blocks
+ * are kept for reuse. The pool is never destroyed, since geoquads in global
+ * variables may be destroyed after it at exit.
+ */
+#define QUADCHUNK 1024
+
+struct geoquadpool
+{
+  mutex poolMutex;
+  vector<geoquad *> freeBlocks;
+};
+
+geoquadpool &quadPool()
+{
+  static geoquadpool *pool=new geoquadpool;
+  return *pool;
+}
+
+geoquad *allocQuads()
+{
+  int i;
+  geoquad *ret;
+  geoquadpool &pool=quadPool();
+  lock_guard<mutex> lock(pool.poolMutex);
+  if (pool.freeBlocks.empty())
+  {
+    ret=new geoquad[4*QUADCHUNK];
+    for (i=QUADCHUNK-1;i>=0;i--)
+      pool.freeBlocks.push_back(ret+4*i);
+  }
+  ret=pool.freeBlocks.back();
+  pool.freeBlocks.pop_back();
+  return ret;
+}
+
+void freeQuads(geoquad *block)
+// block must be a block of four geoquads from allocQuads.
+{
+  int i;
+  geoquadpool &pool=quadPool();
+  for (i=0;i<4;i++)
+  {
+    block[i].clear();
+#ifdef NUMSGEOID
+    block[i].releaseSamples();
+#endif
+  }
+  lock_guard<mutex> lock(pool.poolMutex);
+  pool.freeBlocks.push_back(block);
+}
+
 geoquad::geoquad()
 {
   int i;
@@ -390,10 +449,8 @@ geoquad::geoquad()
 
 geoquad::~geoquad()
 {
-  int i;
   if (subdivided())
-    for (i=0;i<4;i++)
-      delete(sub[i]);
+    freeQuads(sub[0]);
 }
 
 geoquad::geoquad(const geoquad& b)
@@ -402,8 +459,12 @@ geoquad::geoquad(const geoquad& b)
   if (b.subdivided())
   {
     und[5]=INT_MIN;
+    sub[0]=allocQuads();
     for (i=0;i<4;i++)
-      sub[i]=new geoquad(*b.sub[i]);
+    {
+      sub[i]=sub[0]+i;
+      *sub[i]=*b.sub[i];
+    }
   }
   else
   {
@@ -415,8 +476,8 @@ geoquad::geoquad(const geoquad& b)
   scale=b.scale;
   face=b.face;
 #ifdef NUMSGEOID
-  nums=b.nums;
-  nans=b.nans;
+  if (b.samples)
+    samples.reset(new geosamples(*b.samples));
 #endif
 }
 
@@ -430,8 +491,7 @@ geoquad& geoquad::operator=(geoquad b)
   swap(scale,b.scale);
   swap(face,b.face);
 #ifdef NUMSGEOID
-  swap(nums,b.nums);
-  swap(nans,b.nans);
+  swap(samples,b.samples);
 #endif
   return *this;
 }
@@ -440,8 +500,7 @@ void geoquad::clear()
 {
   int i;
   if (subdivided())
-    for (i=0;i<4;i++)
-      delete(sub[i]);
+    freeQuads(sub[0]);
   for (i=0;i<4;i++)
     sub[i]=nullptr;
   for (i=1;i<6;i++)
@@ -465,30 +524,52 @@ void geoquad::subdivide()
  */
 {
   int i,j;
+  geoquad *block=allocQuads();
   und[5]=0x80000000;
   for (i=0;i<4;i++)
   {
-    sub[i]=new(geoquad);
+    sub[i]=block+i;
     sub[i]->scale=scale/2;
     sub[i]->face=face;
     sub[i]->center=xy(center.east()+scale/((i&1)?2:-2),center.north()+scale/((i&2)?2:-2));
 #ifdef NUMSGEOID
-    for (j=0;j<nans.size();j++)
-      if (sub[i]->in(nans[j]))
-	sub[i]->nans.push_back(nans[j]);
-    for (j=0;j<nums.size();j++)
-      if (sub[i]->in(nums[j]))
-	sub[i]->nums.push_back(nums[j]);
+    if (samples)
+    {
+      for (j=0;j<samples->nans.size();j++)
+	if (sub[i]->in(samples->nans[j]))
+	  sub[i]->nans().push_back(samples->nans[j]);
+      for (j=0;j<samples->nums.size();j++)
+	if (sub[i]->in(samples->nums[j]))
+	  sub[i]->nums().push_back(samples->nums[j]);
+    }
 #endif
   }
 #ifdef NUMSGEOID
-  nans.clear();
-  nums.clear();
-  nans.shrink_to_fit();
-  nums.shrink_to_fit();
+  releaseSamples();
 #endif
 }
 
+#ifdef NUMSGEOID
+vector<xy> &geoquad::nans()
+{
+  if (!samples)
+    samples.reset(new geosamples);
+  return samples->nans;
+}
+
+vector<xy> &geoquad::nums()
+{
+  if (!samples)
+    samples.reset(new geosamples);
+  return samples->nums;
+}
+
+void geoquad::releaseSamples()
+{
+  samples.reset();
+}
+#endif
+
 void geoquad::filldepth(int depth)
 /* Makes all subdivisions at depth depth exist, if they don't already.
  * The number of leaves after this operation is at least 4**depth.
@@ -564,25 +645,43 @@ geoquadMatch geoquad::match(double x,double y)
   return ret;
 }
 
+static double leafUndulation(const int *und,double x,double y)
+{
+  double u;
+  u=(und[0]+und[1]*x+und[2]*y+und[3]*(x*x-1/3.)+und[4]*x*y+und[5]*(y*y-1/3.));
+  if (u>8850*65536 || u<-11000*65536)
+    u=NAN;
+  return u;
+}
+
 double geoquad::undulation(double x,double y)
+{
+  geoquad *lf=leaf(x,y);
+  return leafUndulation(lf->und,x,y);
+}
+
+geoquad *geoquad::leaf(double &x,double &y)
+/* Returns the leaf containing (x,y) and changes x and y to the leaf's
+ * coordinates. The subquad is chosen by comparing with its center, which
+ * is exact, and x and y are scaled once at the end, so that a point found
+ * in the leaf cache gets exactly the same coordinates.
+ */
 {
   int xbit,ybit;
-  double u;
-  if (subdivided())
+  double cx=0,cy=0,s=1;
+  geoquad *ret=this;
+  while (ret->subdivided())
   {
-    xbit=x>=0;
-    ybit=y>=0;
-    x=2*(x-(xbit-0.5));
-    y=2*(y-(ybit-0.5));
-    u=sub[(ybit<<1)|xbit]->undulation(x,y);
+    xbit=x>=cx;
+    ybit=y>=cy;
+    s/=2;
+    cx+=xbit?s:-s;
+    cy+=ybit?s:-s;
+    ret=ret->sub[(ybit<<1)|xbit];
   }
-  else
-  {
-    u=(und[0]+und[1]*x+und[2]*y+und[3]*(x*x-1/3.)+und[4]*x*y+und[5]*(y*y-1/3.));
-    if (u>8850*65536 || u<-11000*65536)
-      u=NAN;
-  }
-  return u;
+  x=(x-cx)/s;
+  y=(y-cy)/s;
+  return ret;
 }
 
 xyz geoquad::centeronearth()
@@ -645,7 +744,10 @@ int geoquad::isfull()
  * Returns 1 if all points tested have geoid data.
  */
 {
-  return (nums.size()>0)-(nans.size()>0);
+  if (samples)
+    return (samples->nums.size()>0)-(samples->nans.size()>0);
+  else
+    return 0;
 }
 #endif
 
@@ -983,13 +1085,26 @@ cubemap::cubemap()
   int i;
   for (i=0;i<6;i++)
     faces[i].face=i+1;
+  uncache();
 }
 
 void cubemap::clear()
 {
   int i;
+  mapped.reset();
   for (i=0;i<6;i++)
     faces[i].clear();
+  uncache();
+}
+
+void cubemap::uncache()
+/* Starts a new generation, so that leaves cached from the old one,
+ * on any thread, are no longer found.
+ */
+{
+  generation=++lastGeneration;
+  if (!generation) // wrapped around; 0 marks an unused cache entry
+    generation=++lastGeneration;
 }
 
 cubemap::~cubemap()
@@ -1008,16 +1123,184 @@ double cubemap::undulation(latlong ll)
 }
 
 double cubemap::undulation(xyz dir)
+/* Looks in this thread's leaf cache first. On a miss, finds the leaf
+ * and puts it in the cache.
+ */
 {
   vball v=encodedir(dir);
+  cachedleaf *cl;
+  geoquad *lf;
   if (v.face<1 || v.face>6)
     return NAN;
+  cl=leafCache.find(generation,v);
+  if (cl)
+    leafCacheHits.fetch_add(1,memory_order_relaxed);
   else
-    return faces[v.face-1].undulation(v.x,v.y)*scale;
+  {
+    leafCacheMisses.fetch_add(1,memory_order_relaxed);
+    cl=&leafCache.add();
+    if (mapped)
+    {
+      geoquad leaf;
+      mapped->readLeaf(mapped->leafOffset(v,cl->center,cl->scale),leaf);
+      memcpy(cl->und,leaf.und,sizeof(cl->und));
+    }
+    else
+    {
+      double x=v.x,y=v.y;
+      lf=faces[v.face-1].leaf(x,y);
+      cl->center=lf->center;
+      cl->scale=lf->scale;
+      memcpy(cl->und,lf->und,sizeof(cl->und));
+    }
+    cl->face=v.face;
+    cl->generation=generation;
+  }
+  return leafUndulation(cl->und,(v.x-cl->center.getx())/cl->scale,(v.y-cl->center.gety())/cl->scale)*scale;
+}
+
+static void undulationRun(const int *und,const double *x,const double *y,double *u,int n,double scale)
+/* Evaluates one leaf at n points, the same way as geoquad::undulation.
+ * There are no branches except the range check, so the compiler can
+ * vectorize it.
+ */
+{
+  int i;
+  double ui;
+  for (i=0;i<n;i++)
+  {
+    ui=(und[0]+und[1]*x[i]+und[2]*y[i]+und[3]*(x[i]*x[i]-1/3.)+und[4]*x[i]*y[i]+und[5]*(y[i]*y[i]-1/3.));
+    u[i]=((ui>8850*65536 || ui<-11000*65536)?NAN:ui)*scale;
+  }
+}
+
+void cubemap::undulations(const vector<xyz> &dirs,double *und)
+/* Same as calling undulation on each of dirs, but finds every point's leaf
+ * first, then sorts the points by leaf, so that each leaf is decoded (if
+ * mapped) and loaded once and evaluated at all its points together.
+ */
+{
+  int i,j,n=dirs.size();
+  vball v;
+  xy center;
+  double lscale;
+  geoquad leaf;
+  vector<long long> key(n); // -1 if no face, else pointer to or offset of leaf
+  vector<double> x(n),y(n),xs(n),ys(n),us(n);
+  vector<int> order(n);
+  for (i=0;i<n;i++)
+  {
+    v=encodedir(dirs[i]);
+    x[i]=v.x;
+    y[i]=v.y;
+    order[i]=i;
+    if (v.face<1 || v.face>6)
+      key[i]=-1;
+    else if (mapped)
+    {
+      key[i]=mapped->leafOffset(v,center,lscale);
+      x[i]=(x[i]-center.getx())/lscale;
+      y[i]=(y[i]-center.gety())/lscale;
+    }
+    else
+      key[i]=(uintptr_t)faces[v.face-1].leaf(x[i],y[i]);
+  }
+  sort(order.begin(),order.end(),[&key](int a,int b){return key[a]<key[b];});
+  for (i=0;i<n;i++)
+  {
+    xs[i]=x[order[i]];
+    ys[i]=y[order[i]];
+  }
+  for (i=0;i<n;i=j)
+  {
+    for (j=i+1;j<n && key[order[j]]==key[order[i]];j++);
+    if (key[order[i]]<0)
+      fill(us.begin()+i,us.begin()+j,NAN);
+    else if (mapped)
+    {
+      mapped->readLeaf(key[order[i]],leaf);
+      undulationRun(leaf.und,&xs[i],&ys[i],&us[i],j-i,scale);
+    }
+    else
+      undulationRun(((geoquad *)(uintptr_t)key[order[i]])->und,&xs[i],&ys[i],&us[i],j-i,scale);
+  }
+  for (i=0;i<n;i++)
+    und[order[i]]=us[i];
+}
+
+vector<double> cubemap::undulations(const vector<xyz> &dirs)
+{
+  vector<double> ret(dirs.size());
+  undulations(dirs,ret.data());
+  return ret;
+}
+
+vector<double> cubemap::undulations(const vector<latlong> &lls)
+{
+  int i;
+  vector<xyz> dirs;
+  for (i=0;i<lls.size();i++)
+    dirs.push_back(Sphere.geoc(lls[i],0));
+  return undulations(dirs);
+}
+
+leafcache::leafcache()
+{
+  int i;
+  for (i=0;i<LEAFCACHE_SIZE;i++)
+    leaves[i].generation=0;
+  last=next=0;
+}
+
+cachedleaf *leafcache::find(unsigned generation,const vball &v)
+/* Looks first at the leaf last found, then at the others. A point on the
+ * boundary between two leaves goes to the east or north one, as in
+ * geoquad::leaf, except on the east and north edges of the face.
+ */
+{
+  int i,n;
+  cachedleaf *cl;
+  for (i=0;i<LEAFCACHE_SIZE;i++)
+  {
+    n=(last+i)%LEAFCACHE_SIZE;
+    cl=&leaves[n];
+    if (cl->generation==generation && cl->face==v.face &&
+        v.x>=cl->center.getx()-cl->scale && v.y>=cl->center.gety()-cl->scale &&
+        (v.x<cl->center.getx()+cl->scale || v.x==1) &&
+        (v.y<cl->center.gety()+cl->scale || v.y==1) &&
+        v.x<=cl->center.getx()+cl->scale && v.y<=cl->center.gety()+cl->scale)
+    {
+      last=n;
+      return cl;
+    }
+  }
+  return nullptr;
+}
+
+cachedleaf &leafcache::add()
+// Returns the entry to fill in, the oldest one.
+{
+  last=next;
+  next=(next+1)%LEAFCACHE_SIZE;
+  return leaves[last];
+}
+
+geoquad *cubemap::wholeFaces(vector<geoquad> &loaded)
+/* Returns faces, or if the cubemap is mapped, decodes the mapping into
+ * loaded and returns that.
+ */
+{
+  if (!mapped)
+    return faces;
+  loaded.resize(6);
+  mapped->readFaces(&loaded[0]);
+  return &loaded[0];
 }
 
 geoquadMatch cubemap::match(geoquad &quad)
 {
+  if (mapped)
+    throw unsetGeoid;
   return faces[quad.face-1].match(quad.center.getx(),quad.center.gety());
 }
 
@@ -1026,9 +1309,12 @@ array<unsigned,2> cubemap::hash()
   array<unsigned,2> ret,subhash;
   array<unsigned,12> subhashes;
   int i;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   for (i=0;i<6;i++)
   {
-    subhash=faces[i].hash();
+    subhash=face[i].hash();
     subhashes[2*i]=subhash[0];
     subhashes[2*i+1]=subhash[1];
   }
@@ -1044,9 +1330,12 @@ vector<cylinterval> cubemap::boundrects()
 {
   vector<cylinterval> ret,subret;
   int i,j;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   for (i=0;i<6;i++)
   {
-    subret=faces[i].boundrects();
+    subret=face[i].boundrects();
     for (j=0;j<subret.size();j++)
       ret.push_back(subret[j]);
   }
@@ -1057,9 +1346,12 @@ vector<double> cubemap::areas()
 {
   vector<double> ret,subret;
   int i,j;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   for (i=0;i<6;i++)
   {
-    subret=faces[i].areas();
+    subret=face[i].areas();
     for (j=0;j<subret.size();j++)
       ret.push_back(subret[j]);
   }
@@ -1074,8 +1366,11 @@ cylinterval cubemap::boundrect()
 gboundary cubemap::gbounds()
 {
   gboundary ret;
-  ret=faces[0].gbounds()+faces[1].gbounds()+faces[2].gbounds()+
-      faces[3].gbounds()+faces[4].gbounds()+faces[5].gbounds();
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
+  ret=face[0].gbounds()+face[1].gbounds()+face[2].gbounds()+
+      face[3].gbounds()+face[4].gbounds()+face[5].gbounds();
   ret.consolidate(0);
   ret.splitoff(0);
   ret.deleteCollinear();
@@ -1087,38 +1382,261 @@ gboundary cubemap::gbounds()
 void cubemap::writeBinary(ostream &ofile)
 {
   int i;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   for (i=0;i<6;i++)
-    faces[i].writeBinary(ofile);
+    face[i].writeBinary(ofile);
 }
 
 void cubemap::readBinary(istream &ifile)
 {
   int i;
+  mapped.reset();
   for (i=0;i<6;i++)
     faces[i].readBinary(ifile);
+  uncache();
+}
+
+void cubemap::mapBinary(string filename,long long offset)
+/* Maps the cubemap which starts at offset in filename, which is normally
+ * where geoheader::readBinary left off. Throws badData if the file is bad,
+ * in which case the cubemap is left as it was.
+ */
+{
+  shared_ptr<mappedcube> newMap=make_shared<mappedcube>(filename,offset);
+  clear();
+  mapped=newMap;
+}
+
+class membuf: public streambuf
+// Reads from memory, so that readgeint can decode a mapped file.
+{
+public:
+  membuf(const char *begin,size_t size)
+  {
+    char *b=const_cast<char *>(begin);
+    setg(b,b,b+size);
+  }
+protected:
+  pos_type seekoff(off_type off,ios_base::seekdir dir,ios_base::openmode which) override
+  {
+    char *p;
+    if (dir==ios_base::beg)
+      p=eback()+off;
+    else if (dir==ios_base::cur)
+      p=gptr()+off;
+    else
+      p=egptr()+off;
+    if (p<eback() || p>egptr())
+      return pos_type(off_type(-1));
+    setg(eback(),p,egptr());
+    return pos_type(p-eback());
+  }
+  pos_type seekpos(pos_type pos,ios_base::openmode which) override
+  {
+    return seekoff(off_type(pos),ios_base::beg,which);
+  }
+};
+
+#define MAPGRAIN 4096
+
+mappedcube::mappedcube(string filename,long long offset):file(filename)
+{
+  int i;
+  data=file.data();
+  size=file.size();
+  start=offset;
+  if (offset<0 || offset>(long long)size)
+    throw BeziExcept(badData);
+  membuf buf(data,size);
+  istream in(&buf);
+  in.seekg(offset);
+  for (i=0;i<6;i++)
+    root[i]=scan(in,-1,0);
+  if (!in)
+    throw BeziExcept(badData);
+}
+
+int mappedcube::indexSize()
+{
+  return nodes.size();
+}
+
+int mappedcube::scan(istream &in,int nesting,int depth)
+/* Reads a geoquad the same way as geoquad::readBinary, but keeps only
+ * where it starts and, if it's big, where its subquads start.
+ */
+{
+  int i,n=nodes.size(),kids[4];
+  long long start=in.tellg();
+  mapnode node;
+  geoquad leaf;
+  node.offset=start;
+  node.nesting=nesting;
+  for (i=0;i<4;i++)
+    node.kid[i]=-1;
+  nodes.push_back(node);
+  if (nesting<0)
+    nesting=in.get();
+  if (nesting<0 || nesting>56 || depth>56 || !in)
+    throw BeziExcept(badData);
+  if (nesting>0)
+  {
+    for (i=0;i<4;i++)
+    {
+      kids[i]=scan(in,nesting-1,depth+1);
+      nesting=0;
+    }
+    if ((long long)in.tellg()-start<MAPGRAIN)
+      nodes.resize(n+1);
+    else
+      for (i=0;i<4;i++)
+	nodes[n].kid[i]=kids[i];
+  }
+  else
+  {
+    leaf.und[0]=readgeint(in);
+    if (!leaf.isnan())
+      for (i=1;i<6;i++)
+	leaf.und[i]=readgeint(in);
+    if (!leaf.isValidLeaf() || !in)
+      throw BeziExcept(badData);
+  }
+  return n;
+}
+
+void mappedcube::skip(istream &in,int nesting)
+{
+  int i,und0;
+  if (nesting<0)
+    nesting=in.get();
+  if (nesting>0)
+    for (i=0;i<4;i++)
+    {
+      skip(in,nesting-1);
+      nesting=0;
+    }
+  else
+  {
+    und0=readgeint(in);
+    if (!(und0>8850*65536 || und0<-11000*65536))
+      for (i=1;i<6;i++)
+	readgeint(in);
+  }
+}
+
+double mappedcube::undulation(vball v)
+{
+  xy center;
+  double scale;
+  geoquad leaf;
+  if (v.face<1 || v.face>6)
+    return NAN;
+  readLeaf(leafOffset(v,center,scale),leaf);
+  return leaf.undulation((v.x-center.getx())/scale,(v.y-center.gety())/scale);
+}
+
+long long mappedcube::leafOffset(vball v,xy &center,double &scale)
+/* Returns where the undulations of the leaf containing v start, and sets
+ * center and scale to the leaf's, in the same way as geoquad::leaf.
+ * v must be on a face.
+ */
+{
+  int i,n,q,nesting;
+  int xbit,ybit;
+  double cx=0,cy=0,s=1;
+  membuf buf(data,size);
+  istream in(&buf);
+  n=root[v.face-1];
+  while (true)
+  {
+    xbit=v.x>=cx;
+    ybit=v.y>=cy;
+    q=(ybit<<1)|xbit;
+    if (nodes[n].kid[q]<0)
+      break;
+    s/=2;
+    cx+=xbit?s:-s;
+    cy+=ybit?s:-s;
+    n=nodes[n].kid[q];
+  }
+  in.seekg(nodes[n].offset);
+  nesting=nodes[n].nesting;
+  if (nesting<0)
+    nesting=in.get();
+  while (nesting>0)
+  {
+    xbit=v.x>=cx;
+    ybit=v.y>=cy;
+    q=(ybit<<1)|xbit;
+    s/=2;
+    cx+=xbit?s:-s;
+    cy+=ybit?s:-s;
+    for (i=0;i<q;i++)
+      skip(in,i?-1:nesting-1);
+    if (q)
+      nesting=in.get();
+    else
+      nesting--;
+  }
+  center=xy(cx,cy);
+  scale=s;
+  return in.tellg();
+}
+
+void mappedcube::readLeaf(long long offset,geoquad &leaf)
+{
+  int i;
+  membuf buf(data,size);
+  istream in(&buf);
+  in.seekg(offset);
+  leaf.und[0]=readgeint(in);
+  for (i=1;i<6;i++)
+    leaf.und[i]=leaf.isnan()?0:readgeint(in);
+}
+
+void mappedcube::readFaces(geoquad *faces)
+// Decodes the whole cubemap, as cubemap::readBinary does.
+{
+  int i;
+  membuf buf(data,size);
+  istream in(&buf);
+  in.seekg(start);
+  for (i=0;i<6;i++)
+  {
+    faces[i].readBinary(in);
+    faces[i].face=i+1;
+  }
 }
 
 void cubemap::dump(ostream &ofile)
 {
   int i;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   ofile<<"Scale ";
   if (scale>0 && scale<1)
     ofile<<"1/"<<1/scale<<endl;
   else
     ofile<<scale<<endl;
   for (i=0;i<6;i++)
-    faces[i].dump(ofile);
+    face[i].dump(ofile);
 }
 
 array<int,6> cubemap::undrange()
 {
   int i,j;
   array<int,6> ret,subret;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   ret[0]=ret[2]=ret[4]=INT_MAX;
   ret[1]=ret[3]=ret[5]=INT_MIN;
   for (i=0;i<6;i++)
   {
-    subret=faces[i].undrange();
+    subret=face[i].undrange();
     for (j=0;j<6;j+=2)
     {
       if (subret[j]<ret[j])
@@ -1134,10 +1652,13 @@ array<int,5> cubemap::undhisto()
 {
   int i,j;
   array<int,5> ret,subret;
+  vector<geoquad> loaded;
+  geoquad *face;
+  face=wholeFaces(loaded);
   ret.fill(0);
   for (i=0;i<6;i++)
   {
-    subret=faces[i].undhisto();
+    subret=face[i].undhisto();
     for (j=0;j<5;j++)
     {
       ret[j]+=subret[j];
@@ -30,10 +30,14 @@
 #include <vector>
 #include <array>
 #include <cstring>
+#include <string>
+#include <memory>
+#include <atomic>
 #include "xyz.h"
 #include "ellipsoid.h"
 #include "vball.h"
 #include "geoidboundary.h"
+#include "binio.h"
 
 #define BOL_EARTH 0
 #define BOL_UNDULATION 0
@@ -42,6 +46,7 @@
 #define GQ_SUBDIVIDED 2
 #define GQ_MATCH 4
 #define GQ_PART 8
+#define LEAFCACHE_SIZE 8
 
 class gboundary;
 class geoquad;
@@ -69,7 +74,18 @@ struct geoquadMatch
   int flags;
 };
 
+#ifdef NUMSGEOID
+struct geosamples
+// Points where the source geoids were sampled, with and without data.
+{
+  std::vector<xy> nans,nums;
+};
+#endif
+
 class geoquad
+/* The four subquads are allocated together from a pool, so that sub[1],
+ * sub[2], and sub[3] follow sub[0] in memory.
+ */
 {
 public:
   union
@@ -81,7 +97,10 @@ public:
   float scale; // always a power of 2
   int face;
 #ifdef NUMSGEOID
-  std::vector<xy> nans,nums;
+  std::unique_ptr<geosamples> samples; // only while refining; use nans() and nums()
+  std::vector<xy> &nans();
+  std::vector<xy> &nums();
+  void releaseSamples();
 #endif
   bool subdivided() const;
   bool isnan();
@@ -99,6 +118,7 @@ public:
   bool in(vball pnt) const; // does check
   geoquadMatch match(double x,double y);
   double undulation(double x,double y);
+  geoquad *leaf(double &x,double &y); // changes x and y to the leaf's coordinates
   xyz centeronearth();
   double length(); // length, width, and apxarea are accurate only for small squares
   double width(); // and ignore the orientation of the square relative to the
@@ -120,18 +140,93 @@ public:
   std::array<int,5> undhisto();
 };
 
+class mappedcube
+/* The geoquads of a cubemap in a boldatni file, mapped into memory instead
+ * of read. Opening the file scans it once, checking it and indexing where
+ * each subtree larger than MAPGRAIN bytes starts, without making geoquads.
+ * A query starts at the deepest indexed quad containing the point and
+ * decodes only the nesting bytes and undulations from there to the leaf,
+ * skipping over smaller sibling subtrees. Queries don't change anything,
+ * so several threads can query at once.
+ */
+{
+public:
+  mappedcube(std::string filename,long long offset);
+  double undulation(vball v); // in file units, like geoquad::undulation
+  long long leafOffset(vball v,xy &center,double &scale);
+  void readLeaf(long long offset,geoquad &leaf);
+  void readFaces(geoquad *faces);
+  int indexSize();
+private:
+  struct mapnode
+  {
+    long long offset;
+    int nesting; // -1 if the nesting byte is at offset
+    int kid[4]; // -1 if not indexed
+  };
+  mappedfile file;
+  const char *data;
+  size_t size;
+  long long start;
+  std::vector<mapnode> nodes;
+  int root[6];
+  int scan(std::istream &in,int nesting,int depth);
+  void skip(std::istream &in,int nesting);
+};
+
+struct cachedleaf
+{
+  unsigned generation; // of the cubemap it came from; 0 if unused
+  int face;
+  xy center;
+  double scale;
+  int und[6];
+};
+
+class leafcache
+/* The last few leaves that undulation queries on one thread landed in,
+ * with their bounds in face coordinates. Site work queries many points
+ * within a few kilometers, which nearly all fall in the same few leaves,
+ * so most queries are answered without descending from the face.
+ */
+{
+public:
+  leafcache();
+  cachedleaf *find(unsigned generation,const vball &v);
+  cachedleaf &add();
+private:
+  cachedleaf leaves[LEAFCACHE_SIZE];
+  int last,next;
+};
+
 class cubemap
 {
 public:
   geoquad faces[6]; // note off-by-one: faces[0] is face 1, the Benin face
   double scale; // vertical scale, e.g. 1 means 1/65536 m. always a power of 2
+  std::shared_ptr<mappedcube> mapped;
+  /* If mapped is set, undulation uses it instead of faces, which are empty.
+   * The functions that look at the whole tree (hash, boundrects, gbounds,
+   * undrange, etc.) decode it from the mapping each time they're called.
+   * match returns pointers into faces, so it throws unsetGeoid.
+   */
+  unsigned generation;
+  /* Leaves in the leaf cache are good only for the generation they came from.
+   * clear, readBinary, and mapBinary start a new generation; anything else
+   * that changes faces must call uncache.
+   */
   std::array<unsigned,2> hash();
   cubemap();
   ~cubemap();
   void clear();
+  void uncache();
+  geoquad *wholeFaces(std::vector<geoquad> &loaded);
   double undulation(int lat,int lon);
   double undulation(latlong ll);
   double undulation(xyz dir);
+  void undulations(const std::vector<xyz> &dirs,double *und);
+  std::vector<double> undulations(const std::vector<xyz> &dirs);
+  std::vector<double> undulations(const std::vector<latlong> &lls);
   geoquadMatch match(geoquad &quad);
   std::vector<cylinterval> boundrects();
   std::vector<double> areas();
@@ -139,6 +234,7 @@ public:
   gboundary gbounds();
   void writeBinary(std::ostream &ofile);
   void readBinary(std::istream &ifile);
+  void mapBinary(std::string filename,long long offset);
   void dump(std::ostream &ofile);
   std::array<int,6> undrange();
   std::array<int,5> undhisto();
@@ -181,4 +277,5 @@ bool westof(cylinterval a,cylinterval b);
 cylinterval combine(std::vector<cylinterval> cyls);
 
 extern cubemap cube;
+extern std::atomic<long long> leafCacheHits,leafCacheMisses;
 #endif
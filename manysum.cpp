@@ -28,7 +28,7 @@
 #include "manysum.h"
 using namespace std;
 
-int manysum::cnt=0;
+thread_local int manysum::cnt=0;
 
 void manysum::clear()
 {
@@ -46,7 +46,7 @@ class manysum
 {
 private:
   std::map<int,double> bucket;
-  static int cnt;
+  static thread_local int cnt;
 public:
   void clear();
   void prune();
@@ -450,6 +450,7 @@ point::point()
   x=y=z=0;
   line=NULL;
   flags=0;
+  localEpoch=0;
   note="";
 }
 
@@ -459,6 +460,7 @@ point::point(double e,double n,double h,string desc)
   y=n;
   z=h;
   line=0;
+  localEpoch=0;
   note=desc;
 }
 
@@ -468,6 +470,7 @@ point::point(xy pnt,double h,string desc)
   y=pnt.y;
   z=h;
   line=0;
+  localEpoch=0;
   note=desc;
 }
 
@@ -477,6 +480,7 @@ point::point(xyz pnt,string desc)
   y=pnt.y;
   z=pnt.z;
   line=0;
+  localEpoch=0;
   note=desc;
 }
 
@@ -486,6 +490,7 @@ point::point(const point &rhs)
   y=rhs.y;
   z=rhs.z;
   line=rhs.line;
+  localEpoch=0;
   note=rhs.note;
 }
 
@@ -86,6 +86,7 @@ public:
    */
   std::string note;
   edge *line; // a line incident on this point in the TIN. Used to arrange the lines in order around their endpoints.
+  unsigned localEpoch; // set when put in pointlist::localPoints
   edge *edg(triangle *tri);
   // tri.a->edg(tri) is the side opposite tri.b
 public:
@@ -23,6 +23,7 @@
  */
 
 #include <cmath>
+#include <climits>
 #include "angle.h"
 #include "globals.h"
 #include "pointlist.h"
@@ -32,6 +33,7 @@
 #include "except.h"
 #include "stl.h"
 #include "dxf.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -67,6 +69,10 @@ void criterion::writeXml(ostream &ofile)
 pointlist::pointlist()
 {
   initStlTable();
+  localAll=localValid=edgeLevelsValid=false;
+  localEpoch=0;
+  edgeLevelBase=0;
+  localRadius=0;
 }
 
 void pointlist::clear()
@@ -77,12 +83,26 @@ void pointlist::clear()
   points.clear();
   revpoints.clear();
   triPolyLog.clear();
+  lqinx.clear();
+  cinx.clear();
+  localPoints.clear();
+  localEdges.clear();
+  localTriangles.clear();
+  edgeLevels.clear();
+  localValid=edgeLevelsValid=false;
 }
 
 void pointlist::clearTin()
 {
   triangles.clear();
   edges.clear();
+  lqinx.clear();
+  cinx.clear();
+  localPoints.clear();
+  localEdges.clear();
+  localTriangles.clear();
+  edgeLevels.clear();
+  localValid=edgeLevelsValid=false;
 }
 
 int pointlist::size()
@@ -92,9 +112,9 @@ int pointlist::size()
 
 void pointlist::clearmarks()
 {
-  map<int,edge>::iterator e;
-  for (e=edges.begin();e!=edges.end();e++)
-    e->second.clearmarks();
+  int i;
+  for (i=0;i<edges.size();i++)
+    edges[i].clearmarks();
 }
 
 int symhash(int a,int b)
@@ -485,8 +505,13 @@ void pointlist::makeqindex()
     plist.push_back(i->second);
   qinx.sizefit(plist);
   qinx.split(plist);
+  lqinx.build(plist);
+  localValid=edgeLevelsValid=false;
   if (triangles.size())
+  {
     qinx.settri(&triangles[0]);
+    lqinx.settri(&triangles[0]);
+  }
 }
 
 void pointlist::updateqindex()
@@ -495,24 +520,143 @@ void pointlist::updateqindex()
  * some edges.
  */
 {
+  vector<xy> plist;
+  ptlist::iterator i;
+  if (lqinx.size()==0)
+  {
+    for (i=points.begin();i!=points.end();i++)
+      plist.push_back(i->second);
+    lqinx.build(plist);
+  }
+  localValid=edgeLevelsValid=false;
   if (triangles.size())
+  {
     qinx.settri(&triangles[0]);
+    lqinx.settri(&triangles[0]);
+  }
 }
 
 double pointlist::elevation(xy location)
 {
   triangle *t;
-  t=qinx.findt(location);
+  t=lqinx.findt(location);
   if (t)
     return t->elevation(location);
   else
     return nan("");
 }
 
-void pointlist::setgradient(bool flat)
+#define ELEVCHUNK 64
+
+triangle *pointlist::elevationRun(const double *x,const double *y,int n,double *elev,triangle *&last)
+/* Computes the elevations at n points, walking to each point's triangle
+ * from last, the triangle of the previous point, and looking it up in the
+ * index if the walk falls off the edge of the TIN. Consecutive points
+ * in the same triangle are done in one call to triangle::elevations.
+ * Returns the triangle containing the first point.
+ */
 {
-  int i;
-  for (i=0;i<triangles.size();i++)
+  int i,j;
+  triangle *t,*first=nullptr;
+  xy pnt;
+  for (i=0;i<n;i=j)
+  {
+    pnt=xy(x[i],y[i]);
+    t=nullptr;
+    if (last)
+      t=last->findt(pnt);
+    if (!t)
+      t=lqinx.findt(pnt);
+    if (t)
+    {
+      last=t;
+      for (j=i+1;j<n && t->in(xy(x[j],y[j]));j++);
+      t->elevations(x+i,y+i,j-i,elev+i);
+    }
+    else
+    { // Outside the TIN. Walking from last to the next point could cross the whole TIN.
+      elev[i]=nan("");
+      last=nullptr;
+      j=i+1;
+    }
+    if (i==0)
+      first=t;
+  }
+  return first;
+}
+
+void pointlist::elevations(const vector<xy> &locations,double *elev)
+/* Computes the elevations at many points and puts them in elev, which must
+ * have room for locations.size() numbers. Points near each other should
+ * be near each other in locations.
+ */
+{
+  int i,j,n;
+  double x[ELEVCHUNK],y[ELEVCHUNK];
+  triangle *last=nullptr;
+  for (i=0;i<locations.size();i+=n)
+  {
+    n=locations.size()-i;
+    if (n>ELEVCHUNK)
+      n=ELEVCHUNK;
+    for (j=0;j<n;j++)
+    {
+      x[j]=locations[i+j].east();
+      y[j]=locations[i+j].north();
+    }
+    elevationRun(x,y,n,elev+i,last);
+  }
+}
+
+vector<double> pointlist::elevations(const vector<xy> &locations)
+{
+  vector<double> ret(locations.size());
+  elevations(locations,ret.data());
+  return ret;
+}
+
+void pointlist::elevations(xy origin,xy spacing,int width,int height,double *elev)
+/* Computes the elevations at the points origin+(j*spacing.east(),i*spacing.north())
+ * and puts them in elev[i*width+j], which must have room for width*height
+ * numbers. Each row starts walking from the triangle of the start of
+ * the row before.
+ */
+{
+  int i,j,k,n;
+  double x[ELEVCHUNK],y[ELEVCHUNK];
+  triangle *last,*rowstart=nullptr,*t;
+  for (i=0;i<height;i++)
+  {
+    last=rowstart;
+    for (j=0;j<width;j+=n)
+    {
+      n=width-j;
+      if (n>ELEVCHUNK)
+	n=ELEVCHUNK;
+      for (k=0;k<n;k++)
+      {
+	x[k]=origin.east()+(j+k)*spacing.east();
+	y[k]=origin.north()+i*spacing.north();
+      }
+      t=elevationRun(x,y,n,elev+i*width+j,last);
+      if (j==0 && t)
+	rowstart=t;
+    }
+  }
+}
+
+vector<double> pointlist::elevations(xy origin,xy spacing,int width,int height)
+{
+  vector<double> ret((size_t)width*height);
+  elevations(origin,spacing,width,height,ret.data());
+  return ret;
+}
+
+void pointlist::setgradient(bool flat,int threads)
+// Each triangle sets only its own control points.
+{
+  parallelFor(0,triangles.size(),threads,[&](int i)
+  {
     if (flat)
       triangles[i].flatten();
     else
@@ -522,6 +666,7 @@ void pointlist::setgradient(bool flat)
       triangles[i].setgradient(*triangles[i].c,triangles[i].c->gradient);
       triangles[i].setcentercp();
     }
+  },256);
 }
 
 double pointlist::dirbound(int angle)
@@ -542,42 +687,55 @@ double pointlist::dirbound(int angle)
   return bound;
 }
 
-void pointlist::findedgecriticalpts()
+void pointlist::findedgecriticalpts(int threads)
 {
-  map<int,edge>::iterator e;
-  for (e=edges.begin();e!=edges.end();e++)
-    e->second.findextrema();
+  parallelFor(0,edges.size(),threads,[&](int i)
+  {
+    edges[i].findextrema();
+  },256);
 }
 
-void pointlist::findcriticalpts()
+void pointlist::findtrianglecriticalpts(int begin,int end,int threads)
+/* Finds the critical points of triangles begin through end-1 and subdivides
+ * them. Each triangle writes only its own critical points and subdivision,
+ * and reads only its corners and sides, so the result is the same on any
+ * number of threads. Call findedgecriticalpts first.
+ */
 {
-  map<int,triangle>::iterator t;
-  findedgecriticalpts();
-  for (t=triangles.begin();t!=triangles.end();t++)
+  parallelFor(begin,end,threads,[&](int i)
   {
-    t->second.findcriticalpts();
-    t->second.subdivide();
-  }
+    triangles[i].findcriticalpts();
+    triangles[i].subdivide();
+  },16);
+}
+
+void pointlist::findcriticalpts(int threads)
+{
+  cinx.clear();
+  findedgecriticalpts(threads);
+  findtrianglecriticalpts(0,triangles.size(),threads);
 }
 
 void pointlist::addperimeter()
 {
-  map<int,triangle>::iterator t;
+  int i;
   cout<<"Adding perimeter to "<<triangles.size()<<" triangles\n";
-  for (t=triangles.begin();t!=triangles.end();t++)
-    t->second.addperimeter();
+  cinx.clear();
+  for (i=0;i<triangles.size();i++)
+    triangles[i].addperimeter();
 }
 
 void pointlist::removeperimeter()
 {
-  map<int,triangle>::iterator t;
-  for (t=triangles.begin();t!=triangles.end();t++)
-    t->second.removeperimeter();
+  int i;
+  cinx.clear();
+  for (i=0;i<triangles.size();i++)
+    triangles[i].removeperimeter();
 }
 
 triangle *pointlist::findt(xy pnt,bool clip)
 {
-  return qinx.findt(pnt,clip);
+  return lqinx.findt(pnt,clip);
 }
 
 bool pointlist::join2break0()
@@ -696,86 +854,180 @@ string pointlist::hitTestPointString(xy pnt,double radius)
   return ret;
 }
 
-void pointlist::addIfIn(triangle *t,set<triangle *> &addenda,xy pnt,double radius)
+unsigned pointlist::nextLocalEpoch()
+/* Points, edges, and triangles are stamped with the epoch when they're put
+ * in the local sets, so a stamp from an earlier setLocalSets doesn't count.
+ * If the epoch wraps around, all stamps are cleared.
+ */
+{
+  int i;
+  ptlist::iterator j;
+  if (++localEpoch==0)
+  {
+    for (j=points.begin();j!=points.end();++j)
+      j->second.localEpoch=0;
+    for (i=0;i<edges.size();i++)
+      edges[i].localEpoch=0;
+    for (i=0;i<triangles.size();i++)
+      triangles[i].localEpoch=0;
+    localEpoch=1;
+  }
+  return localEpoch;
+}
+
+void pointlist::addIfIn(triangle *t,xy pnt,double radius)
 {
-  if (t && !localTriangles.count(t) && t->inCircle(pnt,radius))
-    addenda.insert(t);
+  if (t && t->localEpoch!=localEpoch && t->inCircle(pnt,radius))
+  {
+    t->localEpoch=localEpoch;
+    localTriangles.push_back(t);
+  }
 }
 
 void pointlist::setLocalSets(xy pnt,double radius)
-/* If the sets are set to {nullptr}, this means one of two things:
+/* localAll is set in two cases:
  * • The area in the window is too large; it would be faster to loop through
  *   all the edges.
  * • There are no triangles. A qindex is an index of triangles.
  * An empty qindex would produce {}, so this condition has to be checked.
+ *
+ * If the view hasn't moved and the TIN hasn't changed since the last call,
+ * the sets are left as they are.
  */
 {
-  set<point *>::iterator i;
-  set<edge *>::iterator j;
+  int i;
+  set<triangle *> seed;
   set<triangle *>::iterator k;
-  int n;
-  vector<edge *> pointEdges;
-  set<triangle *> addenda;
+  edge *e;
+  point *p;
+  triangle *t;
+  auto addPoint=[this](point *p)
+  {
+    if (p->localEpoch!=localEpoch)
+    {
+      p->localEpoch=localEpoch;
+      localPoints.push_back(p);
+    }
+  };
+  auto addTriangle=[this](triangle *t)
+  {
+    if (t && t->localEpoch!=localEpoch)
+    {
+      t->localEpoch=localEpoch;
+      localTriangles.push_back(t);
+    }
+  };
+  if (localValid && localCenter==pnt && localRadius==radius)
+    return;
+  localValid=true;
+  localCenter=pnt;
+  localRadius=radius;
   localTriangles.clear();
   localEdges.clear();
   localPoints.clear();
   if (triangles.size())
-    localTriangles=qinx.localTriangles(pnt,radius,triangles.size()/64+100);
-  else
-    localTriangles.insert(nullptr);
-  if (localTriangles.count(nullptr))
+    seed=qinx.localTriangles(pnt,radius,triangles.size()/64+100);
+  localAll=triangles.size()==0 || seed.count(nullptr);
+  if (!localAll)
   {
-    localEdges.insert(nullptr);
-    localPoints.insert(nullptr);
-    //cout<<"No triangles or view is too big\n";
-  }
-  else
-  {
-    do
-    {
-      addenda.clear();
-      for (k=localTriangles.begin();k!=localTriangles.end();++k)
-      {
-	addIfIn((*k)->aneigh,addenda,pnt,radius);
-	addIfIn((*k)->bneigh,addenda,pnt,radius);
-	addIfIn((*k)->cneigh,addenda,pnt,radius);
-      }
-      for (k=addenda.begin();k!=addenda.end();++k)
-	localTriangles.insert(*k);
-    } while (addenda.size());
-    for (k=localTriangles.begin();k!=localTriangles.end();++k)
+    nextLocalEpoch();
+    for (k=seed.begin();k!=seed.end();++k)
+      addTriangle(*k);
+    for (i=0;i<localTriangles.size();i++)
+    { // localTriangles grows while this loop runs.
+      t=localTriangles[i];
+      addIfIn(t->aneigh,pnt,radius);
+      addIfIn(t->bneigh,pnt,radius);
+      addIfIn(t->cneigh,pnt,radius);
+    }
+    for (i=0;i<localTriangles.size();i++)
     {
-      localPoints.insert((*k)->a);
-      localPoints.insert((*k)->b);
-      localPoints.insert((*k)->c);
+      addPoint(localTriangles[i]->a);
+      addPoint(localTriangles[i]->b);
+      addPoint(localTriangles[i]->c);
     }
-    for (i=localPoints.begin();i!=localPoints.end();++i)
+    for (i=0;i<localPoints.size();i++)
     {
-      pointEdges=(*i)->incidentEdges();
-      for (n=0;n<pointEdges.size();n++)
-	localEdges.insert(pointEdges[n]);
+      p=localPoints[i];
+      e=p->line;
+      if (e)
+	do
+	{
+	  if (e->localEpoch!=localEpoch)
+	  {
+	    e->localEpoch=localEpoch;
+	    localEdges.push_back(e);
+	  }
+	  e=e->next(p);
+	} while (e!=p->line);
     }
-    for (j=localEdges.begin();j!=localEdges.end();++j)
+    for (i=0;i<localEdges.size();i++)
     { // localTriangles() usually doesn't find all triangles, and may even miss a point.
-      if ((*j)->tria)
-	localTriangles.insert((*j)->tria);
-      if ((*j)->trib)
-	localTriangles.insert((*j)->trib);
-      localPoints.insert((*j)->a);
-      localPoints.insert((*j)->b);
+      addTriangle(localEdges[i]->tria);
+      addTriangle(localEdges[i]->trib);
+      addPoint(localEdges[i]->a);
+      addPoint(localEdges[i]->b);
     }
-    assert(!localPoints.count(nullptr));
-    assert(!localEdges.count(nullptr));
-    assert(!localTriangles.count(nullptr));
     //cout<<localPoints.size()<<" points "<<localEdges.size()<<" edges "<<localTriangles.size()<<" triangles\n";
   }
 }
 
+void pointlist::setEdgeLevels()
+/* Sorts the edges into levels by the binary exponent of their length.
+ * Edges of zero or infinite length are left out, as they're never drawn.
+ */
+{
+  int i,minExp=INT_MAX,maxExp=INT_MIN;
+  vector<int> exps(edges.size());
+  double len;
+  if (edgeLevelsValid)
+    return;
+  for (i=0;i<edges.size();i++)
+  {
+    len=edges[i].length();
+    if (len>0 && std::isfinite(len))
+    {
+      exps[i]=ilogb(len);
+      if (exps[i]<minExp)
+	minExp=exps[i];
+      if (exps[i]>maxExp)
+	maxExp=exps[i];
+    }
+    else
+      exps[i]=INT_MIN;
+  }
+  edgeLevels.clear();
+  edgeLevelBase=minExp;
+  if (minExp<=maxExp)
+    edgeLevels.resize(maxExp-minExp+1);
+  for (i=0;i<edges.size();i++)
+    if (exps[i]>INT_MIN)
+      edgeLevels[exps[i]-minExp].push_back(&edges[i]);
+  edgeLevelsValid=true;
+}
+
+int pointlist::edgeLevel(double length)
+/* Returns the lowest level that can have edges longer than length.
+ * An edge of exactly length is at this level or higher.
+ */
+{
+  int exp;
+  if (!(length>0))
+    return 0;
+  if (!std::isfinite(length))
+    return edgeLevels.size();
+  exp=ilogb(length);
+  if (exp<edgeLevelBase)
+    return 0;
+  if (exp-edgeLevelBase>=(int)edgeLevels.size())
+    return edgeLevels.size();
+  return exp-edgeLevelBase;
+}
+
 void pointlist::writeXml(ofstream &ofile)
 {
   int i;
   ptlist::iterator p;
-  map<int,triangle>::iterator t;
   ofile<<"<Pointlist><Criteria>";
   for (i=0;i<crit.size();i++)
     crit[i].writeXml(ofile);
@@ -788,11 +1040,11 @@ void pointlist::writeXml(ofstream &ofile)
   }
   ofile<<"</Points>"<<endl;
   ofile<<"<TIN>";
-  for (t=triangles.begin(),i=0;t!=triangles.end();t++,i++)
+  for (i=0;i<triangles.size();i++)
   {
     if (i && (i%1)==0)
       ofile<<endl;
-    t->second.writeXml(ofile,*this);
+    triangles[i].writeXml(ofile,*this);
   }
   ofile<<"</TIN>"<<endl;
   ofile<<"<Contours>";
@@ -816,5 +1068,6 @@ void pointlist::roscat(xy tfrom,int ro,double sca,xy tto)
     contours[i]._roscat(tfrom,ro,sca,cossin(ro)*sca,tto);
   for (j=points.begin();j!=points.end();j++)
     j->second._roscat(tfrom,ro,sca,cossin(ro)*sca,tto);
+  localValid=edgeLevelsValid=false;
 }
 
@@ -37,11 +37,17 @@
 #include "contour.h"
 #include "breakline.h"
 #include "intloop.h"
+#include "chunkvector.h"
 
 #ifdef _MSC_VER
 typedef long long ssize_t;
 #endif
 
+#define GRAD_TOLERANCE 1e-4
+/* Gradients are dimensionless; this is a tenth of a millimeter per meter.
+ * Each sweep of makegrad changes them about a quarter as much as the last.
+ */
+
 typedef std::map<int,point> ptlist;
 typedef std::map<point*,int> revptlist;
 
@@ -76,19 +82,32 @@ private:
 public:
   ptlist points;
   revptlist revpoints;
-  std::map<int,edge> edges;
-  std::map<int,triangle> triangles;
-  /* edges and triangles are logically arrays from 0 to size()-1, but are
-   * implemented as maps, because they have pointers to each other, and points
+  chunkvector<edge> edges;
+  chunkvector<triangle> triangles;
+  /* edges and triangles are arrays from 0 to size()-1. They are chunkvectors,
+   * not vectors, because they have pointers to each other, and points
    * point to edges, and the pointers would be messed up by moving memory
    * when a vector is resized.
    */
   std::vector<polyspiral> contours;
-  std::set<point *> localPoints;
-  std::set<edge *> localEdges;
-  std::set<triangle *> localTriangles;
+  std::vector<point *> localPoints;
+  std::vector<edge *> localEdges;
+  std::vector<triangle *> localTriangles;
+  bool localAll;
   /* localPoints, localEdges, and localTriangles are used to speed up repainting
-   * when the view is of a small fraction of a huge TIN.
+   * when the view is of a small fraction of a huge TIN. If localAll is set,
+   * they are empty and everything should be drawn.
+   */
+  bool localValid; // false when the TIN changes, so that setLocalSets redoes them
+  unsigned localEpoch;
+  xy localCenter;
+  double localRadius;
+  std::vector<std::vector<edge *> > edgeLevels;
+  int edgeLevelBase;
+  bool edgeLevelsValid;
+  /* edgeLevels[i] holds the edges whose length is at least 2**(i+edgeLevelBase)
+   * and less than twice that. When the view is too big for the local sets,
+   * only the levels of edges longer than a pixel are looked at.
    */
   criteria crit;
   ContourInterval contourInterval;
@@ -101,6 +120,8 @@ public:
    * 3: both are valid (you just made a TIN, or you just saved breaklines to a file).
    */
   qindex qinx;
+  linqindex lqinx; // same squares as qinx, for finding triangles faster
+  contourindex cinx; // built when drawing contours, cleared when subdivisions change
   std::vector<TriPolyLogEntry> triPolyLog;
   pointlist();
   void addpoint(int numb,point pnt,bool overwrite=false);
@@ -116,9 +137,10 @@ public:
   std::vector<point *> fromInt1loop(int1loop intLoop);
   intloop boundary();
   int readCriteria(std::string fname,Measure ms);
-  void setgradient(bool flat=false);
-  void findedgecriticalpts();
-  void findcriticalpts();
+  void setgradient(bool flat=false,int threads=1);
+  void findedgecriticalpts(int threads=1);
+  void findtrianglecriticalpts(int begin,int end,int threads=1);
+  void findcriticalpts(int threads=1);
   void addperimeter();
   void removeperimeter();
   triangle *findt(xy pnt,bool clip=false);
@@ -129,11 +151,15 @@ public:
   void readBreaklines(std::string filename);
   std::string hitTestString(triangleHit hit);
   std::string hitTestPointString(xy pnt,double radius);
-  void addIfIn(triangle *t,std::set<triangle *> &addenda,xy pnt,double radius);
+  unsigned nextLocalEpoch();
+  void addIfIn(triangle *t,xy pnt,double radius);
   void setLocalSets(xy pnt,double radius);
+  void setEdgeLevels();
+  int edgeLevel(double length);
   virtual void writeXml(std::ofstream &ofile);
   // the following methods are in tin.cpp
 private:
+  triangle *elevationRun(const double *x,const double *y,int n,double *elev,triangle *&last);
   void dumpedges();
   void dumpnext_ps(PostScript &ps);
 public:
@@ -144,19 +170,28 @@ public:
   bool shouldFlip(edge &e);
   bool tryStartPoint(PostScript &ps,xy &startpnt);
   int1loop convexHull();
-  int flipPass(PostScript &ps,bool colorfibaster);
-  void maketin(std::string filename="",bool colorfibaster=false);
-  void makegrad(double corr);
+  std::vector<int> passOrder();
+  std::vector<edge *> flipColored(std::vector<edge *> todo,int threads);
+  int flipPass(PostScript &ps,bool colorfibaster,int threads=1);
+  int flipCascade(int threads=1);
+  void maketin(std::string filename="",bool colorfibaster=false,int threads=1);
+  void makegrad(double corr,int threads=1,double tolerance=0);
   void maketriangles();
   void makeqindex();
   void updateqindex();
   void makeBareTriangles(std::vector<std::array<xyz,3> > bareTriangles);
   void triangulatePolygon(std::vector<point *> poly);
   void makeEdges();
+  bool linkTriangles(const std::vector<point *> &byNum,const std::vector<int> &corners,int threads=1);
+  bool linkBareTriangles(int threads=1);
   void deleteOrphanPoints();
   void fillInBareTin();
   double totalEdgeLength();
   double elevation(xy location);
+  void elevations(const std::vector<xy> &locations,double *elev);
+  std::vector<double> elevations(const std::vector<xy> &locations);
+  void elevations(xy origin,xy spacing,int width,int height,double *elev);
+  std::vector<double> elevations(xy origin,xy spacing,int width,int height);
   double dirbound(int angle);
   std::array<double,2> lohi();
   virtual void roscat(xy tfrom,int ro,double sca,xy tto); // rotate, scale, translate
@@ -154,6 +154,21 @@ unsigned polyspiral::hash()
          memHash(&elevation,sizeof(double))))))))))));
 }
 
+drawobj *polyline::clone()
+{
+  return new polyline(*this);
+}
+
+drawobj *polyarc::clone()
+{
+  return new polyarc(*this);
+}
+
+drawobj *polyspiral::clone()
+{
+  return new polyspiral(*this);
+}
+
 segment polyline::getsegment(int i)
 {
   i%=(signed)lengths.size();
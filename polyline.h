@@ -63,6 +63,7 @@ public:
     return elevation;
   }
   virtual unsigned hash();
+  virtual drawobj *clone();
   bool isopen();
   int size();
   segment getsegment(int i);
@@ -99,6 +100,7 @@ public:
   polyarc(double e);
   polyarc(polyline &p);
   virtual unsigned hash();
+  virtual drawobj *clone();
   arc getarc(int i);
   virtual bezier3d approx3d(double precision);
   virtual void insert(xy newpoint,int pos=-1);
@@ -128,6 +130,7 @@ public:
   polyspiral(double e);
   polyspiral(polyline &p);
   virtual unsigned hash();
+  virtual drawobj *clone();
   spiralarc getspiralarc(int i);
   virtual bezier3d approx3d(double precision);
   virtual void insert(xy newpoint,int pos=-1);
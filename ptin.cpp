@@ -23,14 +23,18 @@
  */
 
 #include <vector>
+#include <memory>
+#include <atomic>
 #include <cmath>
 #include <cstring>
+#include <cassert>
 #include "binio.h"
 #include "angle.h"
+#include "threads.h"
 #include "ptin.h"
 using namespace std;
 
-CoordCheck zCheck;
+#define PTIN_CHUNK 4096
 
 PtinHeader::PtinHeader()
 {
@@ -38,79 +42,163 @@ PtinHeader::PtinHeader()
   tolerance=NAN;
 }
 
-void CoordCheck::clear()
+void CoordCheck::clear(size_t startAt)
 {
-  count=0;
-  memset(stage0,0,sizeof(stage0));
-  memset(stage1,0,sizeof(stage1));
-  memset(stage2,0,sizeof(stage2));
-  memset(stage3,0,sizeof(stage3));
-  memset(stage4,0,sizeof(stage4));
+  int i;
+  start=count=startAt;
+  stages[0].assign(stageSize(0),0);
+  for (i=1;i<5;i++)
+  {
+    stages[i].clear();
+    stages[i].shrink_to_fit();
+  }
+  for (i=0;i<4;i++)
+    head[i].clear();
+}
+
+double *CoordCheck::stage(int level)
+// Allocates the stage, zeroed, if it hasn't been written yet.
+{
+  if (stages[level].empty())
+    stages[level].assign(stageSize(level),0);
+  return stages[level].data();
+}
+
+bool CoordCheck::used(int level)
+{
+  return stages[level].size()>0;
+}
+
+double CoordCheck::rowSum(int level,int row)
+{
+  int len=(level<4)?8192:4096;
+  if (used(level))
+    return pairwisesum(stages[level].data()+len*row,len);
+  else
+    return 0;
+}
+
+int CoordCheck::rows(int level)
+// Number of rows in stage0 through stage3
+{
+  return 13*level+14;
+}
+
+int CoordCheck::stageSize(int level)
+{
+  return (level<4)?8192*rows(level):64*4096;
+}
+
+void CoordCheck::flush(int level,double *src,size_t last)
+/* Sums the block ending with dot number last, whose rows are at src,
+ * into the next stage.
+ */
+{
+  int i,nbits=13*level+13;
+  int slot=(last>>nbits)&8191;
+  double lastStageSum;
+  double (*dst)[8192]=(double (*)[8192])stage(level+1);
+  double (*stage4)[4096]=(double (*)[4096])dst;
+  if (level==3)
+  { // stage4's rows are 4096 long
+    for (i=0;i<52;i++)
+      stage4[i][slot]=pairwisesum(src+8192*i,8192);
+    lastStageSum=pairwisesum(src+8192*52,8192);
+    for (i=52;i<64;i++)
+      if ((last>>i)&1)
+	stage4[i][slot]=-lastStageSum;
+      else
+	stage4[i][slot]=lastStageSum;
+    return;
+  }
+  for (i=0;i<nbits;i++)
+    dst[i][slot]=pairwisesum(src+8192*i,8192);
+  lastStageSum=pairwisesum(src+8192*nbits,8192);
+  for (i=nbits;i<nbits+13;i++)
+    if ((last>>i)&1)
+      dst[i][slot]=-lastStageSum;
+    else
+      dst[i][slot]=lastStageSum;
+  dst[nbits+13][slot]=lastStageSum;
+}
+
+void CoordCheck::endBlock(int level,size_t last)
+/* The block at level ending with dot number last is done. If it began
+ * in another CoordCheck, it can't be summed until they're merged.
+ */
+{
+  size_t span=(size_t)1<<(13*level+13);
+  double *src=stage(level);
+  if ((last&~(span-1))>=start)
+    flush(level,src,last);
+  else
+    head[level].assign(src,src+8192*rows(level));
+  memset(src,0,8192*sizeof(double)*rows(level));
 }
 
 CoordCheck& CoordCheck::operator<<(double val)
 {
   int i;
-  double lastStageSum;
+  double (*stage0)[8192]=(double (*)[8192])stage(0);
   for (i=0;i<13;i++)
     if ((count>>i)&1)
       stage0[i][count&8191]=-val;
     else
       stage0[i][count&8191]=val;
   stage0[13][count&8191]=val;
-  if ((count&8191)==8191)
-  {
-    for (i=0;i<13;i++)
-      stage1[i][(count>>13)&8191]=pairwisesum(stage0[i],8192);
-    lastStageSum=pairwisesum(stage0[13],8192);
-    for (i=13;i<26;i++)
-      if ((count>>i)&1)
-	stage1[i][(count>>13)&8191]=-lastStageSum;
-      else
-	stage1[i][(count>>13)&8191]=lastStageSum;
-    stage1[26][(count>>13)&8191]=lastStageSum;
-    memset(stage0,0,sizeof(stage0));
-  }
-  if ((count&0x3ffffff)==0x3ffffff)
-  {
-    for (i=0;i<26;i++)
-      stage2[i][(count>>26)&8191]=pairwisesum(stage1[i],8192);
-    lastStageSum=pairwisesum(stage1[26],8192);
-    for (i=26;i<39;i++)
-      if ((count>>i)&1)
-	stage2[i][(count>>26)&8191]=-lastStageSum;
-      else
-	stage2[i][(count>>26)&8191]=lastStageSum;
-    stage2[39][(count>>26)&8191]=lastStageSum;
-    memset(stage1,0,sizeof(stage1));
-  }
-  if ((count&0x7fffffffff)==0x7fffffffff)
+  for (i=0;i<4 && ((count+1)&(((size_t)1<<(13*i+13))-1))==0;i++)
+    endBlock(i,count);
+  count++;
+  return *this;
+}
+
+void CoordCheck::merge(CoordCheck &next)
+/* next must start where this ends. Afterward this holds both, and next
+ * is left in an unspecified state. A block that straddles the boundary is
+ * put together from the parts in this and next, then summed if it is done.
+ */
+{
+  int i,level,n;
+  size_t span,blockStart;
+  double *dst,*src;
+  assert(next.start==count);
+  for (level=0;level<4;level++)
   {
-    for (i=0;i<39;i++)
-      stage3[i][(count>>39)&8191]=pairwisesum(stage2[i],8192);
-    lastStageSum=pairwisesum(stage2[39],8192);
-    for (i=39;i<52;i++)
-      if ((count>>i)&1)
-	stage3[i][(count>>39)&8191]=-lastStageSum;
+    span=(size_t)1<<(13*level+13);
+    blockStart=count&~(span-1);
+    n=stageSize(level);
+    if (blockStart<count)
+    { // The block containing the boundary is partly in each.
+      dst=stage(level);
+      if (next.count>=blockStart+span)
+	src=next.head[level].data();
+      else if (next.used(level))
+	src=next.stage(level);
       else
-	stage3[i][(count>>39)&8191]=lastStageSum;
-    stage3[52][(count>>39)&8191]=lastStageSum;
-    memset(stage2,0,sizeof(stage2));
+	src=nullptr;
+      if (src)
+	for (i=0;i<n;i++)
+	  dst[i]+=src[i];
+      if (next.count>=blockStart+span)
+      {
+	if (blockStart>=start)
+	  flush(level,dst,blockStart+span-1);
+	else
+	  head[level].assign(dst,dst+n);
+	swap(stages[level],next.stages[level]);
+      }
+    }
+    else
+      swap(stages[level],next.stages[level]);
   }
-  if ((count&0xfffffffffffff)==0xfffffffffffff)
+  if (next.used(4))
   {
-    for (i=0;i<52;i++)
-      stage4[i][(count>>52)&8191]=pairwisesum(stage3[i],8192);
-    lastStageSum=pairwisesum(stage3[52],8192);
-    for (i=52;i<64;i++)
-      if ((count>>i)&1)
-	stage4[i][(count>>52)&8191]=-lastStageSum;
-      else
-	stage4[i][(count>>52)&8191]=lastStageSum;
-    memset(stage3,0,sizeof(stage3));
+    dst=stage(4);
+    src=next.stage(4);
+    for (i=0;i<stageSize(4);i++)
+      dst[i]+=src[i];
   }
-  count++;
-  return *this;
+  count=next.count;
 }
 
 double CoordCheck::operator[](int n)
@@ -137,9 +225,8 @@ double CoordCheck::operator[](int n)
     n3=52;
     s3=1-2*((count>>n)&1);
   }
-  return pairwisesum(stage0[n0],8192)*s0+pairwisesum(stage1[n1],8192)*s1+
-	 pairwisesum(stage2[n2],8192)*s2+pairwisesum(stage3[n3],8192)*s3+
-         pairwisesum(stage4[n],4096);
+  return rowSum(0,n0)*s0+rowSum(1,n1)*s1+rowSum(2,n2)*s2+rowSum(3,n3)*s3+
+	 rowSum(4,n);
 }
 
 xyz readPoint(istream &file)
@@ -151,23 +238,32 @@ xyz readPoint(istream &file)
   return xyz(x,y,z);
 }
 
-xyz readPoint4(istream &file)
+static int dotLength(const char *p,size_t avail,xyz &pnt)
+/* Decodes a dot, which is one, two, or three floats, as PerfectTIN writes it.
+ * Returns its length in bytes, or 0 if the file ends in the middle of it.
+ */
 {
-  double x,y,z;
-  if (file.eof())
+  float x,y,z;
+  int len=4;
+  if (avail<4)
+    return 0;
+  z=y=x=readlefloat(p);
+  if (std::isfinite(y))
   {
-    x=INFINITY;
-    y=z=NAN;
+    if (avail<8)
+      return 0;
+    z=y=readlefloat(p+4);
+    len=8;
   }
-  else
+  if (std::isfinite(z))
   {
-    z=y=x=readlefloat(file);
-    if (std::isfinite(y))
-      z=y=readlefloat(file);
-    if (std::isfinite(z))
-      z=readlefloat(file);
+    if (avail<12)
+      return 0;
+    z=readlefloat(p+8);
+    len=12;
   }
-  return xyz(x,y,z);
+  pnt=xyz(x,y,z);
+  return len;
 }
 
 PtinHeader readPtinHeader(istream &inputFile)
@@ -234,147 +330,246 @@ PtinHeader readPtinHeader(std::string inputFile)
   return readPtinHeader(ptinFile);
 }
 
-PtinHeader readPtin(std::string inputFile,pointlist &pl)
+struct PtinChunk
+// A run of up to PTIN_CHUNK triangles, decoded on one thread.
 {
-  ifstream ptinFile(inputFile,ios::binary);
-  PtinHeader header;
-  int i,j,m,n,a,b,c;
-  int edgeCheck=0;
-  vector<int> convexHull;
-  vector<double> areas;
+  size_t offset;
+  int firstTriangle,numTriangles;
+  long long firstDot,numDots;
+  int error;
+  int edgeCheck;
+};
+
+static void decodeChunk(PtinChunk &chunk,const char *data,size_t len,pointlist &pl,
+			const vector<point *> &byNum,vector<int> &corners,CoordCheck &zCheck)
+{
+  int i,j,m,a,b,c,err=0;
+  int npoints=byNum.size()-1;
+  size_t pos=chunk.offset;
+  bool last;
   triangle *tri;
   xyz pnt,ctr;
-  bool readingStarted=false;
-  double zError=0,high=-INFINITY,low=INFINITY;
+  chunk.error=chunk.edgeCheck=0;
+  for (i=chunk.firstTriangle;!err && i<chunk.firstTriangle+chunk.numTriangles;i++)
+  {
+    a=readleint(data+pos);
+    b=readleint(data+pos+4);
+    c=readleint(data+pos+8);
+    m=data[pos+12]&255;
+    pos+=13;
+    if (a<1 || a>npoints || b<1 || b>npoints || c<1 || c>npoints)
+    {
+      err=PT_INVALID_POINT_NUMBER;
+      break;
+    }
+    corners[3*i]=a;
+    corners[3*i+1]=b;
+    corners[3*i+2]=c;
+    tri=&pl.triangles[i];
+    tri->a=byNum[a];
+    tri->b=byNum[b];
+    tri->c=byNum[c];
+    ctr=((xyz)*tri->a+(xyz)*tri->b+(xyz)*tri->c)/3;
+    tri->flatten();
+    if (!(tri->sarea>0)) // so written to catch the NaN case
+      err=PT_BACKWARD_TRIANGLE;
+    chunk.edgeCheck+=skewsym(a,b)+skewsym(b,c)+skewsym(c,a);
+    for (j=0;m==255 || j<m;j++)
+    {
+      pos+=dotLength(data+pos,len-pos,pnt);
+      last=m==255 && pnt.isnan();
+      if (xy(pnt).length()>tri->peri/3)
+	err=PT_DOT_OUTSIDE;
+      if (last)
+	break;
+      zCheck<<pnt.getz()+ctr.getz();
+    }
+  }
+  chunk.error=err;
+}
+
+PtinHeader readPtin(std::string inputFile,pointlist &pl,int threads)
+/* The file is mapped, not read. Because dots make triangles different
+ * lengths, it is first scanned in order to find where each chunk of
+ * PTIN_CHUNK triangles starts and how many dots come before it. Then each
+ * of threads threads decodes a run of chunks, summing its part of the z-check
+ * in its own CoordCheck (a few megabytes, as only the stages it reaches are
+ * allocated), and the CoordChecks are merged in order. Last, the
+ * edges are made from the triangles all at once.
+ */
+{
+  PtinHeader header;
+  int i,j,m,n,l,nparts;
+  int edgeCheck=0;
+  long long ndots=0;
+  size_t pos,len,ntri=0;
+  const char *data;
+  bool readingStarted=false,truncated=false;
+  atomic<bool> outOfRange(false);
+  vector<int> convexHull,corners;
+  vector<xyz> pts;
+  vector<point *> byNum;
+  vector<PtinChunk> chunks;
   vector<double> zcheck;
-  zCheck.clear();
+  vector<unique_ptr<CoordCheck> > zParts;
+  ptlist::iterator pnti;
+  xyz pnt;
+  double zError=0,zDiff;
+  ifstream ptinFile(inputFile,ios::binary);
   header=readPtinHeader(ptinFile);
+  pos=ptinFile.tellg();
+  ptinFile.close();
+  mappedfile file(inputFile);
+  data=file.data();
+  len=file.size();
   if (header.tolRatio>0 && header.tolerance>0)
   {
     pl.clear();
     readingStarted=true;
-    for (i=1;i<=header.numPoints;i++)
+    if (header.numPoints<0 || (len-pos)/24<header.numPoints)
+      header.tolRatio=PT_EOF;
+    else
     {
-      pl.points[i]=point(readPoint(ptinFile),"");
-      pl.revpoints[&pl.points[i]]=i;
-      if (outOfGeoRange(pl.points[i].getx(),pl.points[i].gety(),pl.points[i].getz()))
-	header.tolRatio=PT_OUT_OF_RANGE;
-      if (ptinFile.eof())
+      pts.resize(header.numPoints+1);
+      parallelFor(1,header.numPoints+1,threads,[&](int i)
       {
-	header.tolRatio=PT_EOF;
-	break;
-      }
+	const char *p=data+pos+24*(i-1);
+	pts[i]=xyz(readledouble(p),readledouble(p+8),readledouble(p+16));
+	if (outOfGeoRange(pts[i].getx(),pts[i].gety(),pts[i].getz()))
+	  outOfRange=true;
+      });
+      pos+=24*(size_t)header.numPoints;
+      if (outOfRange)
+	header.tolRatio=PT_OUT_OF_RANGE;
     }
   }
   if (header.tolRatio>0 && header.tolerance>0)
-    for (i=0;i<header.numConvexHull;i++)
+  {
+    byNum.resize(header.numPoints+1,nullptr);
+    for (i=1;i<=header.numPoints;i++)
     {
-      n=readleint(ptinFile);
-      if (n<1 || n>header.numPoints)
-	header.tolRatio=PT_INVALID_POINT_NUMBER;
-      if (i)
-	edgeCheck+=skewsym(n,convexHull.back());
-      if (ptinFile.eof())
+      pnti=pl.points.emplace_hint(pl.points.end(),i,point(pts[i],""));
+      byNum[i]=&pnti->second;
+      pl.revpoints.emplace_hint(pl.revpoints.end(),byNum[i],i);
+    }
+    pts.clear();
+    pts.shrink_to_fit();
+  }
+  if (header.tolRatio>0 && header.tolerance>0)
+  {
+    if (header.numConvexHull<0 || (len-pos)/4<header.numConvexHull)
+      header.tolRatio=PT_EOF;
+    else
+      for (i=0;i<header.numConvexHull;i++)
       {
-	header.tolRatio=PT_EOF;
-	break;
+	n=readleint(data+pos);
+	pos+=4;
+	if (n<1 || n>header.numPoints)
+	  header.tolRatio=PT_INVALID_POINT_NUMBER;
+	if (i)
+	  edgeCheck+=skewsym(n,convexHull.back());
+	convexHull.push_back(n);
       }
-      convexHull.push_back(n);
-    }
+  }
   if (convexHull.size())
     edgeCheck+=skewsym(convexHull[0],convexHull.back());
-  //if (header.tolRatio>0 && header.tolerance>0)
-    //if (!pl.validConvexHull())
-      //header.tolRatio=PT_INVALID_CONVEX_HULL;
   if (header.tolRatio>0 && header.tolerance>0)
-    for (i=0;i<header.numTriangles && header.tolRatio>0;i++)
+  {
+    for (i=0;i<header.numTriangles && !truncated;i++)
     {
-      n=pl.addtriangle();
-      //cout<<n<<' ';
-      tri=&pl.triangles[n];
-      a=readleint(ptinFile);
-      //cout<<a<<' ';
-      if (a<1 || a>header.numPoints)
-	header.tolRatio=PT_INVALID_POINT_NUMBER;
-      tri->a=&pl.points[a];
-      b=readleint(ptinFile);
-      //cout<<b<<' ';
-      if (b<1 || b>header.numPoints)
-	header.tolRatio=PT_INVALID_POINT_NUMBER;
-      tri->b=&pl.points[b];
-      c=readleint(ptinFile);
-      //cout<<c<<'\n';
-      if (c<1 || c>header.numPoints)
-	header.tolRatio=PT_INVALID_POINT_NUMBER;
-      tri->c=&pl.points[c];
-      ctr=((xyz)*tri->a+(xyz)*tri->b+(xyz)*tri->c)/3;
-      tri->flatten();
-      //cout<<i<<' '<<tri->sarea<<endl;
-      if (!(tri->sarea>0)) // so written to catch the NaN case
-	header.tolRatio=PT_BACKWARD_TRIANGLE;
-      areas.push_back(tri->sarea);
-      edgeCheck+=skewsym(a,b)+skewsym(b,c)+skewsym(c,a);
-      m=ptinFile.get()&255;
-      if (m<255)
-	for (j=0;j<m;j++)
-	{
-	  pnt=readPoint4(ptinFile);
-	  if (xy(pnt).length()>tri->peri/3)
-	    header.tolRatio=PT_DOT_OUTSIDE;
-	  pnt+=ctr;
-	  zCheck<<pnt.getz();
-	  if (pnt.getz()>high)
-	    high=pnt.getz();
-	  if (pnt.getz()<low)
-	    low=pnt.getz();
-	}
-      else
-	while (true)
+      if (i%PTIN_CHUNK==0)
+      {
+	chunks.emplace_back();
+	chunks.back().offset=pos;
+	chunks.back().firstTriangle=i;
+	chunks.back().numTriangles=0;
+	chunks.back().firstDot=ndots;
+      }
+      if (len-pos<13)
+      {
+	truncated=true;
+	break;
+      }
+      m=data[pos+12]&255;
+      pos+=13;
+      for (j=0;m==255 || j<m;j++)
+      {
+	l=dotLength(data+pos,len-pos,pnt);
+	if (!l)
 	{
-	  pnt=readPoint4(ptinFile);
-	  if (xy(pnt).length()>tri->peri/3)
-	    header.tolRatio=PT_DOT_OUTSIDE;
-	  pnt+=ctr;
-	  if (pnt.isnan())
-	  {
-	    if (std::isinf(pnt.getx()))
-	      header.tolRatio=PT_EOF;
-	    break;
-	  }
-	  zCheck<<pnt.getz();
-	  if (pnt.getz()>high)
-	    high=pnt.getz();
-	  if (pnt.getz()<low)
-	    low=pnt.getz();
+	  truncated=true;
+	  break;
 	}
+	pos+=l;
+	if (m==255 && pnt.isnan())
+	  break;
+	ndots++;
+      }
+      if (!truncated)
+      {
+	chunks.back().numTriangles++;
+	ntri++;
+      }
     }
+    for (i=0;i<chunks.size();i++)
+      chunks[i].numDots=((i+1<chunks.size())?chunks[i+1].firstDot:ndots)-chunks[i].firstDot;
+    corners.resize(3*ntri);
+    pl.addtriangle(ntri);
+    nparts=max(1,min(threads,(int)chunks.size()));
+    zParts.resize(nparts);
+    parallelFor(0,nparts,nparts,[&](int t)
+    {
+      int i,first=t*chunks.size()/nparts,last=(t+1)*chunks.size()/nparts;
+      zParts[t].reset(new CoordCheck);
+      zParts[t]->clear((first<chunks.size())?chunks[first].firstDot:ndots);
+      for (i=first;i<last;i++)
+	decodeChunk(chunks[i],data,len,pl,byNum,corners,*zParts[t]);
+    },1);
+    for (i=0;i<chunks.size() && header.tolRatio>0;i++)
+      if (chunks[i].error)
+	header.tolRatio=chunks[i].error;
+      else
+	edgeCheck+=chunks[i].edgeCheck;
+    if (header.tolRatio>0 && truncated)
+      header.tolRatio=PT_EOF;
+  }
   //cout<<"edgeCheck="<<edgeCheck<<endl;
   if (header.tolRatio>0 && header.tolerance>0 && edgeCheck)
     header.tolRatio=PT_EDGE_MISMATCH;
   if (header.tolRatio>0 && header.tolerance>0)
   {
-    n=ptinFile.get()&255;
-    for (i=0;i<n;i++)
-      zcheck.push_back(readledouble(ptinFile));
+    n=(pos<len)?data[pos++]&255:-1;
+    if (n<0 || (len-pos)/8<n)
+      header.tolRatio=PT_EOF;
+    for (i=0;i<n && header.tolRatio>0;i++)
+      zcheck.push_back(readledouble(data+pos+8*i));
+  }
+  if (header.tolRatio>0 && header.tolerance>0)
+  {
     if (n==0)
       zcheck.push_back(0);
     while (zcheck.size()<64)
       zcheck.push_back(zcheck.back());
-    //cout<<header.tolRatio*header.tolerance*sqrt(zCheck.getCount())<<endl;
-    //for (i=0;i<n;i++)
-      //cout<<i<<' '<<zcheck[i]<<' '<<zCheck[i]<<' '<<zcheck[i]-zCheck[i]<<endl;
+    for (i=1;i<zParts.size();i++)
+    {
+      zParts[0]->merge(*zParts[i]);
+      zParts[i].reset();
+    }
     for (i=0;i<64;i++)
-      if (fabs(zcheck[i]-zCheck[i])>zError)
-	zError=fabs(zcheck[i]-zCheck[i]);
-    //cout<<zError/(header.tolRatio*header.tolerance*sqrt(zCheck.getCount()))<<endl;
-    if (zError>header.tolRatio*header.tolerance*sqrt(zCheck.getCount())/65536)
+    {
+      zDiff=fabs(zcheck[i]-(*zParts[0])[i]);
+      if (zDiff>zError)
+	zError=zDiff;
+    }
+    if (zError>header.tolRatio*header.tolerance*sqrt(ndots)/65536)
       header.tolRatio=PT_ZCHECK_FAIL;
   }
   if (header.tolRatio>0 && header.tolerance>0)
   {
-    pl.makeEdges();
+    if (!pl.linkTriangles(byNum,corners,threads))
+      header.tolRatio=PT_EDGE_MISMATCH;
   }
-  else if (readingStarted)
+  if (!(header.tolRatio>0 && header.tolerance>0) && readingStarted)
     pl.clear();
   return header;
 }
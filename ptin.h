@@ -25,6 +25,7 @@
 #ifndef PTIN_H
 #define PTIN_H
 #include <string>
+#include <vector>
 #include "manysum.h"
 #include "pointlist.h"
 
@@ -58,14 +59,35 @@ struct PtinHeader
 };
 
 class CoordCheck
+/* Sums the elevations of the dots of a PerfectTIN file 64 ways, with the
+ * signs of each bit of the dot's number. Values are summed pairwise in
+ * blocks of 8192, then 8192 blocks at a time, and so on up to stage4.
+ *
+ * To sum on several threads, clear each CoordCheck to start at the number
+ * of the first dot it gets, and merge them in order. The result is the same,
+ * to the bit, as putting all the dots into one. A block whose beginning
+ * belongs to another CoordCheck is kept in head until merged.
+ *
+ * Stages above 0 are allocated when first written. Fewer than 2^26 dots
+ * never reach stage2, so a CoordCheck for each thread takes under 3 MB,
+ * instead of the 11 MB that all five stages take.
+ */
 {
 private:
-  size_t count;
-  double stage0[14][8192],stage1[27][8192],stage2[40][8192],
-         stage3[53][8192],stage4[64][4096];
+  size_t start,count;
+  std::vector<double> stages[5]; // stage0 is 14 rows of 8192, ... stage4 is 64 rows of 4096
+  std::vector<double> head[4];
+  double *stage(int level);
+  bool used(int level);
+  double rowSum(int level,int row);
+  int rows(int level);
+  int stageSize(int level);
+  void endBlock(int level,size_t last);
+  void flush(int level,double *src,size_t last);
 public:
-  void clear();
+  void clear(size_t startAt=0);
   CoordCheck& operator<<(double val);
+  void merge(CoordCheck &next);
   double operator[](int n);
   size_t getCount()
   {
@@ -76,5 +98,5 @@ public:
 xyz readPoint(std::istream &file);
 PtinHeader readPtinHeader(std::istream &inputFile);
 PtinHeader readPtinHeader(std::string inputFile);
-PtinHeader readPtin(std::string inputFile,pointlist &pl);
+PtinHeader readPtin(std::string inputFile,pointlist &pl,int threads=1);
 #endif
@@ -23,6 +23,7 @@
  */
 
 #include <cmath>
+#include <algorithm>
 #include "ps.h"
 #include "qindex.h"
 #include "relprime.h"
@@ -372,3 +373,169 @@ set<triangle *> qindex::localTriangles(xy center,double radius,int max)
     list.insert(tri);
   return list;
 }
+
+/* linqindex is laid out in Morton order: the root is node 0, the children
+ * of a node are four consecutive nodes numbered as qindex's subs, and each
+ * child's subtree follows its block of four. A point is located by scaling
+ * it once to 30-bit integer coordinates in the square; the quarter at each
+ * level is then two bits of those, with no floating-point comparisons.
+ */
+#define LQDEPTH 30
+#define LQSCALE 1073741824.
+
+unsigned long long interleave(unsigned ix,unsigned iy)
+// Returns the Morton code of ix and iy: bits of iy are odd, bits of ix are even.
+{
+  unsigned long long ret=0;
+  int i;
+  for (i=LQDEPTH-1;i>=0;i--)
+    ret=(ret<<2)|(((iy>>i)&1)<<1)|((ix>>i)&1);
+  return ret;
+}
+
+linqindex::linqindex()
+{
+  x=y=side=0;
+}
+
+void linqindex::clear()
+{
+  kids.clear();
+  tri.clear();
+}
+
+int linqindex::size()
+{
+  return kids.size();
+}
+
+void linqindex::split(vector<unsigned long long> &codes,int lo,int hi,int depth,int n)
+/* codes[lo..hi) are the sorted, distinct Morton codes of the points in
+ * node n, a square at depth depth. Splits it if there are more than three.
+ */
+{
+  int i,first,sublo,subhi,shift;
+  if (hi-lo>3 && depth<LQDEPTH)
+  {
+    first=kids.size();
+    kids.resize(first+4,0);
+    tri.resize(first+4,nullptr);
+    kids[n]=first;
+    shift=2*(LQDEPTH-1-depth);
+    for (i=0,sublo=lo;i<4;i++,sublo=subhi)
+    {
+      for (subhi=sublo;subhi<hi && (int)((codes[subhi]>>shift)&3)==i;subhi++);
+      split(codes,sublo,subhi,depth+1,first+i);
+    }
+  }
+}
+
+void linqindex::build(vector<xy> pnts)
+/* Makes the index in one pass over the points, sorted by Morton code,
+ * instead of copying them into subsquares as qindex::split does.
+ * Duplicate points are removed by removing duplicate codes.
+ */
+{
+  qindex square;
+  vector<unsigned long long> codes;
+  int i;
+  clear();
+  square.sizefit(pnts);
+  x=square.x;
+  y=square.y;
+  side=square.side;
+  for (i=0;i<pnts.size();i++)
+    if (pnts[i].isfinite() && side>0)
+      codes.push_back(interleave((pnts[i].east()-x)/side*LQSCALE,(pnts[i].north()-y)/side*LQSCALE));
+  sort(codes.begin(),codes.end());
+  codes.erase(unique(codes.begin(),codes.end()),codes.end());
+  kids.push_back(0);
+  tri.push_back(nullptr);
+  split(codes,0,codes.size(),0,0);
+}
+
+triangle *linqindex::settri(int n,double nx,double ny,double nside,triangle *thistri)
+/* Sets the triangles of the leaves of node n, whose bottom left corner
+ * is (nx,ny), walking from thistri, and returns the last one set.
+ * The leaves are visited in Morton order, which, like qindex's
+ * Hilbert order, keeps the walks short.
+ */
+{
+  int i;
+  if (kids[n])
+    for (i=0;i<4;i++)
+      thistri=settri(kids[n]+i,nx+(i&1)*(nside/2),ny+(i>>1)*(nside/2),nside/2,thistri);
+  else
+    thistri=tri[n]=thistri->findt(xy(nx+nside/2,ny+nside/2),true);
+  return thistri;
+}
+
+void linqindex::settri(triangle *starttri)
+{
+  if (kids.size())
+    settri(0,x,y,side,starttri);
+}
+
+int linqindex::leafOf(unsigned ix,unsigned iy)
+// ix and iy are coordinates scaled to LQSCALE.
+{
+  int n=0,depth;
+  for (depth=LQDEPTH-1;kids[n];depth--)
+    n=kids[n]+((((iy>>depth)&1)<<1)|((ix>>depth)&1));
+  return n;
+}
+
+triangle *linqindex::findt(xy pnt,bool clip)
+{
+  double fx,fy;
+  if (kids.size()==0 || !pnt.isfinite())
+    return nullptr;
+  fx=(pnt.east()-x)/side*LQSCALE;
+  fy=(pnt.north()-y)/side*LQSCALE;
+  if (!clip && (fx<0 || fx>=LQSCALE || fy<0 || fy>=LQSCALE))
+    return nullptr; // point is outside square
+  fx=max(0.,min(fx,LQSCALE-1));
+  fy=max(0.,min(fy,LQSCALE-1));
+  return tri[leafOf(fx,fy)]->findt(pnt,clip);
+}
+
+vector<triangle *> linqindex::findt(const vector<xy> &pnts,bool clip)
+/* Finds the triangles containing many points. The points are first scaled
+ * together in a loop that the compiler can vectorize, then sorted by the
+ * leaf they're in. As the leaves are in Morton order, consecutive points
+ * are then usually near each other, and each walk starts from the triangle
+ * the previous point was found in, or from the leaf's triangle if that
+ * was outside the TIN.
+ */
+{
+  vector<triangle *> ret(pnts.size(),nullptr);
+  vector<double> fx(pnts.size()),fy(pnts.size());
+  vector<pair<int,int> > order;
+  int i,j;
+  triangle *last=nullptr;
+  double scale=LQSCALE/side;
+  if (kids.size()==0)
+    return ret;
+  for (i=0;i<pnts.size();i++)
+  {
+    fx[i]=(pnts[i].east()-x)*scale;
+    fy[i]=(pnts[i].north()-y)*scale;
+  }
+  for (i=0;i<pnts.size();i++)
+  {
+    if (std::isnan(fx[i]) || std::isnan(fy[i]))
+      continue;
+    if (!clip && (fx[i]<0 || fx[i]>=LQSCALE || fy[i]<0 || fy[i]>=LQSCALE))
+      continue;
+    order.push_back(make_pair(leafOf(max(0.,min(fx[i],LQSCALE-1)),max(0.,min(fy[i],LQSCALE-1))),i));
+  }
+  sort(order.begin(),order.end());
+  for (i=0;i<order.size();i++)
+  {
+    j=order[i].second;
+    if (!last)
+      last=tri[order[i].first];
+    ret[j]=last=last->findt(pnts[j],clip);
+  }
+  return ret;
+}
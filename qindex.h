@@ -64,4 +64,30 @@ public:
   ~qindex();
   int size(); // This returns the total number of nodes, which is 4n+1. The number of leaves is 3n+1.
 };
+
+class linqindex
+/* A quad index like qindex, split by the same rule, but stored in one array
+ * instead of a tree of pointers. It is used only for finding triangles.
+ */
+{
+public:
+  double x,y,side;
+  linqindex();
+  void build(std::vector<xy> pnts);
+  void settri(triangle *starttri);
+  triangle *findt(xy pnt,bool clip=false);
+  std::vector<triangle *> findt(const std::vector<xy> &pnts,bool clip=false);
+  void clear();
+  int size();
+private:
+  std::vector<int> kids;
+  std::vector<triangle *> tri;
+  /* kids[n] is the index of the first of node n's four children, which are
+   * consecutive and in the same order as qindex's subs, or 0 if n is a leaf.
+   * tri[n] is the triangle containing the center of leaf n.
+   */
+  void split(std::vector<unsigned long long> &codes,int lo,int hi,int depth,int n);
+  triangle *settri(int n,double nx,double ny,double nside,triangle *thistri);
+  int leafOf(unsigned ix,unsigned iy);
+};
 #endif
@@ -26,6 +26,7 @@
 #include <iostream>
 #include <cmath>
 #include <stdexcept>
+#include <vector>
 #include "raster.h"
 
 using namespace std;
@@ -117,7 +118,7 @@ void rasterdraw(pointlist &pts,xy center,double width,double height,
   int i,j,k;
   string pixel;
   int pwidth,pheight;
-  xy pnt;
+  vector<double> row;
   double z;
   //hvec bend,dir,center,lastcenter,jump;
   char letter;
@@ -129,14 +130,17 @@ void rasterdraw(pointlist &pts,xy center,double width,double height,
   pwidth=ceil(width*scale);
   pheight=ceil(height*scale);
   ppmheader(pwidth,pheight);
+  row.resize(pwidth);
   for (i=0;i<pheight;i++)
+  {
+    pts.elevations(center+xy(-pwidth/2.,pheight/2.-i)/scale,xy(1/scale,0),pwidth,1,row.data());
     for (j=0;j<pwidth;j++)
     {
-      pnt=xy(j-pwidth/2.,pheight/2.-i);
-      z=pts.elevation(center+pnt/scale);
+      z=row[j];
       pixel=color(z/zscale);
       rfile<<pixel;
     }
+  }
   rclose();
 }
 
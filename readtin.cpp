@@ -27,6 +27,7 @@
 #include "ptin.h"
 #include "tintext.h"
 #include "carlsontin.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -43,7 +44,7 @@ int readTinFile(pointlist &pl,string fileName,double unit)
   PtinHeader ptinHeader;
   if (status==0)
   {
-    bareTriangles=extractTriangles(readDxfGroups(fileName));
+    bareTriangles=readDxfTriangles(fileName);
     status=bareTriangles.size()>0;
     if (status)
       anytin=true;
@@ -56,7 +57,7 @@ int readTinFile(pointlist &pl,string fileName,double unit)
 	  bareTriangles[i][j]*=unit;
     try
     {
-      pl.makeBareTriangles(bareTriangles);
+      pl.makeBareTriangles(move(bareTriangles));
       bareTriangles.clear();
       cout<<"Read "<<pl.triangles.size()<<" triangles\n";
       pl.fillInBareTin();
@@ -76,7 +77,7 @@ int readTinFile(pointlist &pl,string fileName,double unit)
   }
   if (status==0)
   {
-    ptinHeader=readPtin(fileName,pl);
+    ptinHeader=readPtin(fileName,pl,defaultThreads());
     status=ptinHeader.tolRatio>0;
     if (ptinHeader.tolRatio!=PT_UNKNOWN_HEADER_FORMAT &&
         ptinHeader.tolRatio!=PT_NOT_PTIN_FILE &&
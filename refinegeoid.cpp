@@ -26,6 +26,8 @@
 #include <windows.h>
 #endif
 #include <iostream>
+#include <thread>
+#include <exception>
 #include "refinegeoid.h"
 #include "hlattice.h"
 #include "relprime.h"
@@ -35,16 +37,24 @@ using namespace std;
 
 manysum dataArea,totalArea;
 time_t progressTime;
-int avgelev_interrocount=0,avgelev_refinecount=0;
+atomic<int> avgelev_interrocount(0),avgelev_refinecount(0);
 histogram correctionHist(1,2);
+mutex refineMutex;
+atomic<int> spareThreads(0); // threads refineCube may still start
 
-void outProgress()
+void writeProgress()
 {
   cout<<"Total area "<<ldecimal(totalArea.total()*1e-12,totalArea.total()*1e-18)
     <<" Data area "<<ldecimal(dataArea.total()*1e-12,dataArea.total()*1e-18)<<"    \r";
   cout.flush();
 }
 
+void outProgress()
+{
+  lock_guard<mutex> lock(refineMutex);
+  writeProgress();
+}
+
 void progress(geoquad &quad)
 /* At the end, totalArea is 510.0645 Mm² (4*π*(6371 km)²).
  * dataArea advances more smoothly, but depends on the files read in.
@@ -53,6 +63,7 @@ void progress(geoquad &quad)
   double qarea;
   time_t now;
   qarea=quad.area();
+  lock_guard<mutex> lock(refineMutex);
   if (!quad.subdivided())
   {
     if (!quad.isnan())
@@ -67,7 +78,7 @@ void progress(geoquad &quad)
   if (now!=progressTime)
   {
     progressTime=now;
-    outProgress();
+    writeProgress();
   }
 }
 
@@ -89,7 +100,7 @@ void interroquad(geoquad &quad,double spacing)
   xyz corner(3678298.565,3678298.565,3678298.565),ctr,xvec,yvec,tmp,pt;
   vball v;
   hvec h;
-  int radius,i,n,rp;
+  int radius,i,n,rp,count=0;
   double qlen,hradius;
   ctr=quad.centeronearth();
   xvec=corner*ctr;
@@ -120,7 +131,7 @@ void interroquad(geoquad &quad,double spacing)
   xvec*=spacing;
   yvec*=spacing;
   rp=relprime(hlat.nelts);
-  for (i=n=0;i<hlat.nelts && !(quad.nums.size() && quad.nans.size());i++)
+  for (i=n=0;i<hlat.nelts && !(quad.nums().size() && quad.nans().size());i++)
   {
     h=hlat.nthhvec(n);
     v=encodedir(ctr+h.getx()*xvec+h.gety()*yvec);
@@ -128,17 +139,20 @@ void interroquad(geoquad &quad,double spacing)
     if (quad.in(v))
     {
       if (std::isfinite(avgelev(pt)))
-	quad.nums.push_back(v.getxy());
+	quad.nums().push_back(v.getxy());
       else
-	quad.nans.push_back(v.getxy());
-      avgelev_interrocount++;
+	quad.nans().push_back(v.getxy());
+      count++;
     }
     n-=rp;
     if (n<0)
       n+=hlat.nelts;
   }
+  avgelev_interrocount+=count;
 }
 
+void refineSubs(geoquad &quad,double vscale,double tolerance,double sublimit,double spacing,int qsz,bool allbol);
+
 void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double spacing,int qsz,bool allbol)
 {
   int i,j=0,numnums,ncorr;
@@ -154,8 +168,9 @@ void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double
   //cout<<"Area: exact "<<quad.area()<<" approx "<<area<<" ratio "<<quad.area()/area<<endl;
   if (quad.scale>2)
   {
+    lock_guard<mutex> lock(refineMutex);
     cout<<"face "<<quad.face<<" ctr "<<quad.center.getx()<<','<<quad.center.gety()<<endl;
-    cout<<quad.nans.size()<<" nans "<<quad.nums.size()<<" nums before"<<endl;
+    cout<<quad.nans().size()<<" nans "<<quad.nums().size()<<" nums before"<<endl;
   }
   if (allbol)
     gqMatch=bolMatch(quad);
@@ -164,7 +179,7 @@ void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double
       ovlp=true;
   if (!excerptcircles.size())
     ovlp=true;
-  if (ovlp && (quad.nans.size()+quad.nums.size()==0 || (quad.isfull() && area/(quad.nans.size()+quad.nums.size())>sqr(spacing))))
+  if (ovlp && (quad.nans().size()+quad.nums().size()==0 || (quad.isfull() && area/(quad.nans().size()+quad.nums().size())>sqr(spacing))))
     interroquad(quad,spacing);
   //biginterior=area>=sqr(sublimit) && quad.isfull()>0;
   biginterior=false;
@@ -181,14 +196,17 @@ void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double
 	pt=decodedir(v);
 	qpoints[i][j]=avgelev(pt)/vscale;
 	if (std::isfinite(qpoints[i][j]))
-	  quad.nums.push_back(qpt);
+	  quad.nums().push_back(qpt);
 	else
-	  quad.nans.push_back(qpt);
+	  quad.nans().push_back(qpt);
       }
     avgelev_refinecount+=sqr(qsz);
   }
   if (quad.scale>2)
-    cout<<quad.nans.size()<<" nans "<<quad.nums.size()<<" nums after"<<endl;
+  {
+    lock_guard<mutex> lock(refineMutex);
+    cout<<quad.nans().size()<<" nans "<<quad.nums().size()<<" nums after"<<endl;
+  }
   j=0;
   if (ovlp)
     if (gqMatch.flags==GQ_MATCH && gqMatch.numMatches && gqMatch.sameQuad)
@@ -236,6 +254,7 @@ void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double
       maxerr=maxerror(quad,qpoints,qsz);
       if (biginterior)
       {
+	lock_guard<mutex> lock(refineMutex);
 	switch (quad.isfull())
 	{
 	  case -1:
@@ -253,12 +272,105 @@ void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double
 	  maxerr>tolerance/vscale || gqMatch.flags==GQ_SUBDIVIDED))
       {
 	quad.subdivide();
-	for (i=0;i<4;i++)
-	  refine(*quad.sub[i],vscale,tolerance,sublimit,spacing,qsz,allbol);
+	refineSubs(quad,vscale,tolerance,sublimit,spacing,qsz,allbol);
       }
     }
   progress(quad);
-  vector<xy>().swap(quad.nums); // deallocate vectors
-  vector<xy>().swap(quad.nans);
+  quad.releaseSamples();
+  lock_guard<mutex> lock(refineMutex);
   correctionHist<<j;
 }
+
+void refineSubs(geoquad &quad,double vscale,double tolerance,double sublimit,double spacing,int qsz,bool allbol)
+/* Refines the four subquads of quad. If refineCube has threads to spare,
+ * the first three may be refined on threads of their own; the last is
+ * always refined on this thread. Each subquad's result is the same no matter
+ * which thread refines it, so the cubemap is the same.
+ */
+{
+  int i;
+  vector<thread> helpers;
+  exception_ptr errors[4];
+  auto refineSub=[&](int n)
+  {
+    try
+    {
+      refine(*quad.sub[n],vscale,tolerance,sublimit,spacing,qsz,allbol);
+    }
+    catch (...)
+    {
+      errors[n]=current_exception();
+    }
+  };
+  for (i=0;i<4;i++)
+    if (i<3 && spareThreads.fetch_sub(1)>0)
+      helpers.push_back(thread([&,i]()
+      {
+	refineSub(i);
+	spareThreads++;
+      }));
+    else
+    {
+      if (i<3)
+	spareThreads++;
+      refineSub(i);
+    }
+  for (i=0;i<helpers.size();i++)
+    helpers[i].join();
+  for (i=0;i<4;i++)
+    if (errors[i])
+      rethrow_exception(errors[i]);
+}
+
+void refineCube(cubemap &cube,double interroSpacing,double tolerance,double sublimit,double spacing,int qsz,bool allbol,int threads)
+/* Interrogates and refines all six faces of cube, using up to threads
+ * threads. Each face starts on a thread of its own if there are enough;
+ * whenever a quad is subdivided and a thread is idle, it takes a subquad.
+ */
+{
+  int i;
+  if (threads<1)
+    threads=1;
+  spareThreads=threads-1;
+  auto refineFace=[&](int n)
+  {
+    interroquad(cube.faces[n],interroSpacing);
+    refine(cube.faces[n],cube.scale,tolerance,sublimit,spacing,qsz,allbol);
+  };
+  vector<thread> helpers;
+  exception_ptr errors[6];
+  for (i=0;i<6;i++)
+    if (i<5 && spareThreads.fetch_sub(1)>0)
+      helpers.push_back(thread([&,i]()
+      {
+	try
+	{
+	  refineFace(i);
+	}
+	catch (...)
+	{
+	  errors[i]=current_exception();
+	}
+	spareThreads++;
+      }));
+    else
+    {
+      if (i<5)
+	spareThreads++;
+      try
+      {
+	refineFace(i);
+      }
+      catch (...)
+      {
+	errors[i]=current_exception();
+      }
+    }
+  for (i=0;i<helpers.size();i++)
+    helpers[i].join();
+  spareThreads=0;
+  cube.uncache();
+  for (i=0;i<6;i++)
+    if (errors[i])
+      rethrow_exception(errors[i]);
+}
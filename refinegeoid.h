@@ -21,14 +21,19 @@
  * and Lesser General Public License along with Bezitopo. If not, see
  * <http://www.gnu.org/licenses/>.
  */
+#include <atomic>
+#include <mutex>
 #include "geoid.h"
 #include "histogram.h"
 #include "manysum.h"
 
-extern int avgelev_interrocount,avgelev_refinecount;
+extern std::atomic<int> avgelev_interrocount,avgelev_refinecount;
 extern histogram correctionHist;
 extern manysum dataArea,totalArea;
+// Lock refineMutex to touch correctionHist, dataArea, or totalArea while refining.
+extern std::mutex refineMutex;
 
 void outProgress();
 void interroquad(geoquad &quad,double spacing);
 void refine(geoquad &quad,double vscale,double tolerance,double sublimit,double spacing,int qsz,bool allbol);
+void refineCube(cubemap &cube,double interroSpacing,double tolerance,double sublimit,double spacing,int qsz,bool allbol,int threads=1);
@@ -23,11 +23,13 @@
  */
 #include <map>
 #include <cmath>
+#include <mutex>
 #include "relprime.h"
 
 using namespace std;
 
 map<unsigned,unsigned> relprimes;
+mutex relprimeMutex;
 
 unsigned gcd(unsigned a,unsigned b)
 {
@@ -49,6 +51,7 @@ unsigned relprime(unsigned n)
 {
   unsigned ret,twice;
   double phin;
+  lock_guard<mutex> lock(relprimeMutex);
   ret=relprimes[n];
   if (!ret)
   {
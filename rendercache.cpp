@@ -24,9 +24,64 @@
 #include "rendercache.h"
 using namespace std;
 
+RenderCache::RenderCache()
+{
+  stopping=false;
+  busy=0;
+  seq=0;
+  nRendered=0;
+  totalLatency=lastLatency=maxLatency=0;
+  next=renderMap.end();
+}
+
+RenderCache::~RenderCache()
+{
+  int i;
+  stopWorkers();
+  for (i=0;i<queue.size();i++)
+    delete queue[i].copy;
+}
+
+void RenderCache::stopWorkers()
+{
+  int i;
+  {
+    lock_guard<mutex> lock(jobMutex);
+    stopping=true;
+  }
+  jobReady.notify_all();
+  for (i=0;i<workers.size();i++)
+    workers[i].join();
+  workers.clear();
+  stopping=false;
+}
+
+void RenderCache::setThreads(int n)
+/* Sets the number of worker threads. With 0, objects are rendered as they're
+ * checked in. Jobs left in the queue when the workers stop are done by the
+ * new workers, or here if there are none.
+ */
+{
+  int i;
+  RenderJob job;
+  stopWorkers();
+  if (n<1)
+    while (takeJob(job))
+    {
+      renderJob(job);
+      finishJob(job);
+    }
+  for (i=0;i<n;i++)
+    workers.push_back(thread(&RenderCache::work,this));
+}
+
 void RenderCache::clear()
 {
   renderMap.clear();
+  next=renderMap.end();
+  lock_guard<mutex> lock(jobMutex);
+  latestJob.clear();
+  finished.clear();
 }
 
 void RenderCache::clearPresent()
@@ -51,6 +106,12 @@ void RenderCache::deleteAbsent()
   for (j=0;j<delenda.size();j++)
     renderMap.erase(delenda[j]);
   next=renderMap.begin();
+  if (delenda.size())
+  {
+    lock_guard<mutex> lock(jobMutex);
+    for (j=0;j<delenda.size();j++)
+      latestJob.erase(delenda[j]);
+  }
 }
 
 bool RenderCache::shouldRerender(double oldScale,double newScale)
@@ -61,22 +122,167 @@ bool RenderCache::shouldRerender(double oldScale,double newScale)
 }
 
 void RenderCache::checkInObject(drawobj *obj,double pixelScale,int layr,int colr,int thik,int ltype)
+/* If the object has to be rerendered and there are workers, a copy of it
+ * is queued, and the old rendering is kept until collectFinished puts in
+ * the new one.
+ */
 {
   unsigned objHash;
-  if (!renderMap.count(obj))
-    renderMap[obj].pixelScale=INFINITY;
-  renderMap[obj].colr=colr;
-  renderMap[obj].thik=thik;
-  renderMap[obj].ltype=ltype;
-  renderMap[obj].present=true;
+  bool fresh,inFlight,dirty;
+  drawobj *copy=nullptr;
+  RenderJob job;
+  fresh=!renderMap.count(obj);
+  RenderItem &item=renderMap[obj];
+  if (fresh)
+  {
+    item.pixelScale=INFINITY;
+    item.appliedSeq=item.queuedSeq=seq;
+    // A job for an object that used to be at this address is ignored.
+  }
+  item.colr=colr;
+  item.thik=thik;
+  item.ltype=ltype;
+  item.present=true;
   objHash=obj->hash(); // Computing the hash of a large polyspiral takes 1/20 as much time as rendering it.
-  if (shouldRerender(renderMap[obj].pixelScale,pixelScale) ||
-      objHash!=renderMap[obj].hash)
+  inFlight=item.queuedSeq>item.appliedSeq;
+  if (inFlight)
+    dirty=shouldRerender(item.queuedScale,pixelScale) || objHash!=item.queuedHash;
+  else
+    dirty=fresh || shouldRerender(item.pixelScale,pixelScale) || objHash!=item.hash;
+  if (dirty)
+  {
+    if (workers.size())
+      copy=obj->clone();
+    if (copy)
+    {
+      job.obj=obj;
+      job.copy=copy;
+      job.pixelScale=pixelScale;
+      job.layr=layr;
+      job.colr=colr;
+      job.thik=thik;
+      job.ltype=ltype;
+      job.hash=objHash;
+      job.seq=++seq;
+      job.queueTime=chrono::steady_clock::now();
+      item.queuedSeq=seq;
+      item.queuedHash=objHash;
+      item.queuedScale=pixelScale;
+      {
+	lock_guard<mutex> lock(jobMutex);
+	latestJob[obj]=seq;
+	queue.push_back(move(job));
+      }
+      jobReady.notify_one();
+    }
+    else
+    {
+      item.rendering=obj->render3d(pixelScale,layr,colr,thik,ltype);
+      item.pixelScale=pixelScale;
+      item.hash=objHash;
+      item.appliedSeq=item.queuedSeq=++seq;
+    }
+  }
+}
+
+bool RenderCache::takeJob(RenderJob &job)
+/* Takes the next job from the queue, dropping any that have been superseded
+ * or whose object is gone. Returns false if there's none. Called with
+ * jobMutex held, or when there are no workers.
+ */
+{
+  map<drawobj *,unsigned>::iterator found;
+  while (queue.size())
+  {
+    job=move(queue.front());
+    queue.pop_front();
+    found=latestJob.find(job.obj);
+    if (found!=latestJob.end() && found->second==job.seq)
+      return true;
+    delete job.copy;
+  }
+  return false;
+}
+
+void RenderCache::renderJob(RenderJob &job)
+// Renders the copy and deletes it. Runs without holding jobMutex.
+{
+  try
+  {
+    job.rendering=job.copy->render3d(job.pixelScale,job.layr,job.colr,job.thik,job.ltype);
+  }
+  catch (...)
+  {
+    job.rendering.clear();
+  }
+  delete job.copy;
+  job.copy=nullptr;
+}
+
+void RenderCache::finishJob(RenderJob &job)
+// Called with jobMutex held, or when there are no workers.
+{
+  map<drawobj *,unsigned>::iterator found;
+  lastLatency=chrono::duration<double,milli>(chrono::steady_clock::now()-job.queueTime).count();
+  totalLatency+=lastLatency;
+  if (lastLatency>maxLatency)
+    maxLatency=lastLatency;
+  nRendered++;
+  found=latestJob.find(job.obj);
+  if (found!=latestJob.end() && found->second==job.seq)
+    latestJob.erase(found);
+  finished.push_back(move(job));
+}
+
+void RenderCache::work()
+{
+  RenderJob job;
+  unique_lock<mutex> lock(jobMutex);
+  while (true)
+  {
+    while (!stopping && queue.empty())
+      jobReady.wait(lock);
+    if (stopping)
+      break;
+    if (takeJob(job))
+    {
+      busy++;
+      lock.unlock();
+      renderJob(job);
+      lock.lock();
+      busy--;
+      finishJob(job);
+      jobDone.notify_all();
+    }
+  }
+}
+
+bool RenderCache::collectFinished()
+/* Puts the finished renderings in the cache, replacing the old ones.
+ * Returns true if any was put in, meaning the canvas should be repainted.
+ */
+{
+  int i;
+  bool ret=false;
+  vector<RenderJob> done;
+  map<drawobj *,RenderItem>::iterator item;
+  {
+    lock_guard<mutex> lock(jobMutex);
+    done.swap(finished);
+  }
+  for (i=0;i<done.size();i++)
   {
-    renderMap[obj].rendering=obj->render3d(pixelScale,layr,colr,thik,ltype);
-    renderMap[obj].pixelScale=pixelScale;
-    renderMap[obj].hash=objHash;
+    item=renderMap.find(done[i].obj);
+    if (item!=renderMap.end() && done[i].seq>item->second.appliedSeq)
+    {
+      item->second.rendering.swap(done[i].rendering);
+      item->second.pixelScale=done[i].pixelScale;
+      item->second.hash=done[i].hash;
+      item->second.appliedSeq=done[i].seq;
+      ret=true;
+    }
   }
+  return ret;
 }
 
 RenderItem RenderCache::nextRenderItem()
@@ -91,3 +297,50 @@ RenderItem RenderCache::nextRenderItem()
   }
   return ret;
 }
+
+bool RenderCache::pending()
+// True if there are renderings not yet done or not yet collected.
+{
+  lock_guard<mutex> lock(jobMutex);
+  return latestJob.size() || busy || finished.size();
+}
+
+void RenderCache::waitIdle()
+// Waits until all jobs are rendered. They still have to be collected.
+{
+  unique_lock<mutex> lock(jobMutex);
+  while (workers.size() && (latestJob.size() || busy))
+    jobDone.wait(lock);
+}
+
+int RenderCache::queueDepth()
+// Number of objects waiting to be rendered or being rendered
+{
+  lock_guard<mutex> lock(jobMutex);
+  return latestJob.size();
+}
+
+int RenderCache::renderCount()
+{
+  lock_guard<mutex> lock(jobMutex);
+  return nRendered;
+}
+
+double RenderCache::renderLatency()
+// Mean time in milliseconds from queueing a job to finishing it
+{
+  lock_guard<mutex> lock(jobMutex);
+  return nRendered?totalLatency/nRendered:0;
+}
+
+double RenderCache::maxRenderLatency()
+{
+  lock_guard<mutex> lock(jobMutex);
+  return maxLatency;
+}
+
+double RenderCache::lastRenderLatency()
+{
+  lock_guard<mutex> lock(jobMutex);
+  return lastLatency;
+}
@@ -24,6 +24,11 @@
 #ifndef RENDERCACHE_H
 #define RENDERCACHE_H
 #include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include "drawobj.h"
 #include "halton.h"
 #include "random.h"
@@ -40,6 +45,13 @@
  * drawing layer has a line in the setback layer, and you hide the setback
  * layer, the line will remain visible until you rerender everything or the
  * block is rerendered because the scale changes.
+ *
+ * If the cache has worker threads, an object that can be cloned is copied
+ * and the copy is queued to be rendered on a worker, so that the GUI thread
+ * isn't held up by a big contour. Until the rendering is done, the previous
+ * rendering is drawn. Finished renderings are put in the cache only by
+ * collectFinished, which is called by the GUI thread before drawing, so
+ * the cache is never seen half-changed.
  */
 
 class RenderItem
@@ -52,6 +64,25 @@ public:
   unsigned hash;
   double pixelScale;
   std::vector<drawingElement> rendering;
+  unsigned appliedSeq,queuedSeq;
+  unsigned queuedHash;
+  double queuedScale;
+  /* appliedSeq is the sequence number of the job whose rendering this is.
+   * If queuedSeq is greater, a job is being rendered for queuedHash and
+   * queuedScale.
+   */
+};
+
+class RenderJob
+{
+public:
+  drawobj *obj; // the object in the cache, which the worker must not touch
+  drawobj *copy; // the clone that the worker renders and deletes
+  double pixelScale;
+  int layr,colr,thik,ltype;
+  unsigned hash,seq;
+  std::chrono::steady_clock::time_point queueTime;
+  std::vector<drawingElement> rendering;
 };
 
 class RenderCache
@@ -61,11 +92,41 @@ private:
   std::map<drawobj *,RenderItem> renderMap;
   bool shouldRerender(double oldScale,double newScale);
   std::map<drawobj *,RenderItem>::iterator next;
+  std::vector<std::thread> workers;
+  std::deque<RenderJob> queue;
+  std::vector<RenderJob> finished;
+  std::map<drawobj *,unsigned> latestJob;
+  /* The sequence number of the newest job for each object that's waiting or
+   * being rendered. A worker drops a job that isn't the newest for its object.
+   */
+  std::mutex jobMutex;
+  std::condition_variable jobReady,jobDone;
+  bool stopping;
+  int busy; // number of jobs the workers are rendering
+  unsigned seq;
+  int nRendered;
+  double totalLatency,lastLatency,maxLatency; // milliseconds from queueing to finishing
+  void work();
+  bool takeJob(RenderJob &job);
+  void renderJob(RenderJob &job);
+  void finishJob(RenderJob &job);
+  void stopWorkers();
 public:
+  RenderCache();
+  ~RenderCache();
+  void setThreads(int n);
   void clear();
   void clearPresent();
   void deleteAbsent();
   void checkInObject(drawobj *obj,double pixelScale,int layr,int colr,int thik,int ltype);
+  bool collectFinished();
   RenderItem nextRenderItem();
+  bool pending();
+  void waitIdle();
+  int queueDepth();
+  int renderCount();
+  double renderLatency();
+  double maxRenderLatency();
+  double lastRenderLatency();
 };
 #endif
@@ -27,6 +27,7 @@
 #include "sitewindow.h"
 #include "except.h"
 #include "globals.h"
+#include "geoid.h"
 
 using namespace std;
 ProjectionList allProjections;
@@ -39,6 +40,7 @@ void readAllProjections()
 
 int main(int argc, char *argv[])
 {
+  int ret;
   QApplication app(argc, argv);
   QTranslator translator,qtTranslator;
   if (qtTranslator.load(QLocale(),QLatin1String("qt"),QLatin1String("_"),
@@ -61,5 +63,8 @@ int main(int argc, char *argv[])
   readAllProjections();
   SiteWindow window;
   window.show();
-  return app.exec();
+  ret=app.exec();
+  if (leafCacheHits+leafCacheMisses)
+    cout<<"Geoid leaf cache: "<<leafCacheHits<<" hits, "<<leafCacheMisses<<" misses"<<endl;
+  return ret;
 }
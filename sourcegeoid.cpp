@@ -24,6 +24,7 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <cassert>
 #include "config.h"
 #include "sourcegeoid.h"
@@ -33,12 +34,15 @@
 #include "manysum.h"
 #include "ldecimal.h"
 #include "except.h"
+#include "threads.h"
 
 using namespace std;
 vector<geoid> geo;
+unsigned geoGeneration;
 map<int,matrix> quadinv;
 vector<smallcircle> excerptcircles;
 cylinterval excerptinterval;
+geoidindex geoinx;
 bool outBigEndian;
 
 void setEndian(int n)
@@ -126,11 +130,151 @@ double readdouble(istream &file)
   return ret;
 }
 
-double geolattice::elev(int lat,int lon)
+const double powersOf10[23]=
+{
+  1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+  1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+};
+
+double parsedouble(const char *begin,const char *end)
+/* Parses the word from begin to end, giving the same result as readdouble,
+ * including throwing. A plain decimal number whose digits fit in 53 bits
+ * and whose exponent is at most 22 is converted with one multiplication
+ * or division of exact numbers, which is correctly rounded as stod is.
+ * Anything else goes to stod.
+ */
+{
+  const char *p=begin;
+  bool neg=false,digits=false;
+  unsigned long long mant=0;
+  int ndigits=0,exp=0,expexp=0,expsign=1;
+  string str;
+  size_t pos;
+  double ret;
+  if (p<end && (*p=='-' || *p=='+'))
+    neg=*p++=='-';
+  for (;p<end && *p>='0' && *p<='9';p++,digits=true)
+  {
+    if (ndigits<19)
+    {
+      mant=mant*10+(*p-'0');
+      if (mant)
+	ndigits++;
+    }
+    else
+      ndigits=99;
+  }
+  if (p<end && *p=='.')
+    for (p++;p<end && *p>='0' && *p<='9';p++,digits=true)
+    {
+      if (ndigits<19)
+      {
+	mant=mant*10+(*p-'0');
+	if (mant)
+	  ndigits++;
+	exp--;
+      }
+      else
+	ndigits=99;
+    }
+  if (digits && p<end && (*p=='e' || *p=='E'))
+  {
+    p++;
+    if (p<end && (*p=='-' || *p=='+'))
+      expsign=(*p++=='-')?-1:1;
+    for (digits=false;p<end && *p>='0' && *p<='9' && expexp<1000;p++,digits=true)
+      expexp=expexp*10+(*p-'0');
+  }
+  exp+=expsign*expexp;
+  if (digits && p==end && ndigits<=19 && mant<=(1ULL<<53) && (mant==0 || (exp>=-22 && exp<=22)))
+  {
+    ret=mant;
+    if (mant && exp<0) // if mant is 0, exp may be outside the table
+      ret/=powersOf10[-exp];
+    else if (mant)
+      ret*=powersOf10[exp];
+    return neg?-ret:ret;
+  }
+  str=string(begin,end);
+  ret=stod(str,&pos);
+  if (pos<str.length())
+    throw 0;
+  return ret;
+}
+
+void readundulatext(const char *text,size_t len,geolattice &geo,bool northFirst,int threads)
+/* Reads the numbers in text, which is the part of a text geoid file after
+ * the header, into geo.undula the same way as readdouble one at a time.
+ * The text is split into chunks at whitespace; each thread counts the
+ * numbers in a chunk, then each parses a chunk, knowing where its first
+ * number goes. If northFirst, the first row in the text is the north row.
+ * Throws if there aren't enough numbers or one is bad.
+ */
+{
+  int i,nchunks=len/1048576+1;
+  size_t b,n=(size_t)(geo.height+1)*(geo.width+1);
+  vector<size_t> bounds(nchunks+1),first(nchunks+1);
+  bounds[0]=0;
+  bounds[nchunks]=len;
+  for (i=1;i<nchunks;i++)
+  {
+    b=len/nchunks*i;
+    if (b<bounds[i-1])
+      b=bounds[i-1];
+    while (b<len && !isspace((unsigned char)text[b]))
+      b++;
+    bounds[i]=b;
+  }
+  auto forWords=[&](int chunk,std::function<void(const char *,const char *)> word)
+  {
+    size_t j=bounds[chunk],k;
+    while (true)
+    {
+      while (j<bounds[chunk+1] && isspace((unsigned char)text[j]))
+	j++;
+      if (j>=bounds[chunk+1])
+	break;
+      for (k=j;k<bounds[chunk+1] && !isspace((unsigned char)text[k]);k++);
+      word(text+j,text+k);
+      j=k;
+    }
+  };
+  parallelForEach(0,nchunks,threads,[&](int chunk)
+  {
+    size_t count=0;
+    forWords(chunk,[&](const char *,const char *){count++;});
+    first[chunk+1]=count;
+  });
+  for (i=0;i<nchunks;i++)
+    first[i+1]+=first[i];
+  if (first[nchunks]<n)
+    throw BeziExcept(badData);
+  parallelForEach(0,nchunks,threads,[&](int chunk)
+  {
+    size_t inx=first[chunk],row,col;
+    if (inx<n)
+      forWords(chunk,[&](const char *wbegin,const char *wend)
+      {
+	if (inx<n)
+	{
+	  row=inx/(geo.width+1);
+	  col=inx%(geo.width+1);
+	  if (northFirst)
+	    row=geo.height-row;
+	  geo.undula[row*(geo.width+1)+col]=rint(65536*(parsedouble(wbegin,wend)));
+	}
+	inx++;
+      });
+  });
+}
+
+int geolattice::cell(int lat,int lon,double &epart,double &npart)
+/* Returns the number of the cell containing (lat,lon), counting from
+ * the southwest corner eastward, or -1 if it's outside the lattice,
+ * and sets epart and npart to where in the cell it is.
+ */
 {
   int easting,northing,eint,nint;
-  double epart,npart,ne,nw,se,sw,ret;
-  xy neslp,nwslp,seslp,swslp;
   easting=(lon-wbd)&0x7fffffff;
   northing=lat-sbd;
   epart=-(double)easting*width/(wbd-ebd);
@@ -154,18 +298,25 @@ double geolattice::elev(int lat,int lon)
   npart=1-npart;
   epart=1-epart;
   if (eint>=0 && eint<width && nint>=0 && nint<height)
-  {
-    sw=undula[(width+1)*nint+eint];
-    se=undula[(width+1)*nint+eint+1];
-    nw=undula[(width+1)*(nint+1)+eint];
-    ne=undula[(width+1)*(nint+1)+eint+1];
-    swslp=xy(eslope[(width+1)*nint+eint],nslope[(width+1)*nint+eint])/2;
-    seslp=xy(eslope[(width+1)*nint+eint+1],nslope[(width+1)*nint+eint+1])/2;
-    nwslp=xy(eslope[(width+1)*(nint+1)+eint],nslope[(width+1)*(nint+1)+eint])/2;
-    neslp=xy(eslope[(width+1)*(nint+1)+eint+1],nslope[(width+1)*(nint+1)+eint+1])/2;
-  }
+    return nint*width+eint;
   else
-    sw=se=nw=ne=-2147483648;
+    return -1;
+}
+
+array<double,16> geolattice::cellControls(int c)
+// Returns the control points of the bicubic surface over cell c.
+{
+  int eint=c%width,nint=c/width;
+  double ne,nw,se,sw;
+  xy neslp,nwslp,seslp,swslp;
+  sw=undula[(width+1)*nint+eint];
+  se=undula[(width+1)*nint+eint+1];
+  nw=undula[(width+1)*(nint+1)+eint];
+  ne=undula[(width+1)*(nint+1)+eint+1];
+  swslp=xy(eslope[(width+1)*nint+eint],nslope[(width+1)*nint+eint])/2;
+  seslp=xy(eslope[(width+1)*nint+eint+1],nslope[(width+1)*nint+eint+1])/2;
+  nwslp=xy(eslope[(width+1)*(nint+1)+eint],nslope[(width+1)*(nint+1)+eint])/2;
+  neslp=xy(eslope[(width+1)*(nint+1)+eint+1],nslope[(width+1)*(nint+1)+eint+1])/2;
   if (sw==-2147483648)
     sw=1e30;
   if (se==-2147483648)
@@ -174,13 +325,67 @@ double geolattice::elev(int lat,int lon)
     nw=1e30;
   if (ne==-2147483648)
     ne=1e30;
+  return bicubicControls(sw,swslp,se,seslp,nw,nwslp,ne,neslp);
+}
+
+double geolattice::elev(int lat,int lon)
+{
+  int c;
+  double epart,npart,ret;
+  c=cell(lat,lon,epart,npart);
+  if (c<0)
+    return NAN;
   //ret=((sw*(1-epart)+se*epart)*(1-npart)+(nw*(1-epart)+ne*epart)*npart)/65536;
-  ret=bicubic(sw,swslp,se,seslp,nw,nwslp,ne,neslp,epart,npart)/65536;
+  ret=beziersquare(cellControls(c),epart,npart)/65536;
   if (ret>8850 || ret<-11000)
     ret=NAN;
   return ret;
 }
 
+void geolattice::elevations(const vector<xyz> &dirs,double *elev)
+/* Same as calling elev on each of dirs, but sorts the points by cell,
+ * so that each cell's control points are computed once for all the points
+ * in it.
+ */
+{
+  int i,j,n=dirs.size();
+  vector<int> cells(n),order(n);
+  vector<double> eparts(n),nparts(n);
+  array<double,16> controls;
+  double ret;
+  xyz dir;
+  for (i=0;i<n;i++)
+  {
+    dir=dirs[i];
+    cells[i]=cell(dir.lati(),dir.loni(),eparts[i],nparts[i]);
+    order[i]=i;
+  }
+  sort(order.begin(),order.end(),[&cells](int a,int b){return cells[a]<cells[b];});
+  for (i=0;i<n;i=j)
+  {
+    for (j=i+1;j<n && cells[order[j]]==cells[order[i]];j++);
+    if (cells[order[i]]<0)
+      for (;i<j;i++)
+	elev[order[i]]=NAN;
+    else
+    {
+      controls=cellControls(cells[order[i]]);
+      for (;i<j;i++)
+      {
+	ret=beziersquare(controls,eparts[order[i]],nparts[order[i]])/65536;
+	elev[order[i]]=(ret>8850 || ret<-11000)?NAN:ret;
+      }
+    }
+  }
+}
+
+vector<double> geolattice::elevations(const vector<xyz> &dirs)
+{
+  vector<double> ret(dirs.size());
+  elevations(dirs,ret.data());
+  return ret;
+}
+
 void geolattice::setundula()
 {
   int i,j;
@@ -520,7 +725,8 @@ int readusngatxt(geolattice &geo,string filename)
  * http://earth-info.nga.mil/GandG/wgs84/gravitymod/egm2008/egm08_wgs84.html
  */
 {
-  int i,j,ret=0;
+  int ret=0;
+  size_t pos;
   fstream file;
   usngatxtheader hdr;
   file.open(filename,fstream::in|fstream::binary);
@@ -543,9 +749,11 @@ int readusngatxt(geolattice &geo,string filename)
       try
       {
 	geo.setheader(hdr,fileSize(file)/2);
-        for (i=0;i<geo.height+1;i++)
-          for (j=0;j<geo.width+1;j++)
-            geo.undula[(geo.height-i)*(geo.width+1)+j]=rint(65536*(readdouble(file)));
+        mappedfile text(filename);
+        pos=file.tellg();
+        if (pos>text.size())
+          throw BeziExcept(badData);
+        readundulatext(text.data()+pos,text.size()-pos,geo,true,defaultThreads());
       }
       catch (...)
       {
@@ -727,7 +935,8 @@ int readcarlsongsf(geolattice &geo,string filename)
  * http://web.carlsonsw.com/files/knowledgebase/kbase_attach/716/Geoid Separation File Format.pdf
  */
 {
-  int i,j,ret=0;
+  int ret=0;
+  size_t pos;
   fstream file;
   carlsongsfheader hdr;
   file.open(filename,fstream::in|fstream::binary);
@@ -750,9 +959,11 @@ int readcarlsongsf(geolattice &geo,string filename)
       try
       {
 	geo.setheader(hdr,fileSize(file)/2);
-        for (i=0;i<geo.height+1;i++)
-          for (j=0;j<geo.width+1;j++)
-            geo.undula[i*(geo.width+1)+j]=rint(65536*(readdouble(file)));
+        mappedfile text(filename);
+        pos=file.tellg();
+        if (pos>text.size())
+          throw BeziExcept(badData);
+        readundulatext(text.data()+pos,text.size()-pos,geo,false,defaultThreads());
       }
       catch (...)
       {
@@ -952,19 +1163,159 @@ void writeboldatni(geoid &geo,string filename)
     throw BeziExcept(unsetGeoid);
 }
 
+/* The buckets of geoidindex are 2**23 binary angle units (1.40625°) on a side.
+ * Each geoid is put in the buckets its boundrect touches and one more all
+ * around, since the boundrect of a cubemap is computed from sample points
+ * and a quad can bulge slightly past it.
+ */
+#define GEOINX_SHIFT 23
+#define GEOINX_LATS (DEG180>>GEOINX_SHIFT)
+#define GEOINX_LONS (DEG360>>GEOINX_SHIFT)
+
+geoidindex::geoidindex()
+{
+  clear();
+}
+
+void geoidindex::clear()
+{
+  nsources=0;
+  generation=0;
+  start.clear();
+  items.clear();
+}
+
+int geoidindex::size()
+{
+  return nsources;
+}
+
+bool geoidindex::current()
+// True if the index was built since geo last changed.
+{
+  return start.size() && generation==geoGeneration;
+}
+
+int geoidindex::bucket(int lat,int lon)
+{
+  int latb=((long long)lat+DEG90)>>GEOINX_SHIFT;
+  int lonb=(((unsigned)lon+DEG180)&(DEG360-1))>>GEOINX_SHIFT;
+  if (latb<0)
+    latb=0;
+  if (latb>=GEOINX_LATS)
+    latb=GEOINX_LATS-1;
+  return latb*GEOINX_LONS+lonb;
+}
+
+void geoidindex::build(vector<geoid> &geos)
+{
+  int i,j,k,pass,lat0,lat1,lon0,nlons;
+  unsigned wb,w;
+  cylinterval cyl;
+  vector<array<int,4> > ranges; // first and last latitude, first and number of longitudes
+  clear();
+  nsources=geos.size();
+  generation=geoGeneration;
+  for (i=0;i<nsources;i++)
+  {
+    if (geos[i].cmap || geos[i].glat)
+      cyl=geos[i].boundrect();
+    else // fake geoid for testing, defined everywhere
+      cyl.setfull();
+    lat0=(((long long)cyl.sbd+DEG90)>>GEOINX_SHIFT)-1;
+    lat1=(((long long)cyl.nbd+DEG90)>>GEOINX_SHIFT)+1;
+    if (lat0<0)
+      lat0=0;
+    if (lat1>=GEOINX_LATS)
+      lat1=GEOINX_LATS-1;
+    wb=((unsigned)cyl.wbd+DEG180)&(DEG360-1);
+    w=((unsigned)cyl.ebd-(unsigned)cyl.wbd)&(DEG360-1);
+    lon0=(wb>>GEOINX_SHIFT)-1;
+    nlons=((wb+w)>>GEOINX_SHIFT)+1-lon0+1;
+    if ((cyl.ebd^cyl.wbd)==DEG360 || nlons>=GEOINX_LONS)
+    {
+      lon0=0;
+      nlons=GEOINX_LONS;
+    }
+    ranges.push_back(array<int,4>{lat0,lat1,lon0,nlons});
+  }
+  start.assign(GEOINX_LATS*GEOINX_LONS+1,0);
+  for (pass=0;pass<2;pass++)
+  {
+    for (i=0;i<nsources;i++)
+      for (j=ranges[i][0];j<=ranges[i][1];j++)
+	for (k=0;k<ranges[i][3];k++)
+	  if (pass)
+	    items[start[j*GEOINX_LONS+((ranges[i][2]+k)&(GEOINX_LONS-1))]++]=i;
+	  else
+	    start[j*GEOINX_LONS+((ranges[i][2]+k)&(GEOINX_LONS-1))+1]++;
+    if (pass)
+    { // Filling advanced each start to the next bucket's; shift them back.
+      for (j=start.size()-1;j>0;j--)
+	start[j]=start[j-1];
+      start[0]=0;
+    }
+    else
+    {
+      for (j=1;j<start.size();j++)
+	start[j]+=start[j-1];
+      items.resize(start.back());
+    }
+  }
+}
+
+void geoidindex::sources(xyz dir,const int *&begin,const int *&end)
+// Sets begin and end to the range of geoids that may have data at dir.
+{
+  int b;
+  if (start.size())
+  {
+    b=bucket(dir.lati(),dir.loni());
+    begin=items.data()+start[b];
+    end=items.data()+start[b+1];
+  }
+  else
+    begin=end=nullptr;
+}
+
+void geoChanged()
+// Makes geoinx out of date, so that avgelev doesn't use it until it's rebuilt.
+{
+  geoGeneration++;
+}
+
 double avgelev(xyz dir)
+/* Averages the undulations of all geoids that have data at dir. If geoinx
+ * is current, only the geoids it lists are asked; the rest would
+ * return NaN, so the sum is the same.
+ */
 {
   int i,n;
   double u,sum;
-  for (sum=i=n=0;i<geo.size();i++)
+  const int *g,*gend;
+  if (geoinx.current())
   {
-    u=geo[i].elev(dir);
-    if (std::isfinite(u))
+    geoinx.sources(dir,g,gend);
+    for (sum=n=0;g<gend;g++)
     {
-      sum+=u;
-      n++;
+      u=geo[*g].elev(dir);
+      if (std::isfinite(u))
+      {
+	sum+=u;
+	n++;
+      }
     }
   }
+  else
+    for (sum=i=n=0;i<geo.size();i++)
+    {
+      u=geo[i].elev(dir);
+      if (std::isfinite(u))
+      {
+	sum+=u;
+	n++;
+      }
+    }
   return sum/n;
 }
 
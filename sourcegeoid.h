@@ -70,6 +70,10 @@ public:
   std::vector<int> undula,eslope,nslope; // starts at southwest corner, heads east
   double elev(int lat,int lon);
   double elev(xyz dir);
+  void elevations(const std::vector<xyz> &dirs,double *elev);
+  std::vector<double> elevations(const std::vector<xyz> &dirs);
+  int cell(int lat,int lon,double &epart,double &npart);
+  std::array<double,16> cellControls(int c);
   void setslopes();
   void resize(size_t dataSize=~(size_t)0);
   void setundula();
@@ -116,6 +120,27 @@ struct geoid
   cylinterval boundrect();
 };
 
+class geoidindex
+/* Buckets of latitude and longitude, each listing, in order, the geoids
+ * whose boundrects come within a bucket of it, so that avgelev asks only
+ * those geoids instead of all of them. It remembers geoGeneration when
+ * built; once geoChanged bumps that, avgelev ignores it until it's rebuilt.
+ */
+{
+public:
+  geoidindex();
+  void build(std::vector<geoid> &geos);
+  void clear();
+  int size();
+  bool current();
+  void sources(xyz dir,const int *&begin,const int *&end);
+private:
+  int nsources;
+  unsigned generation;
+  std::vector<int> start,items;
+  int bucket(int lat,int lon);
+};
+
 struct geoformat
 {
   /* cmd is the argument to -f on the command line; ext is the file extension.
@@ -130,6 +155,8 @@ struct geoformat
 void setEndian(int n);
 std::string readword(std::istream &file);
 double readdouble(std::istream &file);
+double parsedouble(const char *begin,const char *end);
+void readundulatext(const char *text,size_t len,geolattice &geo,bool northFirst,int threads);
 /* The read<geoidformat> functions return:
  * 0 if the file could not be opened for reading
  * 1 if the file could be opened, but is not of that format
@@ -139,6 +166,7 @@ int readusngsbin(geolattice &geo,std::string filename);
 int readusngsbin(geoid &geo,std::string filename);
 int readcarlsongsf(geolattice &geo,std::string filename);
 int readcarlsongsf(geoid &geo,std::string filename);
+int readusngatxt(geolattice &geo,std::string filename);
 int readusngatxt(geoid &geo,std::string filename);
 int readusngabin(geoid &geo,std::string filename);
 int readboldatni(geoid &geo,std::string filename);
@@ -151,8 +179,11 @@ void writeusngatxt(geoid &geo,std::string filename);
 void writeboldatni(geoid &geo,std::string filename);
 std::vector<xyz> gcscint(xyz gc,smallcircle sc);
 extern std::vector<geoid> geo;
+extern unsigned geoGeneration; // call geoChanged after changing geo
 extern std::vector<smallcircle> excerptcircles;
 extern cylinterval excerptinterval;
+extern geoidindex geoinx;
+void geoChanged();
 double avgelev(xyz dir);
 bool allBoldatni();
 geoquadMatch bolMatch(geoquad &quad);
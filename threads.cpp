@@ -0,0 +1,133 @@
+/******************************************************/
+/*                                                    */
+/* threads.cpp - run loops on several threads         */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <thread>
+#include <vector>
+#include <exception>
+#include <atomic>
+#include "threads.h"
+
+using namespace std;
+
+int defaultThreads()
+// Returns the number of hardware threads, or 1 if that isn't known.
+{
+  int n=thread::hardware_concurrency();
+  if (n<1)
+    n=1;
+  return n;
+}
+
+void parallelFor(int begin,int end,int nthreads,function<void(int)> body,int grain)
+/* Calls body(i) for i from begin to end-1, splitting the range into
+ * nthreads contiguous slices, each run on its own thread. The calling
+ * thread does the first slice. Ranges too small to be worth starting
+ * a thread for (fewer than grain items per thread) use fewer threads.
+ * body must not touch anything that body of another i writes.
+ *
+ * If body throws, the exception is rethrown in the calling thread after
+ * all threads finish. If more than one slice throws, the one from the
+ * lowest slice is rethrown, so that the result doesn't depend on timing.
+ */
+{
+  int i,n=end-begin;
+  vector<thread> workers;
+  vector<exception_ptr> errors;
+  if (grain<1)
+    grain=1;
+  if (nthreads>n/grain)
+    nthreads=n/grain;
+  if (nthreads<=1)
+  {
+    for (i=begin;i<end;i++)
+      body(i);
+    return;
+  }
+  errors.resize(nthreads);
+  auto slice=[&](int t)
+  {
+    int j;
+    try
+    {
+      for (j=begin+(long long)n*t/nthreads;j<begin+(long long)n*(t+1)/nthreads;j++)
+	body(j);
+    }
+    catch (...)
+    {
+      errors[t]=current_exception();
+    }
+  };
+  for (i=1;i<nthreads;i++)
+    workers.push_back(thread(slice,i));
+  slice(0);
+  for (i=0;i<workers.size();i++)
+    workers[i].join();
+  for (i=0;i<nthreads;i++)
+    if (errors[i])
+      rethrow_exception(errors[i]);
+}
+
+void parallelForEach(int begin,int end,int nthreads,function<void(int)> body)
+/* Like parallelFor, but for a few items that take widely varying times,
+ * such as contours. Instead of each thread getting a fixed slice, each
+ * thread takes the next undone item when it finishes one, so a thread
+ * that gets a long item doesn't hold up the others, which take the rest.
+ *
+ * If body throws, the exception from the lowest i is rethrown. Items
+ * after one that threw may or may not have been done.
+ */
+{
+  int i;
+  atomic<int> next(begin);
+  vector<thread> workers;
+  vector<exception_ptr> errors(end>begin?end-begin:0);
+  if (nthreads>end-begin)
+    nthreads=end-begin;
+  if (nthreads<=1)
+  {
+    for (i=begin;i<end;i++)
+      body(i);
+    return;
+  }
+  auto worker=[&]()
+  {
+    int j;
+    while ((j=next++)<end)
+      try
+      {
+	body(j);
+      }
+      catch (...)
+      {
+	errors[j-begin]=current_exception();
+      }
+  };
+  for (i=1;i<nthreads;i++)
+    workers.push_back(thread(worker));
+  worker();
+  for (i=0;i<workers.size();i++)
+    workers[i].join();
+  for (i=0;i<errors.size();i++)
+    if (errors[i])
+      rethrow_exception(errors[i]);
+}
@@ -0,0 +1,32 @@
+/******************************************************/
+/*                                                    */
+/* threads.h - run loops on several threads           */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef THREADS_H
+#define THREADS_H
+#include <functional>
+
+int defaultThreads();
+void parallelFor(int begin,int end,int nthreads,std::function<void(int)> body,int grain=64);
+void parallelForEach(int begin,int end,int nthreads,std::function<void(int)> body);
+
+#endif
@@ -24,6 +24,11 @@
 
 #include <map>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <unordered_map>
+#include <atomic>
 #include <iostream>
 #include "globals.h"
 #include "tin.h"
@@ -37,6 +42,7 @@
 #include "smooth5.h"
 #include "relprime.h"
 #include "stl.h"
+#include "threads.h"
 
 #define THR 16777216
 //threshold for goodcenter to determine if a point is sufficiently
@@ -55,6 +61,7 @@ edge::edge()
   extrema[0]=extrema[1]=NAN;
   broken=contour=stlsplit=0;
   flipcnt=0;
+  localEpoch=0;
 }
 
 edge* edge::next(point* end)
@@ -135,6 +142,8 @@ void edge::dump(pointlist *topopoints)
 void edge::flip(pointlist *topopoints)
 /* Given an edge which is a diagonal of a quadrilateral,
  * sets it to the other diagonal. It is rotated clockwise.
+ * The caller clears topopoints->localValid and edgeLevelsValid, since
+ * flip may run on several threads at once.
  */
 {
   edge *temp1,*temp2;
@@ -284,31 +293,30 @@ void dumphull()
 
 void pointlist::dumpedges()
 {
-  map<int,edge>::iterator i;
+  int i;
   printf("dump edges:\n");
-  for (i=edges.begin();i!=edges.end();i++)
-     i->second.dump(this);
+  for (i=0;i<edges.size();i++)
+     edges[i].dump(this);
   printf("end dump\n");
 }
 
 void pointlist::dumpedges_ps(PostScript &ps,bool colorfibaster)
 {
-  map<int,edge>::iterator i;
   int n;
-  for (i=edges.begin(),n=0;i!=edges.end();i++,n++)
-     ps.line(i->second,n,colorfibaster);
+  for (n=0;n<edges.size();n++)
+     ps.line(edges[n],n,colorfibaster);
 }
 
 void pointlist::dumpnext_ps(PostScript &ps)
 {
-  map<int,edge>::iterator i;
+  int i;
   ps.setcolor(0,0.7,0);
-  for (i=edges.begin();i!=edges.end();i++)
+  for (i=0;i<edges.size();i++)
   {
-    if (i->second.nexta)
-      ps.line2p(i->second.midpoint(),i->second.nexta->midpoint());
-    if (i->second.nextb)
-      ps.line2p(i->second.midpoint(),i->second.nextb->midpoint());
+    if (edges[i].nexta)
+      ps.line2p(edges[i].midpoint(),edges[i].nexta->midpoint());
+    if (edges[i].nextb)
+      ps.line2p(edges[i].midpoint(),edges[i].nextb->midpoint());
   }
 }
 
@@ -335,14 +343,14 @@ void dumphull_ps(PostScript &ps)
 
 void pointlist::dumptriangles()
 {
-  map<int,triangle>::iterator i;
-  for (i=triangles.begin();i!=triangles.end();i++)
+  int i;
+  for (i=0;i<triangles.size();i++)
   {
-    cout<<i->first<<": ";
-    cout<<revpoints[i->second.a]<<' ';
-    cout<<revpoints[i->second.b]<<' ';
-    cout<<revpoints[i->second.c]<<' ';
-    cout<<i->second.sarea<<endl;
+    cout<<i<<": ";
+    cout<<revpoints[triangles[i].a]<<' ';
+    cout<<revpoints[triangles[i].b]<<' ';
+    cout<<revpoints[triangles[i].c]<<' ';
+    cout<<triangles[i].sarea<<endl;
   }
 }
 
@@ -549,6 +557,7 @@ bool pointlist::tryStartPoint(PostScript &ps,xy &startpnt)
   bool fail;
   maxedges=3*points.size()-6;
   edges.clear();
+  localValid=edgeLevelsValid=false;
   convexhull.clear();
   for (m=0;m<100;m++)
   {
@@ -886,32 +895,550 @@ int1loop pointlist::convexHull()
   return ret;
 }
 
-int pointlist::flipPass(PostScript &ps,bool colorfibaster)
+/* Incremental Delaunay triangulation, used by maketin.
+ *
+ * The points are inserted in biased randomized insertion order (BRIO): each
+ * point is assigned to a round, each round has about twice as many points as
+ * the one before, and within a round the points are sorted along a Hilbert
+ * curve. Each point is located by walking from the triangle in which the
+ * previous point was inserted, which is usually close by. After a point
+ * is inserted, the edges opposite it are flipped until they are Delaunay;
+ * no other edges can be affected. The expected time is O(n log n).
+ *
+ * The triangles are kept in a vector with indices, not pointers, to each other.
+ * The area outside the convex hull is covered by ghost triangles, each of
+ * which has one side of the convex hull and the point at infinity as corners.
+ * When all points are inserted, the triangles are converted to edges in
+ * the pointlist, as if the TIN had been made by tryStartPoint and flipPass.
+ */
+#define GHOST (-1)
+
+struct InsTriangle
+{
+  int v[3]; // corners, counterclockwise; GHOST is the point at infinity
+  int n[3]; // n[i] is the triangle across the side opposite v[i]
+};
+
+unsigned long long hilbertIndex(xy pnt,double x,double y,double side)
+/* Returns the position of pnt along a Hilbert curve filling the square
+ * with lower left corner (x,y) and the given side, divided into 65536×65536
+ * cells.
+ */
+{
+  unsigned hx,hy,s,rx,ry,t;
+  unsigned long long ret=0;
+  hx=(unsigned)((pnt.getx()-x)/side*65535.);
+  hy=(unsigned)((pnt.gety()-y)/side*65535.);
+  for (s=32768;s>0;s/=2)
+  {
+    rx=(hx&s)>0;
+    ry=(hy&s)>0;
+    ret+=(unsigned long long)s*s*((3*rx)^ry);
+    if (ry==0)
+    {
+      if (rx==1)
+      {
+	hx=65535-hx;
+	hy=65535-hy;
+      }
+      t=hx;
+      hx=hy;
+      hy=t;
+    }
+  }
+  return ret;
+}
+
+int brioRound(unsigned n)
+/* Returns the number of trailing zero bits of a hash of n. Half of all
+ * numbers return 0, a quarter return 1, and so on.
+ */
+{
+  int ret;
+  n*=0x9e3779b9;
+  n^=n>>15;
+  n*=0x2c1b3c6d;
+  for (ret=0;ret<31 && (n&1)==0;ret++)
+    n>>=1;
+  return ret;
+}
+
+class TinBuilder
+{
+public:
+  std::vector<point *> pnt;
+  std::vector<InsTriangle> tri;
+  TinBuilder(std::vector<point *> order);
+  bool start();
+  void insert(int p);
+  void toEdges(pointlist &pl);
+private:
+  int last; // a triangle containing the last point inserted
+  std::vector<int> dirty; // triangles whose side opposite the new point must be checked
+  bool isGhost(int t);
+  int corner(int t,int v);
+  int side(int t,int a,int b);
+  void replaceNeighbor(int t,int oldn,int newn);
+  int newTriangle(int a,int b,int c);
+  double orient(int a,int b,int p);
+  int locate(int p);
+  void splitTriangle(int t,int p);
+  void splitSide(int t,int i,int p);
+  void extendHull(int g,int p);
+  void legalize(int p);
+};
+
+TinBuilder::TinBuilder(vector<point *> order)
+{
+  pnt=order;
+  last=0;
+}
+
+bool TinBuilder::isGhost(int t)
+{
+  return tri[t].v[0]==GHOST || tri[t].v[1]==GHOST || tri[t].v[2]==GHOST;
+}
+
+int TinBuilder::corner(int t,int v)
+// Returns the index of corner v in triangle t.
+{
+  int i;
+  for (i=0;i<3 && tri[t].v[i]!=v;i++);
+  assert(i<3);
+  return i;
+}
+
+int TinBuilder::side(int t,int a,int b)
+// Returns the index of the side of t whose ends are a and b.
+{
+  return 3-corner(t,a)-corner(t,b);
+}
+
+void TinBuilder::replaceNeighbor(int t,int oldn,int newn)
+{
+  int i;
+  for (i=0;i<3;i++)
+    if (tri[t].n[i]==oldn)
+      tri[t].n[i]=newn;
+}
+
+int TinBuilder::newTriangle(int a,int b,int c)
+{
+  InsTriangle t;
+  t.v[0]=a;
+  t.v[1]=b;
+  t.v[2]=c;
+  t.n[0]=t.n[1]=t.n[2]=-1;
+  tri.push_back(t);
+  return tri.size()-1;
+}
+
+double TinBuilder::orient(int a,int b,int p)
+{
+  return area3(*pnt[a],*pnt[b],*pnt[p]);
+}
+
+bool TinBuilder::start()
+/* Finds three points which make a triangle which is not flat, moves them
+ * to the front of the order, and makes the first triangle and three ghosts.
+ * Returns false if all the points are in a line.
+ */
+{
+  int i,j,k,t,g;
+  double A,perim;
+  for (i=1;i<pnt.size() && xy(*pnt[i])==xy(*pnt[0]);i++);
+  for (k=i+1;k<pnt.size();k++)
+  {
+    A=fabs(area3(*pnt[0],*pnt[i],*pnt[k]));
+    perim=dist(*pnt[0],*pnt[i])+dist(*pnt[i],*pnt[k])+dist(*pnt[k],*pnt[0]);
+    if (A>=perim*perim/THR)
+      break;
+  }
+  if (k>=pnt.size())
+    return false;
+  swap(pnt[1],pnt[i]);
+  swap(pnt[2],pnt[k]);
+  if (orient(0,1,2)<0)
+    swap(pnt[1],pnt[2]);
+  tri.clear();
+  newTriangle(0,1,2);
+  newTriangle(2,1,GHOST);
+  newTriangle(0,2,GHOST);
+  newTriangle(1,0,GHOST);
+  for (t=0;t<4;t++)
+    for (i=0;i<3;i++)
+      for (g=0;g<4;g++)
+	for (j=0;j<3;j++)
+	  if (tri[t].v[(i+1)%3]==tri[g].v[(j+2)%3] && tri[t].v[(i+2)%3]==tri[g].v[(j+1)%3])
+	    tri[t].n[i]=g;
+  last=0;
+  return true;
+}
+
+int TinBuilder::locate(int p)
+/* Walks from the last triangle toward p. Returns a real triangle containing p,
+ * or a ghost triangle whose side of the convex hull can see p. Throws noTriangle
+ * if roundoff leaves p outside every triangle.
+ */
+{
+  int t=last,i,j,steps,a,b;
+  bool found=false;
+  for (steps=0;!found && steps<=tri.size();steps++)
+  {
+    found=true;
+    for (j=0;found && j<3;j++)
+    {
+      i=(j+steps)%3; // vary the starting side so that the walk doesn't cycle
+      a=tri[t].v[(i+1)%3];
+      b=tri[t].v[(i+2)%3];
+      if (a!=GHOST && b!=GHOST && tri[t].v[i]!=GHOST && orient(a,b,p)<0)
+      {
+	t=tri[t].n[i];
+	found=false;
+      }
+    }
+    if (isGhost(t))
+      return t;
+  }
+  if (!found) // roundoff error sent the walk in a circle; look at every triangle
+  {
+    for (t=0;t<tri.size();t++)
+    {
+      if (isGhost(t))
+      {
+	i=corner(t,GHOST);
+	if (orient(tri[t].v[(i+1)%3],tri[t].v[(i+2)%3],p)>0)
+	  break;
+      }
+      else if (orient(tri[t].v[1],tri[t].v[2],p)>=0 &&
+	       orient(tri[t].v[2],tri[t].v[0],p)>=0 &&
+	       orient(tri[t].v[0],tri[t].v[1],p)>=0)
+	break;
+    }
+    if (t>=tri.size())
+      throw BeziExcept(noTriangle);
+  }
+  return t;
+}
+
+void TinBuilder::splitTriangle(int t,int p)
+// p is inside t. Splits t into three triangles.
+{
+  int a=tri[t].v[0],b=tri[t].v[1],c=tri[t].v[2];
+  int na=tri[t].n[0],nb=tri[t].n[1],nc=tri[t].n[2];
+  int t1,t2;
+  t1=newTriangle(b,c,p);
+  t2=newTriangle(c,a,p);
+  tri[t].v[2]=p;
+  tri[t].n[0]=t1;
+  tri[t].n[1]=t2;
+  tri[t].n[2]=nc;
+  tri[t1].n[0]=t2;
+  tri[t1].n[1]=t;
+  tri[t1].n[2]=na;
+  tri[t2].n[0]=t;
+  tri[t2].n[1]=t1;
+  tri[t2].n[2]=nb;
+  replaceNeighbor(na,t,t1);
+  replaceNeighbor(nb,t,t2);
+  dirty.push_back(t);
+  dirty.push_back(t1);
+  dirty.push_back(t2);
+}
+
+void TinBuilder::splitSide(int t,int i,int p)
+/* p is on the side of t opposite corner i. Splits t and the triangle
+ * on the other side, which may be a ghost, into two triangles each.
+ */
+{
+  int c=tri[t].v[i],a=tri[t].v[(i+1)%3],b=tri[t].v[(i+2)%3];
+  int u=tri[t].n[i],d,ta,tb,ua,ub,t1,u1;
+  ta=tri[t].n[(i+1)%3];
+  tb=tri[t].n[(i+2)%3];
+  d=tri[u].v[side(u,a,b)];
+  ua=tri[u].n[corner(u,a)];
+  ub=tri[u].n[corner(u,b)];
+  t1=newTriangle(c,p,b);
+  u1=newTriangle(d,p,a);
+  tri[t].v[0]=c;
+  tri[t].v[1]=a;
+  tri[t].v[2]=p;
+  tri[t].n[0]=u1;
+  tri[t].n[1]=t1;
+  tri[t].n[2]=tb;
+  tri[t1].n[0]=u;
+  tri[t1].n[1]=ta;
+  tri[t1].n[2]=t;
+  tri[u].v[0]=d;
+  tri[u].v[1]=b;
+  tri[u].v[2]=p;
+  tri[u].n[0]=t1;
+  tri[u].n[1]=u1;
+  tri[u].n[2]=ua;
+  tri[u1].n[0]=t;
+  tri[u1].n[1]=ub;
+  tri[u1].n[2]=u;
+  replaceNeighbor(ta,t,t1);
+  replaceNeighbor(ub,u,u1);
+  dirty.push_back(t);
+  dirty.push_back(t1);
+  if (d!=GHOST)
+  {
+    dirty.push_back(u);
+    dirty.push_back(u1);
+  }
+}
+
+void TinBuilder::extendHull(int g,int p)
+/* p is outside the convex hull, and the side of ghost triangle g can see it.
+ * Turns g, and the ghosts on either side whose sides can also see p, into
+ * real triangles, then makes two new ghosts for the new sides of the hull.
+ */
+{
+  int i,x,y,z,f,b,h,hf,gf,gb;
+  i=corner(g,GHOST);
+  x=tri[g].v[(i+1)%3];
+  y=tri[g].v[(i+2)%3];
+  tri[g].v[i]=p;
+  dirty.push_back(g);
+  for (f=g,h=tri[f].n[side(f,y,p)];;h=tri[f].n[side(f,y,p)])
+  {
+    i=corner(h,GHOST);
+    z=tri[h].v[(i+2)%3];
+    if (orient(y,z,p)<=0)
+      break;
+    tri[h].v[i]=p;
+    dirty.push_back(h);
+    f=h;
+    y=z;
+  }
+  hf=h;
+  for (b=g,h=tri[b].n[side(b,p,x)];;h=tri[b].n[side(b,p,x)])
+  {
+    i=corner(h,GHOST);
+    z=tri[h].v[(i+1)%3];
+    if (orient(z,x,p)<=0)
+      break;
+    tri[h].v[i]=p;
+    dirty.push_back(h);
+    b=h;
+    x=z;
+  }
+  gf=newTriangle(p,y,GHOST);
+  gb=newTriangle(x,p,GHOST);
+  tri[gf].n[0]=hf;
+  tri[gf].n[1]=gb;
+  tri[gf].n[2]=f;
+  tri[gb].n[0]=gf;
+  tri[gb].n[1]=h;
+  tri[gb].n[2]=b;
+  tri[f].n[side(f,y,p)]=gf;
+  tri[hf].n[side(hf,GHOST,y)]=gf;
+  tri[b].n[side(b,p,x)]=gb;
+  tri[h].n[side(h,GHOST,x)]=gb;
+}
+
+void TinBuilder::legalize(int p)
+/* Flips the sides opposite p of the dirty triangles until they are Delaunay.
+ * Uses the same criterion as edge::delaunay, and like isFlippable, does not
+ * flip the diagonal of a concave quadrilateral.
+ */
+{
+  int t,u,i,a,b,d,ta,tb,ua,ub;
+  while (dirty.size())
+  {
+    t=dirty.back();
+    dirty.pop_back();
+    i=corner(t,p);
+    a=tri[t].v[(i+1)%3];
+    b=tri[t].v[(i+2)%3];
+    u=tri[t].n[i];
+    d=tri[u].v[side(u,a,b)];
+    if (d==GHOST || intersection_type(*pnt[p],*pnt[d],*pnt[a],*pnt[b])!=ACXBD ||
+        ::delaunay(*pnt[a],*pnt[b],*pnt[p],*pnt[d]))
+      continue;
+    ta=tri[t].n[corner(t,a)];
+    tb=tri[t].n[corner(t,b)];
+    ua=tri[u].n[corner(u,a)];
+    ub=tri[u].n[corner(u,b)];
+    tri[t].v[0]=p;
+    tri[t].v[1]=a;
+    tri[t].v[2]=d;
+    tri[t].n[0]=ub;
+    tri[t].n[1]=u;
+    tri[t].n[2]=tb;
+    tri[u].v[0]=p;
+    tri[u].v[1]=d;
+    tri[u].v[2]=b;
+    tri[u].n[0]=ua;
+    tri[u].n[1]=ta;
+    tri[u].n[2]=t;
+    replaceNeighbor(ub,u,t);
+    replaceNeighbor(ta,t,u);
+    dirty.push_back(t);
+    dirty.push_back(u);
+  }
+}
+
+void TinBuilder::insert(int p)
+/* Inserts pnt[p] into the triangulation. Throws samePoints if it is at
+ * the same place as a point already inserted.
+ */
+{
+  int t,i,zeroside=-1,nzero=0;
+  t=locate(p);
+  if (isGhost(t))
+    extendHull(t,p);
+  else
+  {
+    for (i=0;i<3;i++)
+    {
+      if (xy(*pnt[tri[t].v[i]])==xy(*pnt[p]))
+	throw BeziExcept(samePoints);
+      if (orient(tri[t].v[(i+1)%3],tri[t].v[(i+2)%3],p)==0)
+      {
+	zeroside=i;
+	nzero++;
+      }
+    }
+    if (nzero>1)
+      throw BeziExcept(samePoints);
+    if (nzero)
+      splitSide(t,zeroside,p);
+    else
+      splitTriangle(t,p);
+  }
+  for (i=0;i<dirty.size();i++)
+    if (!isGhost(dirty[i]))
+      last=dirty[i];
+  legalize(p);
+}
+
+void TinBuilder::toEdges(pointlist &pl)
+/* Makes an edge for each side of a real triangle, and links the edges
+ * counterclockwise around each point. The side of a ghost triangle
+ * which goes to infinity is not an edge; the next edge after a side
+ * of the convex hull is the next side of the convex hull.
+ */
 {
-  int m,n,e,step;
+  int t,i,j,u,e,e1,e2;
+  vector<array<int,3> > sideEdge(tri.size(),array<int,3>{-1,-1,-1});
+  pl.edges.clear();
+  pl.localValid=pl.edgeLevelsValid=false;
+  for (t=0;t<tri.size();t++)
+    if (!isGhost(t))
+      for (i=0;i<3;i++)
+	if (sideEdge[t][i]<0)
+	{
+	  e=pl.edges.size();
+	  pl.edges[e].a=pnt[tri[t].v[(i+1)%3]];
+	  pl.edges[e].b=pnt[tri[t].v[(i+2)%3]];
+	  pl.edges[e].a->line=pl.edges[e].b->line=&pl.edges[e];
+	  sideEdge[t][i]=e;
+	  u=tri[t].n[i];
+	  sideEdge[u][side(u,tri[t].v[(i+1)%3],tri[t].v[(i+2)%3])]=e;
+	}
+  for (t=0;t<tri.size();t++)
+    for (i=0;i<3;i++)
+      if (tri[t].v[i]!=GHOST && tri[t].v[(i+1)%3]!=GHOST)
+      {
+	e1=sideEdge[t][(i+2)%3];
+	if (tri[t].v[(i+2)%3]==GHOST)
+	{
+	  u=tri[t].n[(i+1)%3];
+	  e2=sideEdge[u][corner(u,GHOST)];
+	}
+	else
+	  e2=sideEdge[t][(i+1)%3];
+	pl.edges[e1].setnext(pnt[tri[t].v[i]],&pl.edges[e2]);
+      }
+}
+
+vector<edge *> pointlist::flipColored(vector<edge *> todo,int threads)
+/* Flips those edges in todo which shouldFlip says to flip, a set at a time.
+ * Each set (a color) is chosen greedily, in the order of todo, so that
+ * no two of its edges' quadrilaterals share a point. edge::flip writes only
+ * to the quadrilateral's edges, points, and triangles, and to the neighbor
+ * pointers of the triangles just outside it, so the edges of a set can be
+ * flipped at once on separate threads. Edges left out of a set are tested
+ * again after it is flipped. The result depends only on the order of todo,
+ * not on the number of threads. Returns the edges flipped, in order.
+ */
+{
+  int i,j;
+  vector<edge *> ret,color,rest;
+  vector<char> flip;
+  unordered_set<point *> used;
+  point *corner[4];
+  bool disjoint;
+  while (todo.size())
+  {
+    flip.resize(todo.size());
+    parallelFor(0,todo.size(),threads,[&](int k){flip[k]=shouldFlip(*todo[k]);});
+    color.clear();
+    rest.clear();
+    used.clear();
+    for (i=0;i<todo.size();i++)
+      if (flip[i])
+      {
+	corner[0]=todo[i]->a;
+	corner[1]=todo[i]->b;
+	corner[2]=todo[i]->nexta->otherend(todo[i]->a);
+	corner[3]=todo[i]->nextb->otherend(todo[i]->b);
+	for (disjoint=true,j=0;j<4;j++)
+	  if (used.count(corner[j]))
+	    disjoint=false;
+	if (disjoint)
+	{
+	  for (j=0;j<4;j++)
+	    used.insert(corner[j]);
+	  color.push_back(todo[i]);
+	}
+	else
+	  rest.push_back(todo[i]);
+      }
+    parallelFor(0,color.size(),threads,[&](int k){color[k]->flip(this);},16);
+    if (color.size())
+      localValid=edgeLevelsValid=false;
+    ret.insert(ret.end(),color.begin(),color.end());
+    swap(todo,rest);
+  }
+  return ret;
+}
+
+vector<int> pointlist::passOrder()
+/* Returns the indices of the edges in a random order which steps through
+ * the array by a number relatively prime to its size.
+ */
+{
+  int n,e,step;
+  vector<int> ret;
   e=rng.usrandom()%edges.size();
   step=rng.usrandom();
   do
   {
     step=(step+relprime(edges.size()))%edges.size();
   } while (gcd(step,edges.size())>1);
-  for (m=n=0;n<edges.size();n++)
+  for (n=0;n<edges.size();n++)
   {
-    if (shouldFlip(edges[e]))
-    {
-      edges[e].flip(this);
-      m++;
-      //debugdel=0;
-      if (e>680 && e<680)
-      {
-        ps.startpage();
-        dumpedges_ps(ps,colorfibaster);
-        ps.endpage();
-      }
-      //debugdel=1;
-    }
+    ret.push_back(e);
     e=(e+step)%edges.size();
   }
+  return ret;
+}
+
+int pointlist::flipPass(PostScript &ps,bool colorfibaster,int threads)
+/* Goes through the edges in the order passOrder gives, and has flipColored
+ * flip those that should be. The flips depend on the order, not on the
+ * number of threads.
+ */
+{
+  int i,m;
+  vector<int> order=passOrder();
+  vector<edge *> todo;
+  for (i=0;i<order.size();i++)
+    todo.push_back(&edges[order[i]]);
+  m=flipColored(todo,threads).size();
   debugdel=0;
   if (ps.isOpen())
   {
@@ -924,125 +1451,207 @@ int pointlist::flipPass(PostScript &ps,bool colorfibaster)
   return m;
 }
 
-void pointlist::maketin(string filename,bool colorfibaster)
+int pointlist::flipCascade(int threads)
+/* Flips every edge that shouldFlip says to flip, then checks the sides
+ * of the quadrilaterals of the edges just flipped, and so on. After the
+ * incremental triangulation, the only edges that need flipping are those
+ * that cross type-0 breaklines and the edges near them, so this takes
+ * much less time than repeated flipPasses. Like maketin's flip passes,
+ * it is capped at one round per three points.
+ */
+{
+  int i,m=0,rounds;
+  edge *e;
+  vector<edge *> queue,flipped;
+  for (i=0;i<edges.size();i++)
+    queue.push_back(&edges[i]);
+  for (rounds=0;queue.size() && rounds*3<=points.size();rounds++)
+  {
+    flipped=flipColored(queue,threads);
+    m+=flipped.size();
+    queue.clear();
+    for (i=0;i<flipped.size();i++)
+    {
+      e=flipped[i];
+      // flip leaves a->line and b->line as the edges before e.
+      queue.push_back(e->nexta);
+      queue.push_back(e->nextb);
+      queue.push_back(e->a->line);
+      queue.push_back(e->b->line);
+    }
+  }
+  return m;
+}
+
+void pointlist::maketin(string filename,bool colorfibaster,int threads)
 /* Makes a triangulated irregular network. If <3 points, throws noTriangle without altering
  * the existing TIN. If two points are equal, or close enough to likely cause problems,
  * throws samePoints; the TIN is partially constructed and will have to be destroyed.
+ *
+ * The points are inserted one at a time (see TinBuilder above), which makes
+ * a Delaunay TIN in O(n log n) time, then edges are flipped to honor
+ * the type-0 breaklines, on as many threads as threads says.
  */
 {
   ptlist::iterator i;
-  int m,m2,n,flipcount,passcount,cycles;
-  bool fail;
+  int n;
+  double minx=INFINITY,miny=INFINITY,maxx=-INFINITY,maxy=-INFINITY,side;
+  vector<pair<pair<int,unsigned long long>,point *> > sortpoints;
+  vector<point *> order;
   PostScript ps;
   if (points.size()<3)
     throw BeziExcept(noTriangle);
-  startpnt=xy(0,0);
-  for (i=points.begin();i!=points.end();i++)
-    startpnt+=i->second;
-  startpnt/=points.size();
   edges.clear();
+  localValid=edgeLevelsValid=false;
   splitBreaklines();
-  /* startpnt has to be within or out the side of the triangle formed
-   * by the three nearest points. In a 100-point asteraceous pattern,
-   * the centroid is out one corner, and the first triangle is drawn
-   * negative, with point 0 connected wrong.
-   */
-  startpnt=points.begin()->second;
+  for (i=points.begin();i!=points.end();i++)
+  {
+    if (i->second.east()>maxx)
+      maxx=i->second.east();
+    if (i->second.east()<minx)
+      minx=i->second.east();
+    if (i->second.north()>maxy)
+      maxy=i->second.north();
+    if (i->second.north()<miny)
+      miny=i->second.north();
+  }
   if (filename.length())
   {
     ps.open(filename);
     ps.setpaper(papersizes["A4 portrait"],0);
     ps.prolog();
     ps.setPointlist(*this);
+    ps.setscale(minx,miny,maxx,maxy);
+    ps.startpage();
+    ps.setcolor(1,.5,0);
+    for (i=points.begin();i!=points.end();i++)
+      ps.dot(i->second,to_string(i->first));
+    ps.endpage();
   }
-  for (m2=0,fail=true;m2<100 && fail;m2++)
-    fail=tryStartPoint(ps,startpnt);
-  if (fail)
+  /* Sort the points into rounds, the last round having half the points,
+   * the one before it a quarter, and so on, then along a Hilbert curve
+   * within each round.
+   */
+  side=maxx-minx;
+  if (side<maxy-miny)
+    side=maxy-miny;
+  if (side==0)
+    side=1;
+  for (i=points.begin(),n=0;i!=points.end();i++,n++)
+    sortpoints.push_back(make_pair(make_pair(-brioRound(n),
+      hilbertIndex(i->second,minx,miny,side)),&i->second));
+  sort(sortpoints.begin(),sortpoints.end());
+  for (n=0;n<sortpoints.size();n++)
   {
-    throw BeziExcept(flatTriangle);
-    /* Failing to make a proper TIN, after trying a hundred start points,
-     * normally means that all triangles are flat.
-     */
+    order.push_back(sortpoints[n].second);
+    order.back()->line=nullptr;
   }
+  TinBuilder builder(order);
+  if (!builder.start())
+    throw BeziExcept(flatTriangle);
+  for (n=3;n<builder.pnt.size();n++)
+    builder.insert(n);
+  builder.toEdges(*this);
   if (ps.isOpen())
   {
     ps.startpage();
     dumpedges_ps(ps,colorfibaster);
-    //dumpnext_ps();
-    ps.dot(startpnt);
     ps.endpage();
   }
-  flipcount=passcount=0;
-  //debugdel=1;
-  /* The flipping algorithm can take quadratic time, but usually does not
-   * on real-world data. It can also get stuck in a loop because of roundoff error.
-   * This requires at least five points in a perfect circle with nothing else
-   * inside. The test datum {ring(1000);rotate(30);} results in flipping edges
-   * around 13 points forever. To stop this, I put a cap on the number of passes.
-   * The worst cases are ring with lots of rotation and ellipse. They take about
-   * 280 passes for 1000 points. I think that a cap of 1 pass per 3 points is
-   * reasonable.
-   */
-  flipcount=passcount=0;
-  do
-  {
-    flipcount+=m=flipPass(ps,colorfibaster);
-    passcount++;
-  } while (m && passcount*3<=points.size());
-  //printf("Total %d edges flipped in %d passes\n",flipcount,passcount);
+  flipCascade(threads);
   if (ps.isOpen())
   {
     ps.startpage();
     dumpedges_ps(ps,colorfibaster);
-    ps.dot(startpnt);
     ps.endpage();
     ps.trailer();
     ps.close();
   }
 }
 
-void pointlist::makegrad(double corr)
-// Compute the gradient at each point.
-// corr is a correlation factor which is how much the slope
-// at one end of an edge affects the slope at the other.
+#define GRAD_BLOCK 1024
+
+void pointlist::makegrad(double corr,int threads,double tolerance)
+/* Compute the gradient at each point.
+ * corr is a correlation factor which is how much the slope
+ * at one end of an edge affects the slope at the other.
+ *
+ * The edges around each point that don't cross breaklines are first copied
+ * into arrays, point by point in order around the point, so that the sweeps
+ * read neighbors' gradients by index instead of following edge pointers.
+ * Each sweep reads only the last sweep's gradients, so points are done on
+ * threads threads, GRAD_BLOCK at a time. Each point's sums are taken in the
+ * same order on any number of threads. There are at most ten sweeps; if
+ * tolerance is positive, sweeping stops when no component of any gradient
+ * changes by as much as tolerance.
+ */
 {
   ptlist::iterator i;
-  int n,m;
+  int j,k,n,npoints=points.size(),nblocks=(npoints+GRAD_BLOCK-1)/GRAD_BLOCK;
+  double change;
   edge *e;
-  double zdiff,zxtrap,zthere;
-  xy gradthere,diff;
-  double sum1,sumx,sumy,sumz,sumxx,sumxy,sumxz,sumzz,sumyy,sumyz;
+  point *pnt,*there;
+  vector<point *> byIndex;
+  unordered_map<point *,int> index;
+  vector<int> start(1,0),nbr;
+  vector<double> dx,dy,dz,gx(npoints,0),gy(npoints,0),ngx(npoints),ngy(npoints);
+  vector<double> blockChange(nblocks);
+  index.reserve(npoints);
   for (i=points.begin();i!=points.end();i++)
-    i->second.gradient=xy(0,0);
-  for (n=0;n<10;n++)
   {
-    for (i=points.begin();i!=points.end();i++)
-    {
-      //i->second.gradient=xy(0,0);
-      sum1=sumx=sumy=sumz=sumxx=sumxy=sumxz=sumzz=sumyy=sumyz=0;
-      for (m=0,e=i->second.line;m==0 || e!=i->second.line;m++,e=e->next(&i->second))
+    index.emplace(&i->second,byIndex.size());
+    byIndex.push_back(&i->second);
+  }
+  for (k=0;k<npoints;k++)
+  {
+    pnt=byIndex[k];
+    for (j=0,e=pnt->line;e && (j==0 || e!=pnt->line);j++,e=e->next(pnt))
       if (!(e->broken&8))
       {
-	gradthere=e->otherend(&i->second)->gradient;
-	diff=(xy)(*e->otherend(&i->second))-(xy)i->second;
-	zdiff=e->otherend(&i->second)->elev()-i->second.elev();
-	zxtrap=zdiff-dot(gradthere,diff);
-	zthere=zdiff+corr*zxtrap;
-	sum1+=1;
-	sumx+=diff.east();
-	sumy+=diff.north();
-	sumz+=zthere;
-	sumxx+=diff.east()*diff.east();
-	sumyy+=diff.north()*diff.north();
-	sumzz+=zthere*zthere;
-	sumxy+=diff.east()*diff.north();
-	sumxz+=diff.east()*zthere;
-	sumyz+=diff.north()*zthere;
+	there=e->otherend(pnt);
+	nbr.push_back(index[there]);
+	dx.push_back(there->east()-pnt->east());
+	dy.push_back(there->north()-pnt->north());
+	dz.push_back(there->elev()-pnt->elev());
       }
-      //printf("point %d sum1=%f zdiff=%f zthere=%f\n",i->first,sum1,zdiff,zthere);
-      if (sum1)
+    start.push_back(nbr.size());
+    if (start[k]==start[k+1])
+      fprintf(stderr,"Warning: point at address %p has no edges that don't cross breaklines\n",pnt);
+  }
+  for (n=0,change=INFINITY;n<10 && !(change<tolerance);n++)
+  {
+    parallelFor(0,nblocks,threads,[&](int b)
+    {
+      int j,k;
+      double zdiff,zxtrap,zthere;
+      double sum1,sumx,sumy,sumz,sumxx,sumxy,sumxz,sumzz,sumyy,sumyz;
+      blockChange[b]=0;
+      for (k=b*GRAD_BLOCK;k<npoints && k<(b+1)*GRAD_BLOCK;k++)
       {
-	sum1++; //add the point i to the set
+	if (start[k]==start[k+1])
+	{ // keeps whatever gradient the point had
+	  ngx[k]=byIndex[k]->newgradient.east();
+	  ngy[k]=byIndex[k]->newgradient.north();
+	  continue;
+	}
+	sum1=sumx=sumy=sumz=sumxx=sumxy=sumxz=sumzz=sumyy=sumyz=0;
+	for (j=start[k];j<start[k+1];j++)
+	{
+	  zdiff=dz[j];
+	  zxtrap=zdiff-(gy[nbr[j]]*dy[j]+gx[nbr[j]]*dx[j]);
+	  zthere=zdiff+corr*zxtrap;
+	  sum1+=1;
+	  sumx+=dx[j];
+	  sumy+=dy[j];
+	  sumz+=zthere;
+	  sumxx+=dx[j]*dx[j];
+	  sumyy+=dy[j]*dy[j];
+	  sumzz+=zthere*zthere;
+	  sumxy+=dx[j]*dy[j];
+	  sumxz+=dx[j]*zthere;
+	  sumyz+=dy[j]*zthere;
+	}
+	sum1++; //add the point k to the set
 	sumx/=sum1;
 	sumy/=sum1;
 	sumz/=sum1;
@@ -1062,18 +1671,20 @@ void pointlist::makegrad(double corr)
 	(xx xy)   (gradx)
 	(     ) × (     ) = (xz yz)
 	(xy yy)   (grady) */
-	i->second.newgradient=xy(sumxz/sumxx,sumyz/sumyy);
-	/*if (i->first==63)
-	printf("sumxz %f sumxx %f sumyz %f sumyy %f\n",sumxz,sumxx,sumyz,sumyy);*/
+	ngx[k]=sumxz/sumxx;
+	ngy[k]=sumyz/sumyy;
+	blockChange[b]=max(blockChange[b],max(fabs(ngx[k]-gx[k]),fabs(ngy[k]-gy[k])));
       }
-      else
-	fprintf(stderr,"Warning: point at address %p has no edges that don't cross breaklines\n",&i->second);
-    }
-    for (i=points.begin();i!=points.end();i++)
-    {
-      i->second.oldgradient=i->second.gradient;
-      i->second.gradient=i->second.newgradient;
-    }
+    },1);
+    swap(gx,ngx);
+    swap(gy,ngy);
+    for (change=k=0;k<nblocks;k++)
+      change=max(change,blockChange[k]);
+  }
+  for (k=0;k<npoints;k++)
+  {
+    byIndex[k]->oldgradient=xy(ngx[k],ngy[k]);
+    byIndex[k]->gradient=byIndex[k]->newgradient=xy(gx[k],gy[k]);
   }
 }
 
@@ -1087,6 +1698,7 @@ void pointlist::maketriangles()
   edge *e;
   triangle cib,*t;
   triangles.clear();
+  localValid=edgeLevelsValid=false;
   for (i=0;i<edges.size();i++)
   {
     a=edges[i].a;
@@ -1137,48 +1749,76 @@ void pointlist::maketriangles()
     edges[i].setNeighbors();
 }
 
+struct ExactXyHash
+/* Hashes the exact coordinates of a point. 0 and -0 compare equal, so
+ * adding 0 makes them hash the same.
+ */
+{
+  size_t operator()(const xy &pnt) const
+  {
+    double x=pnt.getx()+0.,y=pnt.gety()+0.;
+    unsigned long long xbits,ybits;
+    memcpy(&xbits,&x,sizeof(x));
+    memcpy(&ybits,&y,sizeof(y));
+    xbits*=0x9e3779b97f4a7c15ULL;
+    return xbits^(xbits>>31)^ybits^(ybits<<23);
+  }
+};
+
 void pointlist::makeBareTriangles(vector<array<xyz,3> > bareTriangles)
-/* Assigns point numbers to the corners of the triangles. Makes a qindex and
- * a map of triangles, but no edges. Can throw samePoints or badData.
+/* Assigns point numbers to the corners of the triangles, numbering them in
+ * the order they first appear, and merging corners with exactly the same xy
+ * (the first one's elevation is kept). Makes a qindex and a map of
+ * triangles, but no edges. Can throw badData.
+ *
+ * Corners are merged by a hash table, rather than by looking each one up in
+ * the qindex, which took most of the time when importing large TINs.
  */
 {
   int i,j;
   vector<xy> corners;
   point *pont[3];
-  triangle newtri;
+  unordered_map<xy,point *,ExactXyHash> cornerPoints;
+  unordered_map<xy,point *,ExactXyHash>::iterator found;
+  ptlist::iterator newpt;
+  triangle *newtri;
   clear();
   for (i=0;i<bareTriangles.size();i++)
     for (j=0;j<3;j++)
-    {
       if (outOfGeoRange(bareTriangles[i][j].east(),
 			bareTriangles[i][j].north(),
 			bareTriangles[i][j].elev()))
 	throw BeziExcept(badData);
-      corners.push_back(bareTriangles[i][j]);
-    }
-  qinx.sizefit(corners);
-  qinx.split(corners);
+  cornerPoints.reserve(bareTriangles.size());
+  addtriangle(bareTriangles.size());
   for (i=0;i<bareTriangles.size();i++)
   {
     if (area3(bareTriangles[i][0],bareTriangles[i][1],bareTriangles[i][2])<0)
       swap(bareTriangles[i][0],bareTriangles[i][2]);
     for (j=0;j<3;j++)
     {
-      pont[j]=qinx.findp(bareTriangles[i][j]);
-      if (!pont[j])
+      found=cornerPoints.find(bareTriangles[i][j]);
+      if (found==cornerPoints.end())
       {
-	addpoint(1,point(bareTriangles[i][j],""));
-	pont[j]=&points[points.size()];
-	qinx.insertPoint(pont[j]);
+	newpt=points.emplace_hint(points.end(),points.size()+1,point(bareTriangles[i][j],""));
+	pont[j]=&newpt->second;
+	revpoints.emplace(pont[j],newpt->first);
+	cornerPoints.emplace(bareTriangles[i][j],pont[j]);
+	corners.push_back(bareTriangles[i][j]);
       }
+      else
+	pont[j]=found->second;
     }
-    newtri.a=pont[0];
-    newtri.b=pont[1];
-    newtri.c=pont[2];
-    newtri.flatten();
-    triangles[triangles.size()]=newtri;
+    newtri=&triangles[i];
+    newtri->a=pont[0];
+    newtri->b=pont[1];
+    newtri->c=pont[2];
+    newtri->flatten();
   }
-  qinx.clearLeaves();
+  qinx.sizefit(corners);
+  qinx.split(corners);
+  lqinx.clear();
+  localValid=edgeLevelsValid=false;
 }
 
 void pointlist::triangulatePolygon(vector<point *> poly)
@@ -1317,8 +1957,6 @@ void pointlist::makeEdges()
   //dumptriangles();
   for (i=0;i<triangles.size();i++)
   {
-    if (triangles[i].sarea<1e-6)
-      cerr<<"tiny triangle "<<triangles[i].a<<' '<<triangles[i].b<<' '<<triangles[i].c<<'\n';
     if (!triangles[i].a->isNeighbor(triangles[i].b))
     {
       newedge.a=triangles[i].a;
@@ -1364,6 +2002,127 @@ void pointlist::makeEdges()
   }
 }
 
+bool pointlist::linkTriangles(const vector<point *> &byNum,const vector<int> &corners,int threads)
+/* Makes the edges of a TIN all at once, instead of one at a time as
+ * makeEdges does, finding each edge's place around its ends by bearing.
+ * Since every triangle goes counterclockwise, the next edge counterclockwise
+ * about a corner of a triangle is the triangle's other side at that corner,
+ * except around the boundary, where the edge leaving a point follows the
+ * edge entering it. Half-edge h goes from corners[h] to the next corner of
+ * triangle h/3; byNum[n] is point n. The half-edges are sorted by the point
+ * they start from, so that each one's twin is found among few.
+ *
+ * There must be no edges yet. Returns false, having made no edges, if the
+ * triangles don't fit together, as when two overlap or a point is on the
+ * boundary twice. The edges are numbered as makeEdges would number them.
+ */
+{
+  int i,h,nhalf=corners.size(),npoints=byNum.size()-1,nedges=0;
+  vector<int> start(npoints+2,0),out(nhalf),twin(nhalf),edgeNum(nhalf);
+  vector<int> hullIn(npoints+1,-1),hullOut(npoints+1,-1);
+  atomic<bool> ok(true);
+  auto to=[&](int h){return corners[(h%3==2)?h-2:h+1];};
+  assert(edges.size()==0);
+  for (h=0;h<nhalf;h++)
+    start[corners[h]+1]++;
+  for (i=1;i<=npoints+1;i++)
+    start[i]+=start[i-1];
+  vector<int> fill(start);
+  for (h=0;h<nhalf;h++)
+    out[fill[corners[h]]++]=h;
+  parallelFor(0,nhalf,threads,[&](int h)
+  {
+    int k,u=corners[h],v=to(h);
+    twin[h]=-1;
+    for (k=start[v];k<start[v+1];k++)
+      if (to(out[k])==u)
+      {
+	if (twin[h]>=0)
+	  ok=false;
+	twin[h]=out[k];
+      }
+  });
+  if (!ok)
+    return false;
+  for (h=0;h<nhalf;h++)
+    if (twin[h]<0)
+    {
+      if (hullOut[corners[h]]>=0 || hullIn[to(h)]>=0)
+	return false;
+      hullOut[corners[h]]=h;
+      hullIn[to(h)]=h;
+    }
+  for (i=1;i<=npoints;i++)
+    if ((hullIn[i]<0)!=(hullOut[i]<0))
+      return false;
+  // Number the edges in the order makeEdges would make them.
+  for (h=0;h<nhalf;h++)
+    if (twin[h]<0 || twin[h]>h)
+      edgeNum[h]=nedges++;
+    else
+      edgeNum[h]=edgeNum[twin[h]];
+  if (nedges)
+    edges[nedges-1];
+  parallelFor(0,nhalf,threads,[&](int h)
+  {
+    edge *e=&edges[edgeNum[h]];
+    if (twin[h]<0 || twin[h]>h)
+    {
+      e->a=byNum[corners[h]];
+      e->b=byNum[to(h)];
+      e->trib=&triangles[h/3];
+      e->tria=(twin[h]<0)?nullptr:&triangles[twin[h]/3];
+    }
+  });
+  parallelFor(0,nhalf,threads,[&](int h)
+  {
+    int prev=(h%3==0)?h+2:h-1;
+    edges[edgeNum[h]].setnext(byNum[corners[h]],&edges[edgeNum[prev]]);
+  });
+  for (i=1;i<=npoints;i++)
+  {
+    if (hullIn[i]>=0)
+      edges[edgeNum[hullIn[i]]].setnext(byNum[i],&edges[edgeNum[hullOut[i]]]);
+    if (start[i]<start[i+1])
+      byNum[i]->line=&edges[edgeNum[out[start[i]]]];
+  }
+  parallelFor(0,nedges,threads,[&](int i)
+  {
+    edges[i].setNeighbors();
+  });
+  return true;
+}
+
+bool pointlist::linkBareTriangles(int threads)
+/* Makes the edges of bare triangles with linkTriangles, if they're all
+ * counterclockwise, as makeBareTriangles leaves them. Returns false if
+ * makeEdges has to be used instead.
+ */
+{
+  int i;
+  vector<point *> byNum(1,nullptr);
+  vector<int> corners(3*triangles.size());
+  ptlist::iterator j;
+  unordered_map<point *,int> ptNum;
+  if (edges.size())
+    return false;
+  ptNum.reserve(points.size());
+  for (j=points.begin();j!=points.end();j++)
+  {
+    ptNum.emplace(&j->second,byNum.size());
+    byNum.push_back(&j->second);
+  }
+  for (i=0;i<triangles.size();i++)
+  {
+    if (!(triangles[i].sarea>0))
+      return false;
+    corners[3*i]=ptNum[triangles[i].a];
+    corners[3*i+1]=ptNum[triangles[i].b];
+    corners[3*i+2]=ptNum[triangles[i].c];
+  }
+  return linkTriangles(byNum,corners,threads);
+}
+
 void pointlist::deleteOrphanPoints()
 /* In a TIN exported by PerfectTIN, there may be points which are not the
  * corner of any triangle. This function deletes them. Call it after
@@ -1403,7 +2162,8 @@ void pointlist::fillInBareTin()
   br.include(this);
   ps.startpage();
   ps.setscale(br);
-  makeEdges();
+  if (!linkBareTriangles(defaultThreads()))
+    makeEdges();
   deleteOrphanPoints();
   holes=boundary();
   holes.push_back(convexHull());
@@ -1419,9 +2179,9 @@ void pointlist::fillInBareTin()
 double pointlist::totalEdgeLength()
 {
   vector<double> edgeLengths;
-  map<int,edge>::iterator i;
-  for (i=edges.begin();i!=edges.end();i++)
-    edgeLengths.push_back(i->second.length());
+  int i;
+  for (i=0;i<edges.size();i++)
+    edgeLengths.push_back(edges[i].length());
   return pairwisesum(edgeLengths);
 }
 
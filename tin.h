@@ -67,6 +67,7 @@ public:
    * when writing an STL file.
    */
   short flipcnt;
+  unsigned localEpoch; // set when put in pointlist::localEdges
   edge();
   void flip(pointlist *topopoints);
   void reverse();
@@ -32,8 +32,10 @@
 #include "color.h"
 #include "penwidth.h"
 #include "dxf.h"
+#include "threads.h"
 
 #define CACHEDRAW
+#define RENDER_POLL 20 // ms between checks for renderings done in the background
 
 using namespace std;
 
@@ -81,11 +83,15 @@ TopoCanvas::TopoCanvas(QWidget *parent):QWidget(parent)
   progressDialog->reset();
   ciDialog=new ContourIntervalDialog(this);
   timer=new QTimer(this);
+  renderTimer=new QTimer(this);
+  connect(renderTimer,SIGNAL(timeout()),this,SLOT(checkRenders()));
   plnum=-1;
   goal=DONE;
   rotation=0;
   tipXyz=false;
   showDelaunay=true;
+  nThreads=defaultThreads();
+  contourCache.setThreads(nThreads);
   allowFlip=true;
   //for (i=0;i<doc.pl[1].edges.size();i++)
     //doc.pl[1].edges[i].dump(&doc.pl[1]);
@@ -214,6 +220,14 @@ void TopoCanvas::setAllowFlip(bool allow)
   allowFlip=allow;
 }
 
+void TopoCanvas::setThreads(int n)
+{
+  if (n<1)
+    n=1;
+  nThreads=n;
+  contourCache.setThreads(n);
+}
+
 void TopoCanvas::setTipXyz(bool tipxyz)
 {
   tipXyz=tipxyz;
@@ -667,7 +681,7 @@ void TopoCanvas::flipPass()
   {
     try
     {
-      nFlip=doc.pl[plnum].flipPass(dummyPs,false);
+      nFlip=doc.pl[plnum].flipPass(dummyPs,false,nThreads);
       nGoodEdges=doc.pl[plnum].edges.size()-nFlip;
       progressDialog->setValue(nGoodEdges);
       ++passCount;
@@ -694,11 +708,11 @@ void TopoCanvas::redoSurface()
   //cout<<"redoSurface"<<endl;
   if (tinValid)
   {
-    doc.pl[plnum].makegrad(0.15);
+    doc.pl[plnum].makegrad(0.15,nThreads,GRAD_TOLERANCE);
     doc.pl[plnum].maketriangles();
-    doc.pl[plnum].setgradient(!trianglesShouldBeCurvy);
-    doc.pl[plnum].makeqindex();           // These five are all fast. It's finding the
-    doc.pl[plnum].findedgecriticalpts();  // critical points of a triangle that's slow.
+    doc.pl[plnum].setgradient(!trianglesShouldBeCurvy,nThreads);
+    doc.pl[plnum].makeqindex();                   // These five are all fast. It's finding the
+    doc.pl[plnum].findedgecriticalpts(nThreads);  // critical points of a triangle that's slow.
     trianglesAreCurvy=trianglesShouldBeCurvy;
   }
   progressDialog->setRange(0,doc.pl[plnum].triangles.size());
@@ -714,7 +728,11 @@ void TopoCanvas::redoSurface()
 }
 
 void TopoCanvas::findCriticalPoints()
+/* Each tick does a batch of triangles on nThreads threads, so that the
+ * progress bar moves and the window stays responsive.
+ */
 {
+  int batchEnd;
   //cout<<"findCriticalPoints"<<endl;
   if (tinerror)
   {
@@ -725,8 +743,11 @@ void TopoCanvas::findCriticalPoints()
   {
     try
     {
-      doc.pl[plnum].triangles[triCount].findcriticalpts();
-      doc.pl[plnum].triangles[triCount++].subdivide();
+      batchEnd=triCount+16*nThreads;
+      if (batchEnd>doc.pl[plnum].triangles.size())
+	batchEnd=doc.pl[plnum].triangles.size();
+      doc.pl[plnum].findtrianglecriticalpts(triCount,batchEnd,nThreads);
+      triCount=batchEnd;
       progressDialog->setValue(triCount);
       if (triCount==doc.pl[plnum].triangles.size())
       {
@@ -946,8 +967,8 @@ void TopoCanvas::loadGeoid()
       {
 	ifstream geofile(fileName,ios::binary);
 	ghead.readBinary(geofile);
+	cube.mapBinary(fileName,geofile.tellg());
 	cube.scale=pow(2,ghead.logScale);
-	cube.readBinary(geofile);
 	cout<<"read "<<fileName<<endl;
       }
       catch(BeziExcept e)
@@ -982,6 +1003,36 @@ void TopoCanvas::dump()
     cout<<doc.pl[i].crit.size()<<" criteria\n";
     cout<<doc.pl[i].type0Breaklines.size()<<" breaklines"<<endl;
   }
+  cout<<"Geoid leaf cache: "<<leafCacheHits<<" hits, "<<leafCacheMisses<<" misses"<<endl;
+  cout<<"Contour renderings: "<<contourCache.renderCount()<<" in background, "<<contourCache.queueDepth()<<" queued, latency "
+      <<contourCache.renderLatency()<<" ms mean, "<<contourCache.maxRenderLatency()<<" ms max, "<<contourCache.lastRenderLatency()<<" ms last"<<endl;
+}
+
+void TopoCanvas::checkRenders()
+// Called by renderTimer while contours are being rendered in the background.
+{
+  if (contourCache.collectFinished())
+    update();
+  if (!contourCache.pending())
+    renderTimer->stop();
+}
+
+void TopoCanvas::addEdgeLine(edge *e,QVector<QLineF> edgeLines[3])
+/* Adds the edge to the lines to be drawn with the normal, breakline, or flip
+ * pen, if it's longer than a pixel and crosses the view. The lines of each pen
+ * are drawn with one call.
+ */
+{
+  segment seg=e->getsegment();
+  int pen;
+  if (seg.length()>pixelScale() && fabs(pldist(worldCenter,seg.getstart(),seg.getend()))<viewableRadius())
+  {
+    if (!showDelaunay || e->delaunay())
+      pen=e->broken&1;
+    else
+      pen=2;
+    edgeLines[pen].append(QLineF(worldToWindow(seg.getstart()),worldToWindow(seg.getend())));
+  }
 }
 
 void TopoCanvas::paintEvent(QPaintEvent *event)
@@ -990,14 +1041,14 @@ void TopoCanvas::paintEvent(QPaintEvent *event)
   double r;
   bezier3d b3d;
   ptlist::iterator j;
-  set<edge *>::iterator e;
+  vector<edge *>::iterator e;
+  QVector<QLineF> edgeLines[3];
   RenderItem ri;
   QTime paintTime,subTime;
   QPen itemPen;
   QPainter painter(this);
   QPainterPath path;
   vector<xyz> beziseg;
-  segment seg;
   paintTime.start();
   painter.setBrush(brush);
   painter.setRenderHint(QPainter::Antialiasing,true);
@@ -1005,38 +1056,24 @@ void TopoCanvas::paintEvent(QPaintEvent *event)
   {
     doc.pl[plnum].setLocalSets(worldCenter,viewableRadius());
     if (doc.pl[plnum].triangles.size())
-      if (doc.pl[plnum].localEdges.count(nullptr))
-	for (i=0;plnum>=0 && i<doc.pl[plnum].edges.size();i++)
-	{
-	  seg=doc.pl[plnum].edges[i].getsegment();
-	  if (seg.length()>pixelScale() && fabs(pldist(worldCenter,seg.getstart(),seg.getend()))<viewableRadius())
-	  {
-	    if (!showDelaunay || doc.pl[plnum].edges[i].delaunay())
-	      if (doc.pl[plnum].edges[i].broken&1)
-		painter.setPen(breakEdgePen);
-	      else
-		painter.setPen(normalEdgePen);
-	    else
-	      painter.setPen(flipEdgePen);
-	    painter.drawLine(worldToWindow(seg.getstart()),worldToWindow(seg.getend()));
-	  }
-	}
+    {
+      if (doc.pl[plnum].localAll)
+      {
+	doc.pl[plnum].setEdgeLevels();
+	for (k=doc.pl[plnum].edgeLevel(pixelScale());k<doc.pl[plnum].edgeLevels.size();k++)
+	  for (i=0;i<doc.pl[plnum].edgeLevels[k].size();i++)
+	    addEdgeLine(doc.pl[plnum].edgeLevels[k][i],edgeLines);
+      }
       else
 	for (e=doc.pl[plnum].localEdges.begin();e!=doc.pl[plnum].localEdges.end();++e)
-	{
-	  seg=(*e)->getsegment();
-	  if (seg.length()>pixelScale() && fabs(pldist(worldCenter,seg.getstart(),seg.getend()))<viewableRadius())
-	  {
-	    if (!showDelaunay || (*e)->delaunay())
-	      if ((*e)->broken&1)
-		painter.setPen(breakEdgePen);
-	      else
-		painter.setPen(normalEdgePen);
-	    else
-	      painter.setPen(flipEdgePen);
-	    painter.drawLine(worldToWindow(seg.getstart()),worldToWindow(seg.getend()));
-	  }
-	}
+	  addEdgeLine(*e,edgeLines);
+      painter.setPen(normalEdgePen);
+      painter.drawLines(edgeLines[0]);
+      painter.setPen(breakEdgePen);
+      painter.drawLines(edgeLines[1]);
+      painter.setPen(flipEdgePen);
+      painter.drawLines(edgeLines[2]);
+    }
     else
       for (j=doc.pl[plnum].points.begin();j!=doc.pl[plnum].points.end();++j)
         for (i=0;i<3;i++)
@@ -1047,6 +1084,7 @@ void TopoCanvas::paintEvent(QPaintEvent *event)
           painter.drawEllipse(worldToWindow(j->second),r,r);
         }
 #ifdef CACHEDRAW
+    contourCache.collectFinished();
     contourCache.clearPresent();
     subTime.start();
     for (i=0;i<doc.pl[plnum].contours.size();i++)
@@ -1106,6 +1144,10 @@ void TopoCanvas::paintEvent(QPaintEvent *event)
   //cout<<"Painting took "<<paintTime.elapsed()<<" ms, rendering "<<renderTime<<", paths "<<pathTime<<", stroke "<<strokeTime<<endl;
   lastPaintTime=paintTime;
   lastPaintDuration=paintTime.elapsed();
+#ifdef CACHEDRAW
+  if (contourCache.pending() && !renderTimer->isActive())
+    renderTimer->start(RENDER_POLL);
+#endif
 }
 
 void TopoCanvas::setSize()
@@ -1214,6 +1256,7 @@ void TopoCanvas::mouseReleaseEvent(QMouseEvent *event)
         if (allowFlip && hitRec.edg && hitRec.edg->isFlippable() && mouseCheckImported())
         {
           hitRec.edg->flip(&doc.pl[plnum]);
+          doc.pl[plnum].localValid=doc.pl[plnum].edgeLevelsValid=false;
           updateEdgeNeighbors(hitRec.edg);
           roughContoursValid=false;
           surfaceValid=false;
@@ -69,6 +69,7 @@ public slots:
   void zoomp10();
   void setShowDelaunay(bool showd);
   void setAllowFlip(bool allow);
+  void setThreads(int n);
   void setTipXyz(bool tipxyz);
   void rotatecw();
   void rotateccw();
@@ -105,8 +106,10 @@ public slots:
   void smoothContoursFinish();
   void loadGeoid();
   void dump();
+  void checkRenders();
 protected:
   void setSize();
+  void addEdgeLine(edge *e,QVector<QLineF> edgeLines[3]);
   void paintEvent(QPaintEvent *event) Q_DECL_OVERRIDE;
   void resizeEvent(QResizeEvent *event) Q_DECL_OVERRIDE;
   void mousePressEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
@@ -127,6 +130,7 @@ private:
   QFileDialog *fileDialog;
   QProgressDialog *progressDialog;
   QTimer *timer;
+  QTimer *renderTimer; // polls contourCache while contours are rendered in the background
   ContourIntervalDialog *ciDialog;
   double conterval;
   xy windowCenter,worldCenter,dragStart;
@@ -155,6 +159,7 @@ private:
   bool contoursAreCurvy,contoursShouldBeCurvy;
   bool showDelaunay; // If true, edges change color and become dashed if not Delaunay.
   bool allowFlip; // If true, clicking on an edge toggles breakline or flips it.
+  int nThreads; // Number of threads used to make the TIN and surface.
   bool tipXyz;
   /* If true, tooltip shows xyz while cursor is in TIN.
    * If false, shows point numbers.